@@ -0,0 +1,323 @@
+#include "cfg.h"
+#include <algorithm>
+#include <set>
+
+using namespace std;
+
+/**
+ * Constructor, recovers the graph
+ *
+ * Every address reachable from pc 0 is explored once, to find the
+ * leaders: pc 0, the edge targets, and the instructions after a block
+ * ends. The jalr targets are then worked out from the blocks those
+ * leaders start, and any new ones are explored in turn, until no more
+ * turn up. Each leader then starts a block that runs up to the next
+ * leader or block ending instruction.
+ *
+ * Words in pages that were never touched are read as the 0xa5 fill,
+ * without touching them.
+ *
+ * @param mem The memory the program is loaded into
+ **************************************************************************/
+cfg::cfg(const memory &mem) : mem(mem)
+{
+	std::vector<bool> seen(mem.get_size() / 4);
+	std::set<uint32_t> leaders;
+	std::vector<uint32_t> work;
+	std::vector<edge> succs;
+
+	if(!valid(0))
+		return;
+
+	leaders.insert(0);
+	work.push_back(0);
+
+	while(!work.empty())
+	{
+		while(!work.empty())
+		{
+			uint32_t pc = work.back();
+			work.pop_back();
+
+			for(; valid(pc) && !seen[pc / 4]; pc += 4)
+			{
+				uint32_t insn = mem.peek32(pc);
+
+				seen[pc / 4] = true;
+				if(!ends_block(classify(insn)))
+					continue;
+
+				succs.clear();
+				successors(pc, insn, succs);
+				for(const edge &e : succs)
+				{
+					leaders.insert(e.to);
+					work.push_back(e.to);
+				}
+				break;
+			}
+		}
+
+		// A new target splits the block it lands in, so the targets
+		// are all worked out again with it as a leader
+		resolve_jalrs(leaders);
+		for(const auto &t : jalr_targets)
+		{
+			if(valid(t.second) && leaders.insert(t.second).second)
+				work.push_back(t.second);
+		}
+	}
+
+	for(uint32_t start : leaders)
+	{
+		block &b = blocks[start];
+		uint32_t pc = start;
+
+		b.start = start;
+		b.len = 1;
+		b.indirect = false;
+
+		for(;; pc += 4, b.len++)
+		{
+			uint32_t insn = mem.peek32(pc);
+			insn_id id = classify(insn);
+
+			if(ends_block(id))
+			{
+				b.indirect = id == id_jalr && !jalr_targets.count(pc);
+				successors(pc, insn, b.succs);
+				break;
+			}
+			if(!valid(pc + 4) || leaders.count(pc + 4))
+			{
+				if(valid(pc + 4))
+					b.succs.push_back({ pc + 4, edge_fall });
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Works out the jalr targets that are known
+ *
+ * Only the constants set in the jalr's own block are followed, from
+ * its leader on, so a target never depends on which way the block was
+ * reached.
+ *
+ * @param leaders The starts of the blocks
+ **************************************************************************/
+void cfg::resolve_jalrs(const std::set<uint32_t> &leaders)
+{
+	jalr_targets.clear();
+
+	for(uint32_t start : leaders)
+	{
+		constants c;
+
+		for(uint32_t pc = start; valid(pc); pc += 4)
+		{
+			uint32_t insn = mem.peek32(pc);
+			insn_id id = classify(insn);
+
+			if(ends_block(id))
+			{
+				uint32_t rs1 = get_rs1(insn);
+				if(id == id_jalr && (c.known & (1u << rs1)))
+					jalr_targets[pc] = (c.val[rs1] + get_imm_i(insn)) & ~1u;
+				break;
+			}
+			if(leaders.count(pc + 4))
+				break;
+			track(pc, insn, c);
+		}
+	}
+}
+
+/**
+ * Follows the registers set to constants by an instruction
+ *
+ * @param pc The address of the instruction
+ * @param insn The instruction, which does not end a block
+ * @param c The registers known before it, updated to after it
+ **************************************************************************/
+void cfg::track(uint32_t pc, uint32_t insn, constants &c)
+{
+	uint32_t rd = get_rd(insn);
+	uint32_t rs1 = get_rs1(insn);
+	uint32_t val;
+
+	switch(classify(insn))
+	{
+		case id_lui:
+			val = get_imm_u(insn);
+			break;
+
+		case id_auipc:
+			val = pc + get_imm_u(insn);
+			break;
+
+		case id_addi:
+			if(!(c.known & (1u << rs1)))
+			{
+				c.known &= ~(1u << rd) | 1;
+				return;
+			}
+			val = c.val[rs1] + get_imm_i(insn);
+			break;
+
+		default:
+			// Stores and branches have no rd, the rest are not
+			// followed
+			if(get_opcode(insn) != opcode_stype)
+				c.known &= ~(1u << rd) | 1;
+			return;
+	}
+
+	if(rd != 0)
+	{
+		c.known |= 1u << rd;
+		c.val[rd] = val;
+	}
+}
+
+/**
+ * Finds the edges out of a block ending instruction
+ *
+ * Targets that are misaligned or out of range would fault, and are left
+ * out.
+ *
+ * @param pc The address of the instruction
+ * @param insn The instruction
+ * @param succs Where to add the edges
+ **************************************************************************/
+void cfg::successors(uint32_t pc, uint32_t insn, std::vector<edge> &succs) const
+{
+	std::vector<edge> e;
+
+	switch(classify(insn))
+	{
+		default:
+			break;
+
+		case id_beq:
+		case id_bne:
+		case id_blt:
+		case id_bge:
+		case id_bltu:
+		case id_bgeu:
+			e.push_back({ pc + get_imm_b(insn), edge_taken });
+			e.push_back({ pc + 4, edge_fall });
+			break;
+
+		case id_jal:
+			e.push_back({ pc + get_imm_j(insn), edge_taken });
+			if(get_rd(insn))
+				e.push_back({ pc + 4, edge_return });
+			break;
+
+		case id_jalr:
+			if(jalr_targets.count(pc))
+				e.push_back({ jalr_targets.at(pc), edge_taken });
+			if(get_rd(insn))
+				e.push_back({ pc + 4, edge_return });
+			break;
+
+		case id_csrrs:
+			e.push_back({ pc + 4, edge_fall });
+			break;
+	}
+
+	for(const edge &i : e)
+		if(valid(i.to))
+			succs.push_back(i);
+}
+
+/**
+ * Finds the loop headers
+ *
+ * @return The start of each block with an edge back to it
+ **************************************************************************/
+std::vector<uint32_t> cfg::get_loops() const
+{
+	std::vector<uint32_t> loops;
+
+	for(const auto &b : blocks)
+		for(const edge &e : b.second.succs)
+			if(e.kind == edge_taken && e.to <= b.second.start + 4 * (b.second.len - 1))
+				loops.push_back(e.to);
+
+	std::sort(loops.begin(), loops.end());
+	loops.erase(std::unique(loops.begin(), loops.end()), loops.end());
+	return loops;
+}
+
+const char *cfg::kind_name(edge_kind k)
+{
+	switch(k)
+	{
+		case edge_taken:	return "taken";
+		case edge_fall:		return "fall";
+		default:		return "return";
+	}
+}
+
+/**
+ * Writes the graph in Graphviz DOT
+ *
+ * Each block is a node labelled with its disassembly.
+ *
+ * @param os The stream to write to
+ **************************************************************************/
+void cfg::write_dot(std::ostream &os) const
+{
+	os << "digraph cfg {" << endl;
+	os << "\tnode [shape=box, fontname=\"monospace\"];" << endl;
+
+	for(const auto &i : blocks)
+	{
+		const block &b = i.second;
+
+		os << "\tb" << to_hex32(b.start) << " [label=\"";
+		for(uint32_t pc = b.start; pc < b.start + 4 * b.len; pc += 4)
+			os << to_hex32(pc) << ": " << decode(pc, mem.peek32(pc)) << "\\l";
+		os << "\"];" << endl;
+
+		for(const edge &e : b.succs)
+			os << "\tb" << to_hex32(b.start) << " -> b" << to_hex32(e.to)
+				<< " [label=\"" << kind_name(e.kind) << "\"];" << endl;
+	}
+	os << "}" << endl;
+}
+
+/**
+ * Writes the graph as JSON
+ *
+ * @param os The stream to write to
+ **************************************************************************/
+void cfg::write_json(std::ostream &os) const
+{
+	os << "{\"blocks\": [";
+
+	const char *sep = "";
+	for(const auto &i : blocks)
+	{
+		const block &b = i.second;
+
+		os << sep << endl << "\t{\"start\": \"" << to_hex0x32(b.start)
+			<< "\", \"end\": \"" << to_hex0x32(b.start + 4 * (b.len - 1))
+			<< "\", \"insns\": " << b.len
+			<< ", \"indirect\": " << (b.indirect ? "true" : "false")
+			<< ", \"succs\": [";
+
+		const char *esep = "";
+		for(const edge &e : b.succs)
+		{
+			os << esep << "{\"to\": \"" << to_hex0x32(e.to) << "\", \"kind\": \"" << kind_name(e.kind) << "\"}";
+			esep = ", ";
+		}
+		os << "]}";
+		sep = ",";
+	}
+	os << endl << "]}" << endl;
+}
@@ -0,0 +1,86 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdint.h>
+#include <map>
+#include <ostream>
+#include <set>
+#include <vector>
+#include "hex.h"
+#include "memory.h"
+#include "rv32i_decode.h"
+
+// The control flow graph of the program in memory, recovered statically
+// by following jal, branch targets and fall through from pc 0.
+//
+// A block ends where the hart's basic blocks do, at a branch, jal, jalr,
+// ebreak, csrrs or illegal instruction, and also before any address that
+// something else jumps to. The target of a jalr is only known when its
+// base register was set by lui, auipc or addi earlier in the jalr's own
+// block, as in an auipc, jalr call. The instruction after a call, one
+// with an rd, is assumed to be returned to.
+class cfg : public rv32i_decode
+{
+	public:
+		enum edge_kind
+		{
+			edge_taken,		// a branch taken, or a jal
+			edge_fall,		// on to the next instruction
+			edge_return		// back from a call
+		};
+
+		struct edge
+		{
+			uint32_t to;
+			edge_kind kind;
+		};
+
+		struct block
+		{
+			uint32_t start;
+			uint32_t len;		// in instructions
+			bool indirect;		// ends in a jalr to somewhere unknown
+			std::vector<edge> succs;
+		};
+
+		cfg(const memory &mem);
+
+		const std::map<uint32_t, block> &get_blocks() const { return blocks; }
+
+		// The blocks that some edge goes back to, from the same
+		// address or a higher one. These are where the loops are.
+		std::vector<uint32_t> get_loops() const;
+
+		// Writes the graph as Graphviz DOT, with the disassembly of
+		// each block, or as JSON
+		void write_dot(std::ostream &os) const;
+		void write_json(std::ostream &os) const;
+
+	private:
+		// The registers whose values are known while following a run
+		// of instructions
+		struct constants
+		{
+			uint32_t known = { 1 };	// a bit for each, x0 always
+			uint32_t val[32] = { 0 };
+		};
+		static void track(uint32_t pc, uint32_t insn, constants &c);
+
+		// Fills in jalr_targets from the blocks that leaders start
+		void resolve_jalrs(const std::set<uint32_t> &leaders);
+
+		// The edges out of the instruction at pc, which ends a block
+		void successors(uint32_t pc, uint32_t insn, std::vector<edge> &succs) const;
+
+		bool valid(uint32_t addr) const { return (addr & 3) == 0 && mem.in_range(addr, 4); }
+
+		static const char *kind_name(edge_kind k);
+
+		const memory &mem;
+		std::map<uint32_t, block> blocks;
+
+		// The jalr targets worked out while exploring
+		std::map<uint32_t, uint32_t> jalr_targets;
+};
+
+#endif
@@ -0,0 +1,318 @@
+#include "cpu_multi_hart.h"
+#include <iostream>
+
+using namespace std;
+
+/**
+ * Constructor, makes the harts
+ *
+ * @param mem The memory shared by the harts
+ * @param harts The number of harts, at least 1
+ * @param stack_size The bytes of stack for each hart, 0 to split
+ *	memory evenly between them
+ **************************************************************************/
+cpu_multi_hart::cpu_multi_hart(memory &mem, unsigned harts, uint32_t stack_size) : mem(mem)
+{
+	if(stack_size == 0)
+		stack_size = (mem.get_size() / harts) & ~15u;
+	mem.set_shared(harts > 1);
+
+	for(unsigned i = 0; i < harts; i++)
+	{
+		this->harts.emplace_back(new smp_hart(mem, i, mem.get_size() - i * stack_size));
+		this->harts.back()->set_trace_header("[" + std::to_string(i) + "] ");
+		this->harts.back()->set_output_lock(&out_lock);
+	}
+}
+
+/**
+ * Runs every hart on a thread of its own, or takes turns
+ *
+ * The harts flush their traces, and memory its warnings, under one lock
+ * while they run on threads, so the lines of each flush stay whole.
+ * Once they have all finished, each hart's halt reason and instruction
+ * count is shown with its number in front, followed by the total.
+ *
+ * @param exec_limit The most instructions each hart may execute, 0 for
+ *	no limit
+ **************************************************************************/
+void cpu_multi_hart::run(uint64_t exec_limit)
+{
+	std::atomic<bool> stop(false);
+	round_barrier barrier(harts.size());
+	std::vector<std::thread> threads;
+
+	if(quantum && !parallel_quanta)
+		run_turns(exec_limit);
+	else
+	{
+		mem.set_output_lock(&out_lock);
+		for(auto &h : harts)
+		{
+			smp_hart *p = h.get();
+
+			if(quantum)
+				threads.emplace_back([p, exec_limit, this, &barrier] { p->run_quanta(exec_limit, quantum, barrier); });
+			else
+				threads.emplace_back([p, exec_limit, &stop] { p->run_thread(exec_limit, stop); });
+		}
+		for(std::thread &t : threads)
+			t.join();
+		mem.set_output_lock(nullptr);
+	}
+
+	for(const auto &h : harts)
+	{
+		if(h->is_halted())
+			*out << h->get_trace_header() << "Execution terminated. Reason: " << h->get_halt_reason() << std::endl;
+		*out << h->get_trace_header() << h->get_insn_counter() << " instructions executed" << std::endl;
+	}
+
+	*out << get_insn_counter() << " instructions executed" << std::endl;
+	mem.dump_faults();
+}
+
+/**
+ * Runs the harts a quantum at a time in hart order
+ *
+ * Everything runs on the calling thread, so each hart sees the stores of
+ * the ones before it straight away. The trace of each turn, along with
+ * its out of range warnings, is written out at the end of it, so that it
+ * comes out in the order it was run.
+ *
+ * @param exec_limit The most instructions each hart may execute, 0 for
+ *	no limit
+ **************************************************************************/
+void cpu_multi_hart::run_turns(uint64_t exec_limit)
+{
+	std::vector<bool> finished(harts.size());
+	unsigned left = harts.size();
+
+	for(auto &h : harts)
+		h->start();
+
+	while(left)
+	{
+		for(unsigned i = 0; i < harts.size() && left; i++)
+		{
+			if(finished[i])
+				continue;
+
+			harts[i]->take_warnings();
+			if(harts[i]->run_for(quantum, exec_limit))
+			{
+				finished[i] = true;
+				left--;
+			}
+			harts[i]->flush_trace();
+
+			if(harts[i]->is_crashed())
+				left = 0;
+		}
+	}
+	mem.set_warning_writer(nullptr);
+}
+
+/**
+ * Waits for the rest of the harts at the end of a quantum
+ *
+ * @param finished True if the calling hart has halted or reached the
+ *	limit
+ * @param crashed True if the calling hart has crashed
+ *
+ * @return True if the run is over, the same for every hart
+ **************************************************************************/
+bool cpu_multi_hart::round_barrier::wait(bool finished, bool crashed)
+{
+	std::unique_lock<std::mutex> l(lock);
+	uint64_t gen = generation;
+
+	this->finished += finished;
+	this->crashed |= crashed;
+
+	if(++arrived == n)
+	{
+		over = this->finished == n || this->crashed;
+		arrived = 0;
+		this->finished = 0;
+		generation++;
+		cv.notify_all();
+		return over;
+	}
+
+	// over is left alone until every hart is back for the next round
+	cv.wait(l, [this, gen] { return generation != gen; });
+	return over;
+}
+
+/**
+ * Dumps the registers of every hart
+ **************************************************************************/
+void cpu_multi_hart::dump() const
+{
+	for(const auto &h : harts)
+		h->dump(h->get_trace_header());
+}
+
+/**
+ * Sends the output of every hart to a stream
+ *
+ * @param os The stream to print to
+ **************************************************************************/
+void cpu_multi_hart::set_output(std::ostream *os)
+{
+	out = os;
+	for(auto &h : harts)
+		h->set_output(os);
+}
+
+/**
+ * Adds up the instructions executed
+ *
+ * @return The number executed by all of the harts together
+ **************************************************************************/
+uint64_t cpu_multi_hart::get_insn_counter() const
+{
+	uint64_t n = 0;
+
+	for(const auto &h : harts)
+		n += h->get_insn_counter();
+	return n;
+}
+
+/**
+ * Constructor, sets up a hart to start at pc 0
+ *
+ * @param mem The memory shared by the harts
+ * @param id Its mhartid
+ * @param sp Where its stack starts
+ **************************************************************************/
+cpu_multi_hart::smp_hart::smp_hart(memory &mem, uint32_t id, uint32_t sp) : cpu_single_hart(mem), stack_top(sp)
+{
+	set_mhartid(id);
+}
+
+/**
+ * Runs the hart on the calling thread
+ *
+ * The hart runs sync_insns instructions at a time, and takes in the
+ * stores made into its code by the others in between.
+ *
+ * @param exec_limit The most instructions to execute, 0 for no limit
+ * @param stop Set by any hart that crashes, to stop the others
+ **************************************************************************/
+void cpu_multi_hart::smp_hart::run_thread(uint64_t exec_limit, std::atomic<bool> &stop)
+{
+	start();
+
+	while(!stop.load(std::memory_order_relaxed) && !run_for(sync_insns, exec_limit))
+		sync();
+
+	if(is_crashed())
+		stop.store(true, std::memory_order_relaxed);
+	flush_trace();
+}
+
+/**
+ * Runs the hart a quantum at a time on the calling thread
+ *
+ * A hart that has finished still waits at the end of every quantum,
+ * until the others have finished too. Stores into its code made during
+ * a quantum are taken in before the next one.
+ *
+ * @param exec_limit The most instructions to execute, 0 for no limit
+ * @param quantum The instructions in each quantum
+ * @param barrier Where the harts wait for each other
+ **************************************************************************/
+void cpu_multi_hart::smp_hart::run_quanta(uint64_t exec_limit, uint64_t quantum, round_barrier &barrier)
+{
+	bool finished = false;
+
+	start();
+
+	for(;;)
+	{
+		if(!finished)
+			finished = run_for(quantum, exec_limit);
+
+		if(barrier.wait(finished, is_crashed()))
+			break;
+		sync();
+	}
+	flush_trace();
+}
+
+/**
+ * Makes the calling thread the hart's own
+ *
+ * Sets sp to the top of its stack, and drops any decodes stored into
+ * before now.
+ **************************************************************************/
+void cpu_multi_hart::smp_hart::start()
+{
+	owner.store(std::this_thread::get_id());
+	regs.set(2, stack_top);
+	sync();
+}
+
+/**
+ * Runs up to a number of instructions
+ *
+ * @param n The most instructions to run
+ * @param exec_limit The most instructions the hart may have executed in
+ *	all, 0 for no limit
+ *
+ * @return True if the hart has halted or reached exec_limit
+ **************************************************************************/
+bool cpu_multi_hart::smp_hart::run_for(uint64_t n, uint64_t exec_limit)
+{
+	uint64_t limit = get_insn_counter() + n;
+
+	if(exec_limit && limit > exec_limit)
+		limit = exec_limit;
+
+	run_until(limit);
+
+	return is_halted() || (exec_limit && get_insn_counter() >= exec_limit);
+}
+
+/**
+ * Drops the cached decodes of a store
+ *
+ * Stores made by the hart itself are dealt with straight away, those of
+ * the other harts wait for the hart to sync.
+ *
+ * @param addr The first address written
+ * @param len The number of bytes written
+ **************************************************************************/
+void cpu_multi_hart::smp_hart::code_modified(uint32_t addr, uint32_t len)
+{
+	if(std::this_thread::get_id() == owner.load())
+	{
+		cpu_single_hart::code_modified(addr, len);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(pending_lock);
+	pending.push_back({ addr, len });
+	has_pending.store(true, std::memory_order_release);
+}
+
+/**
+ * Drops the decodes that the other harts have stored into
+ **************************************************************************/
+void cpu_multi_hart::smp_hart::sync()
+{
+	if(!has_pending.load(std::memory_order_acquire))
+		return;
+
+	std::vector<range> ranges;
+	{
+		std::lock_guard<std::mutex> lock(pending_lock);
+		ranges.swap(pending);
+		has_pending.store(false, std::memory_order_relaxed);
+	}
+
+	for(const range &r : ranges)
+		cpu_single_hart::code_modified(r.addr, r.len);
+}
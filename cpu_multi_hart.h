@@ -0,0 +1,148 @@
+#ifndef CPU_MULTI_HART_H
+#define CPU_MULTI_HART_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "rv32i_hart.h"
+#include "cpu_single_hart.h"
+
+// Runs several harts over one shared memory, each on a host thread of
+// its own. Every hart starts at pc 0 with its mhartid set to its
+// number, and its own stack: hart n's sp starts n stacks down from the
+// end of memory, so hart 0 starts where cpu_single_hart would.
+//
+// Memory gives the harts whole aligned words, halfwords and bytes, see
+// memory.h. A store into code that another hart has cached is only seen
+// by that hart's instruction fetch the next time it syncs, every
+// sync_insns instructions, as if it had run a fence.i then.
+//
+// The run ends when every hart has halted or reached the limit. A hart
+// that crashes stops the others at their next sync.
+//
+// With a quantum, the harts are scheduled in quanta of instructions.
+// Either they take turns on one thread, each running a quantum in hart
+// order, or they all run a quantum at once on their own threads and
+// wait for each other at the end of it. Only the turns are reproducible
+// whatever the program does. Running at once is reproducible only for a
+// program without data races, where no hart reads memory that another
+// one writes during the same quantum. Stores into code are taken in at
+// the quantum boundaries.
+class cpu_multi_hart
+{
+	public:
+		static constexpr uint64_t sync_insns = 1 << 16;
+
+		// stack_size 0 splits memory evenly between the stacks
+		cpu_multi_hart(memory &mem, unsigned harts, uint32_t stack_size = 0);
+
+		unsigned size() const { return harts.size(); }
+		cpu_single_hart &hart(unsigned i) { return *harts[i]; }
+		const cpu_single_hart &hart(unsigned i) const { return *harts[i]; }
+
+		// Schedule the harts in quanta of n instructions, in turns or
+		// all at once. 0 lets them run freely.
+		void set_quantum(uint64_t n, bool parallel) { quantum = n; parallel_quanta = parallel; }
+
+		// Runs every hart for up to exec_limit instructions each, 0 for
+		// no limit, then shows why each one halted
+		void run(uint64_t exec_limit);
+
+		// Dumps the registers of each hart, labelled with its number
+		void dump() const;
+
+		// Where every hart prints, std::cout unless changed
+		void set_output(std::ostream *os);
+
+		uint64_t get_insn_counter() const;
+
+	private:
+		// Waits for every hart to finish a quantum. The last one to
+		// arrive decides for all of them whether the run is over.
+		class round_barrier
+		{
+			public:
+				round_barrier(unsigned n) : n(n) {}
+
+				// True once every hart is finished, or any one of
+				// them has crashed
+				bool wait(bool finished, bool crashed);
+
+			private:
+				std::mutex lock;
+				std::condition_variable cv;
+				unsigned n;
+				unsigned arrived = { 0 };
+				unsigned finished = { 0 };
+				bool crashed = { false };
+				uint64_t generation = { 0 };
+				bool over = { false };
+		};
+
+		// A hart that takes stores into its cached code from the other
+		// threads as pending until its next sync
+		class smp_hart : public cpu_single_hart
+		{
+			public:
+				smp_hart(memory &mem, uint32_t id, uint32_t sp);
+
+				// Makes the current thread the one the hart
+				// runs on, and sets up its stack
+				void start();
+
+				// Runs up to n more instructions, no further
+				// than exec_limit. True once the hart has halted
+				// or reached the limit.
+				bool run_for(uint64_t n, uint64_t exec_limit);
+
+				// Runs on the current thread until halted,
+				// stopped or at exec_limit
+				void run_thread(uint64_t exec_limit, std::atomic<bool> &stop);
+
+				// Runs a quantum at a time on the current thread,
+				// waiting for the other harts after each one
+				void run_quanta(uint64_t exec_limit, uint64_t quantum, round_barrier &barrier);
+
+				void code_modified(uint32_t addr, uint32_t len) override;
+
+				// Sends out of range warnings to the hart's trace,
+				// for while it has the only thread using memory
+				void take_warnings() { mem.set_warning_writer(&trace_out); }
+
+			private:
+				// Drops the decodes stored into by the other harts
+				void sync();
+
+				uint32_t stack_top;
+				// Set by start() on the hart's thread, read by
+				// the other harts' stores into code
+				std::atomic<std::thread::id> owner;
+
+				struct range
+				{
+					uint32_t addr;
+					uint32_t len;
+				};
+				std::mutex pending_lock;
+				std::vector<range> pending;
+				std::atomic<bool> has_pending = { false };
+		};
+
+		// Runs each hart's quantum in turn on the calling thread
+		void run_turns(uint64_t exec_limit);
+
+		memory &mem;
+		std::vector<std::unique_ptr<smp_hart>> harts;
+		std::ostream *out = { &std::cout };
+		// Taken by every hart and by memory to print to out while
+		// the harts run on threads of their own
+		std::mutex out_lock;
+		uint64_t quantum = { 0 };
+		bool parallel_quanta = { false };
+};
+
+#endif
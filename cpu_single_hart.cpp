@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "hex.h"
 #include "rv32i_decode.h"
 #include "registerfile.h"
@@ -6,13 +7,75 @@
 
 void cpu_single_hart::run(uint64_t exec_limit)
 {
-	regs.set(2, mem.get_size());
+	init_stack();
 
-	while( ( is_halted() != true && exec_limit == 0 ) || ( is_halted() != true && get_insn_counter() < exec_limit ) )
-		tick();
+	// Out of range warnings go out in line with the trace
+	mem.set_warning_writer(&trace_out);
+
+	run_until(exec_limit);
+
+	flush_trace();
+	mem.set_warning_writer(nullptr);
 
 	if(is_halted())
-		std::cout << "Execution terminated. Reason: " << get_halt_reason() << std::endl;
+		*out << "Execution terminated. Reason: " << get_halt_reason() << std::endl;
+
+	if(flight && is_crashed())
+	{
+		trace_writer w(out);
+
+		w.text("Last ").dec(flight->size()).text(" instructions:").end_line();
+		for(size_t i = 0; i < flight->size(); i++)
+			render_record(w, "", (*flight)[i]);
+	}
+
+	*out << get_insn_counter() <<  " instructions executed" << std::endl;
+	mem.dump_faults();
+}
+
+/**
+ * Runs the program without printing anything but the trace
+ *
+ * The faster engines are used for as long as nothing is being rendered
+ * and the recorder doesn't need tick(), and tick() for everything else.
+ *
+ * @param exec_limit The most instructions the hart may have executed,
+ *	0 for no limit
+ **************************************************************************/
+void cpu_single_hart::run_until(uint64_t exec_limit)
+{
+	// An unchecked load or store in tick() that faults lands back here
+	// to be finished with the range checks. Nothing that tick() is
+	// called with may need destroying, so the header is a member.
+	memory::fault_guard guard(mem);
+	if(sigsetjmp(guard.env, 0))
+		retry_access();
+
+	while( ( is_halted() != true && exec_limit == 0 ) || ( is_halted() != true && get_insn_counter() < exec_limit ) )
+	{
+		// The faster engines can only be used when nothing is being
+		// rendered, which includes the run up to a trace window, and
+		// the recorder can take records a block at a time. Whatever
+		// is left over when a block won't fit in the limit, or that
+		// can't be run from the decode cache, is done one tick() at a
+		// time.
+		uint64_t budget = is_recording_by_tick() ? 0 : untraced_budget();
+
+		if(exec_limit)
+			budget = std::min(budget, exec_limit - get_insn_counter());
+
+		if(exec_engine != engine_step && budget != 0)
+		{
+			uint64_t done;
+
+			if(exec_engine == engine_threaded)
+				done = run_threaded(budget);
+			else
+				done = run_blocks(budget);
 
-	std::cout << get_insn_counter() <<  " instructions executed" << std::endl;
+			if(done != 0)
+				continue;
+		}
+		tick(trace_hdr);
+	}
 }
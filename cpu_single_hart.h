@@ -4,8 +4,39 @@
 class cpu_single_hart : public rv32i_hart
 {
 	public:
+		// The ways the hart can be driven through the program
+		enum engine
+		{
+			engine_step,		// one tick() per instruction
+			engine_block,		// whole basic blocks at a time
+			engine_jit,		// basic blocks, hot ones as native code
+			engine_threaded		// direct-threaded handlers
+		};
+
 		cpu_single_hart(memory& mem) : rv32i_hart(mem) {}
+		void set_engine(engine e) { exec_engine = e; set_jit(e == engine_jit); }
 		void run(uint64_t exec_limit);		
+
+		// Points sp at the end of memory, where run() starts it
+		void init_stack() { regs.set(2, mem.get_size()); }
+
+		// Runs the program with the chosen engine until the hart halts
+		// or has executed exec_limit instructions in all, 0 for no
+		// limit. Nothing is printed apart from the trace.
+		void run_until(uint64_t exec_limit);
+
+		// Put in front of every line of -i and -r output
+		void set_trace_header(const std::string &h) { trace_hdr = h; }
+		const std::string &get_trace_header() const { return trace_hdr; }
+
+		// Record the last instructions into f, and show them if the
+		// hart crashes. Takes the place of any other recorder.
+		void set_flight_recorder(flight_recorder *f) { flight = f; set_recorder(f); }
+
+	private:
+		engine exec_engine = { engine_step };
+		flight_recorder *flight = { nullptr };
+		std::string trace_hdr;
 };
 
 
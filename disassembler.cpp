@@ -0,0 +1,159 @@
+#include "disassembler.h"
+#include <deque>
+#include <future>
+#include "hex.h"
+#include "rv32i_decode.h"
+
+using namespace std;
+
+constexpr uint32_t disassembler::slice_words;
+
+/**
+ * Prints the disassembly of every word in memory
+ *
+ * Each slice of words is formatted by a task of its own. At most twice
+ * as many as there are workers are in flight, and they are printed in
+ * the order they were started.
+ *
+ * @param os The stream to print to
+ * @param workers The number of threads, 0 to format everything inline
+ **************************************************************************/
+void disassembler::run(std::ostream &os, unsigned workers) const
+{
+	uint32_t words = mem.get_size() / 4;
+	std::string text;
+
+	if(workers == 0)
+	{
+		for(uint32_t i = 0; i < words; i += slice_words)
+		{
+			format(i, i + std::min(slice_words, words - i), text);
+			os.write(text.data(), text.size());
+		}
+		return;
+	}
+
+	std::deque<std::future<std::string>> slices;
+
+	for(uint32_t i = 0; i < words || !slices.empty(); )
+	{
+		if(i < words && slices.size() < 2 * workers)
+		{
+			uint32_t last = i + std::min(slice_words, words - i);
+
+			slices.push_back(std::async(std::launch::async, [this, i, last]
+			{
+				std::string s;
+				format(i, last, s);
+				return s;
+			}));
+			i = last;
+			continue;
+		}
+
+		text = slices.front().get();
+		slices.pop_front();
+		os.write(text.data(), text.size());
+	}
+}
+
+/**
+ * Formats a slice of the disassembly
+ *
+ * @param first The index of the first word
+ * @param last The index one past the last word
+ * @param text Where to put the text
+ **************************************************************************/
+void disassembler::format(uint32_t first, uint32_t last, std::string &text) const
+{
+	trace_writer out(nullptr, (last - first) * 64);
+
+	for(uint32_t i = first; i < last; )
+	{
+		uint32_t w = word(i);
+
+		// The run of identical words that i starts, or continues from
+		// the slice before, up to the end of the slice
+		uint32_t end = i + 1;
+		while(end < last && word(end) == w)
+			end++;
+
+		if(collapse)
+		{
+			uint32_t before = same_before(i);
+			uint32_t len = before + (end - i);
+
+			if(len < collapse_run && end == last)
+				len += same_after(end - 1);
+
+			// Only the first word of a long run is shown, and the
+			// second one as a *
+			if(len >= collapse_run)
+			{
+				uint32_t start = i - before;
+
+				if(start == i)
+					line(out, i, w);
+				if(start + 1 >= i && start + 1 < end)
+					out.text("*").end_line();
+				i = end;
+				continue;
+			}
+		}
+
+		for(; i < end; i++)
+			line(out, i, w);
+	}
+	out.drain(text);
+}
+
+/**
+ * Formats the disassembly of one word
+ *
+ * @param out Where to format it
+ * @param i The index of the word
+ * @param w The word
+ **************************************************************************/
+void disassembler::line(trace_writer &out, uint32_t i, uint32_t w)
+{
+	out.hex32(i * 4).text(": ").hex32(w).text("  ");
+	rv32i_decode::decode(out, i * 4, w);
+	out.end_line();
+}
+
+/**
+ * Counts the identical words just before a word
+ *
+ * @param i The index of the word
+ *
+ * @return The number of words before i that are the same as it, at most
+ *	collapse_run
+ **************************************************************************/
+uint32_t disassembler::same_before(uint32_t i) const
+{
+	uint32_t w = word(i);
+	uint32_t n = 0;
+
+	while(n < collapse_run && n < i && word(i - n - 1) == w)
+		n++;
+	return n;
+}
+
+/**
+ * Counts the identical words just after a word
+ *
+ * @param i The index of the word
+ *
+ * @return The number of words after i that are the same as it, at most
+ *	collapse_run
+ **************************************************************************/
+uint32_t disassembler::same_after(uint32_t i) const
+{
+	uint32_t w = word(i);
+	uint32_t words = mem.get_size() / 4;
+	uint32_t n = 0;
+
+	while(n < collapse_run && i + n + 1 < words && word(i + n + 1) == w)
+		n++;
+	return n;
+}
@@ -0,0 +1,47 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include "memory.h"
+#include "trace_writer.h"
+
+// Disassembles the whole of memory for -d. The words are split into
+// slices that are formatted on worker threads, each into a buffer of its
+// own, and printed in order.
+//
+// With collapse set, a run of at least collapse_run identical words is
+// shown as its first line followed by a "*" line, like hexdump does.
+// Whether a word is shown only depends on the words around it, so the
+// slices can be formatted independently.
+class disassembler
+{
+	public:
+		static constexpr uint32_t collapse_run = 4;
+
+		disassembler(const memory &mem, bool collapse) : mem(mem), collapse(collapse) {}
+
+		// Prints the disassembly to os, using up to workers threads,
+		// or none at all for 0
+		void run(std::ostream &os, unsigned workers) const;
+
+	private:
+		static constexpr uint32_t slice_words = 1 << 14;
+
+		// Formats the words from first up to, but not including, last
+		void format(uint32_t first, uint32_t last, std::string &text) const;
+		static void line(trace_writer &out, uint32_t i, uint32_t w);
+
+		// The number of words either side of i, at most collapse_run
+		// each way, that are the same as it
+		uint32_t same_before(uint32_t i) const;
+		uint32_t same_after(uint32_t i) const;
+
+		uint32_t word(uint32_t i) const { return mem.peek32(i * 4); }
+
+		const memory &mem;
+		bool collapse;
+};
+
+#endif
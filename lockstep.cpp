@@ -0,0 +1,273 @@
+#include "lockstep.h"
+#include <string.h>
+#include <thread>
+#include "hex.h"
+#include "rv32i_decode.h"
+
+using namespace std;
+
+/**
+ * Constructor
+ *
+ * @param infile The program to run
+ * @param mem_size The size of each memory
+ * @param e The engine to check
+ * @param interval The instructions between checkpoints
+ **************************************************************************/
+lockstep::lockstep(const std::string &infile, uint32_t mem_size, cpu_single_hart::engine e, uint64_t interval)
+	: infile(infile), mem_size(mem_size), engine(e), interval(interval ? interval : default_interval)
+{
+}
+
+const char *lockstep::engine_name(cpu_single_hart::engine e)
+{
+	switch(e)
+	{
+		case cpu_single_hart::engine_block:	return "block";
+		case cpu_single_hart::engine_jit:	return "jit";
+		case cpu_single_hart::engine_threaded:	return "threaded";
+		default:				return "step";
+	}
+}
+
+/**
+ * Runs the engine and the reference side by side
+ *
+ * The engine runs on a thread of its own, and the reference on the
+ * calling thread, which does the comparing.
+ *
+ * @param exec_limit The most instructions to run, 0 for no limit
+ * @param out Where to say how it went
+ *
+ * @return Whether the engine agreed with the reference throughout
+ **************************************************************************/
+lockstep::result lockstep::run(uint64_t exec_limit, std::ostream &out)
+{
+	std::unique_ptr<hart_run> ref = start(true, out);
+	std::unique_ptr<hart_run> eng;
+
+	insns = 0;
+	if(!ref || !(eng = start(false, out)))
+		return not_loaded;
+
+	produced = 0;
+	consumed = 0;
+	aborted = false;
+
+	std::thread t(&lockstep::produce, this, std::ref(*eng), exec_limit);
+	checkpoint mine;
+
+	for(uint64_t k = 1; ; k++)
+	{
+		ref->hart.run_until(target(k, exec_limit));
+		take(*ref, mine);
+
+		uint64_t n = consumed.load(std::memory_order_relaxed);
+		while(produced.load(std::memory_order_acquire) == n)
+			std::this_thread::yield();
+
+		if(!same(mine, ring[n % ring_size]))
+		{
+			aborted = true;
+			t.join();
+
+			// Each probe makes two more memories
+			ref.reset();
+			eng.reset();
+			insns = bisect(target(k - 1, exec_limit), target(k, exec_limit), exec_limit, out);
+			return differed;
+		}
+		consumed.store(n + 1, std::memory_order_release);
+		insns = mine.insns;
+
+		if(finished(mine, exec_limit))
+		{
+			t.join();
+			if(ref->hart.is_halted())
+				out << "Execution terminated. Reason: " << ref->hart.get_halt_reason() << endl;
+			out << "Lockstep: the " << engine_name(engine) << " engine agrees with the reference over "
+				<< mine.insns << " instructions, at " << k << " checkpoints" << endl;
+			return agreed;
+		}
+	}
+}
+
+/**
+ * Makes a hart ready to run the program
+ *
+ * Out of range warnings are left to be counted, the two harts would
+ * print them over each other.
+ *
+ * @param reference True for the reference, false for the engine
+ * @param out Where to say if the program can't be loaded
+ *
+ * @return The hart, or nullptr if the program can't be loaded
+ **************************************************************************/
+std::unique_ptr<lockstep::hart_run> lockstep::start(bool reference, std::ostream &out) const
+{
+	std::unique_ptr<hart_run> r(new hart_run(mem_size));
+
+	r->mem.set_output(&out);
+	if(!r->mem.load_file(infile))
+		return nullptr;
+
+	r->mem.set_warning_limit(0);
+	r->mem.set_store_digest(true);
+	r->hart.set_output(&out);
+	r->hart.set_halt_on_fault(halt_on_fault);
+	r->hart.set_uncached(reference);
+	r->hart.set_engine(reference ? cpu_single_hart::engine_step : engine);
+	r->hart.init_stack();
+	return r;
+}
+
+uint64_t lockstep::target(uint64_t k, uint64_t exec_limit) const
+{
+	uint64_t t = k * interval;
+
+	return exec_limit && t > exec_limit ? exec_limit : t;
+}
+
+void lockstep::take(const hart_run &r, checkpoint &c)
+{
+	c.insns = r.hart.get_insn_counter();
+	c.halted = r.hart.is_halted();
+	c.pc = r.hart.get_pc();
+	for(uint32_t i = 0; i < 32; i++)
+		c.regs[i] = r.hart.get_registers().get(i);
+	c.stores = r.mem.get_store_digest();
+}
+
+bool lockstep::same(const checkpoint &a, const checkpoint &b)
+{
+	return a.insns == b.insns && a.halted == b.halted && a.pc == b.pc
+		&& a.stores == b.stores && memcmp(a.regs, b.regs, sizeof(a.regs)) == 0;
+}
+
+bool lockstep::finished(const checkpoint &c, uint64_t exec_limit) const
+{
+	return c.halted || (exec_limit && c.insns >= exec_limit);
+}
+
+/**
+ * Runs the engine, handing over a checkpoint every interval
+ *
+ * The ring is single producer, single consumer. The engine waits when
+ * it is a whole ring ahead.
+ *
+ * @param r The engine's hart
+ * @param exec_limit The most instructions to run, 0 for no limit
+ **************************************************************************/
+void lockstep::produce(hart_run &r, uint64_t exec_limit)
+{
+	for(uint64_t k = 1; ; k++)
+	{
+		r.hart.run_until(target(k, exec_limit));
+
+		uint64_t n = produced.load(std::memory_order_relaxed);
+		while(n - consumed.load(std::memory_order_acquire) == ring_size)
+		{
+			if(aborted.load())
+				return;
+			std::this_thread::yield();
+		}
+
+		take(r, ring[n % ring_size]);
+		produced.store(n + 1, std::memory_order_release);
+
+		if(finished(ring[n % ring_size], exec_limit) || aborted.load())
+			return;
+	}
+}
+
+void lockstep::replay(hart_run &r, uint64_t insns, uint64_t exec_limit) const
+{
+	for(uint64_t k = 1; target(k, exec_limit) < insns; k++)
+		r.hart.run_until(target(k, exec_limit));
+	r.hart.run_until(insns);
+}
+
+/**
+ * Finds the first instruction after which the two differ
+ *
+ * Every probe runs both from the start again, so the engine goes through
+ * the same checkpoints, and with them the same blocks, as the first time
+ * round. The instruction is shown along with everything that differs
+ * after it.
+ *
+ * @param lo A count at which they agree
+ * @param hi A count at which they differ
+ * @param exec_limit The most instructions to run, 0 for no limit
+ * @param out Where to show it
+ *
+ * @return The instructions run before the first one that differs
+ **************************************************************************/
+uint64_t lockstep::bisect(uint64_t lo, uint64_t hi, uint64_t exec_limit, std::ostream &out) const
+{
+	checkpoint a, b;
+
+	while(hi - lo > 1)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		std::unique_ptr<hart_run> ref = start(true, out);
+		std::unique_ptr<hart_run> eng = start(false, out);
+
+		ref->hart.run_until(mid);
+		replay(*eng, mid, exec_limit);
+		take(*ref, a);
+		take(*eng, b);
+
+		if(same(a, b))
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	std::unique_ptr<hart_run> ref = start(true, out);
+	std::unique_ptr<hart_run> eng = start(false, out);
+	const char *name = engine_name(engine);
+
+	// Where the reference was just before it
+	ref->hart.run_until(hi - 1);
+	uint32_t pc = ref->hart.get_pc();
+
+	ref->hart.run_until(hi);
+	replay(*eng, hi, exec_limit);
+	take(*ref, a);
+	take(*eng, b);
+
+	out << "Lockstep: the " << name << " engine differs from the reference after instruction " << hi - 1
+		<< " (counted from 0)" << endl;
+	if((pc & 3) == 0 && ref->mem.in_range(pc, 4))
+		out << "  " << hex::to_hex32(pc) << ": " << rv32i_decode::decode(pc, ref->mem.peek32(pc)) << endl;
+	else
+		out << "  " << hex::to_hex32(pc) << ": (no instruction)" << endl;
+
+	if(a.insns != b.insns || a.halted != b.halted)
+	{
+		out << "  halted: reference " << (a.halted ? ref->hart.get_halt_reason() : "no") << " after " << a.insns
+			<< ", " << name << " " << (b.halted ? eng->hart.get_halt_reason() : "no") << " after " << b.insns << endl;
+	}
+	if(a.pc != b.pc)
+		out << "  pc: reference " << hex::to_hex32(a.pc) << ", " << name << " " << hex::to_hex32(b.pc) << endl;
+	for(uint32_t i = 0; i < 32; i++)
+	{
+		if(a.regs[i] != b.regs[i])
+			out << "  x" << i << ": reference " << hex::to_hex32(a.regs[i]) << ", " << name << " " << hex::to_hex32(b.regs[i]) << endl;
+	}
+	if(a.stores != b.stores)
+	{
+		uint32_t addr;
+
+		for(addr = 0; addr < mem_size && ref->mem.peek32(addr) == eng->mem.peek32(addr); addr += 4)
+			;
+
+		if(addr < mem_size)
+			out << "  stores: the word at " << hex::to_hex0x32(addr) << " is " << hex::to_hex32(ref->mem.peek32(addr))
+				<< " in the reference, " << hex::to_hex32(eng->mem.peek32(addr)) << " in " << name << endl;
+		else
+			out << "  stores: made differently, with the same memory left" << endl;
+	}
+
+	return hi - 1;
+}
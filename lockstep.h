@@ -0,0 +1,108 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+#include "memory.h"
+#include "rv32i_hart.h"
+#include "cpu_single_hart.h"
+
+// Checks one of the engines against the reference interpreter, which
+// fetches and decodes every instruction through rv32i_hart::exec().
+//
+// The two run side by side, each on a thread and memory of its own.
+// Every interval instructions the engine's thread hands a checkpoint of
+// its state to the reference's thread over a lock free ring: the
+// instructions run, the pc, the registers and a digest of every store
+// made so far. The reference compares its own state at the same count
+// against it. Once a checkpoint differs, both are run again from the
+// start, the engine stopping at the same checkpoints as before, to
+// bisect for the first instruction after which they differ.
+class lockstep
+{
+	public:
+		static constexpr uint64_t default_interval = 1 << 16;
+
+		lockstep(const std::string &infile, uint32_t mem_size, cpu_single_hart::engine e, uint64_t interval);
+
+		void set_halt_on_fault(bool b) { halt_on_fault = b; }
+
+		enum result
+		{
+			not_loaded,	// the program couldn't be loaded
+			agreed,
+			differed
+		};
+
+		// Runs both until they halt or reach exec_limit, 0 for no
+		// limit, and says whether they agreed
+		result run(uint64_t exec_limit, std::ostream &out);
+
+		// The instructions both ran and agreed on
+		uint64_t get_insn_counter() const { return insns; }
+
+		static const char *engine_name(cpu_single_hart::engine e);
+
+	private:
+		struct checkpoint
+		{
+			uint64_t insns;
+			bool halted;
+			uint32_t pc;
+			int32_t regs[32];
+			uint64_t stores;
+		};
+
+		// A hart with a memory of its own, loaded with the program
+		struct hart_run
+		{
+			hart_run(uint32_t mem_size) : mem(mem_size), hart(mem) {}
+
+			memory mem;
+			cpu_single_hart hart;
+		};
+
+		// Checkpoints in flight from the engine to the reference
+		static constexpr size_t ring_size = 64;
+
+		// Makes a hart ready to run, nullptr if the program can't be
+		// loaded
+		std::unique_ptr<hart_run> start(bool reference, std::ostream &out) const;
+
+		// The count the k'th checkpoint is taken at, counted from 1
+		uint64_t target(uint64_t k, uint64_t exec_limit) const;
+
+		static void take(const hart_run &r, checkpoint &c);
+		static bool same(const checkpoint &a, const checkpoint &b);
+		bool finished(const checkpoint &c, uint64_t exec_limit) const;
+
+		// Runs the engine on the calling thread, publishing a
+		// checkpoint each interval until it finishes or is aborted
+		void produce(hart_run &r, uint64_t exec_limit);
+
+		// Runs the engine, stopping at the same checkpoints, up to
+		// insns
+		void replay(hart_run &r, uint64_t insns, uint64_t exec_limit) const;
+
+		// Finds and shows the first instruction after which the two
+		// differ, somewhere after lo and no later than hi, and returns
+		// the instructions before it
+		uint64_t bisect(uint64_t lo, uint64_t hi, uint64_t exec_limit, std::ostream &out) const;
+
+		std::string infile;
+		uint32_t mem_size;
+		cpu_single_hart::engine engine;
+		uint64_t interval;
+		bool halt_on_fault = { false };
+		uint64_t insns = { 0 };
+
+		checkpoint ring[ring_size];
+		std::atomic<uint64_t> produced = { 0 };
+		std::atomic<uint64_t> consumed = { 0 };
+		std::atomic<bool> aborted = { false };
+};
+
+#endif
@@ -1,6 +1,13 @@
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <memory>
+#include <thread>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "hex.h"
@@ -8,110 +15,1032 @@
 #include "memory.h"
 #include "rv32i_hart.h"
 #include "cpu_single_hart.h"
+#include "cpu_multi_hart.h"
+#include "cfg.h"
+#include "lockstep.h"
+#include "profile_report.h"
+#include "disassembler.h"
+#include "trace_pipeline.h"
+#include "trace_recorder.h"
+#include "trace_replay.h"
+#include "regression.h"
+#include "work_pool.h"
 
 using namespace std;
 
+// Everything that one run of the simulator is told on its command line
+struct sim_options
+{
+    uint32_t memory_limit = 0x100;
+    uint64_t execution_limit = 0;
+    int cflag = 0;
+    int dflag = 0;
+    int fflag = 0;
+    int iflag = 0;
+    int pflag = 0;
+    int rflag = 0;
+    int sflag = 0;
+    int zflag = 0;
+    uint64_t warning_limit = UINT64_MAX;
+    uint64_t register_delta = 0;
+    std::string trace_name;
+    std::string cfg_name;
+    std::string batch_name;
+    std::string test_dir;
+    std::string engine_name;
+    rv32i_hart::trace_window window;
+    int workers = -1;
+    size_t flight_records = 0;
+    bool profile = false;
+    size_t profile_top = 0;
+    unsigned harts = 1;
+    uint32_t stack_size = 0;
+    uint64_t quantum = 0;
+    bool parallel_quanta = false;
+    cpu_single_hart::engine engine = cpu_single_hart::engine_step;
+    bool lockstep = false;
+    cpu_single_hart::engine lockstep_engine = cpu_single_hart::engine_step;
+    uint64_t lockstep_interval = 0;
+    std::string infile;
+};
+
+// How a run ended
+struct sim_result
+{
+    bool started = false;
+    bool halted = false;
+    std::string halt_reason;
+    uint64_t insns = 0;
+    bool diverged = false;
+};
+
+static void usage(std::ostream &os)
+{
+    os << "Usage: rv32i [-c] [-d] [-f] [-i] [-p] [-r] [-s] [-z] [-b batch-manifest] [-D engine[:interval]] [-e engine] [-F flight-records] [-g cfg-file] [-j workers] [-l exec-limit] [-m hex-mem-size] [-n harts] [-P hot-spots] [-q quantum] [-Q quantum] [-R full-dump-every] [-S hart-stack-size] [-t trace-file] [-T test-dir] [-w warning-limit] [-W trace-window] infile" << endl;
+    os << "    -b run each line of a manifest as a separate job, -j at a time, and summarize how they ended" << endl;
+    os << "       a line holds the options and infile of a job, and optionally > outfile for its output" << endl;
+    os << "    -c collapse runs of identical words in the -d disassembly to a * line" << endl;
+    os << "    -d show disassembly before program execution" << endl;
+    os << "    -D run engine against the reference interpreter on two threads, comparing them every interval" << endl;
+    os << "       instructions (default = " << lockstep::default_interval << "), and show the first instruction where they differ" << endl;
+    os << "    -e execution engine: step (default), block, jit or threaded" << endl;
+    os << "    -f halt with an access fault on an out of range load or store" << endl;
+    os << "    -F keep the last n instructions executed and show them if the hart crashes" << endl;
+    os << "    -g write the control flow graph found from pc 0 as DOT, or JSON for a .json file" << endl;
+    os << "    -i show instruction printing during execution" << endl;
+    os << "    -j number of threads formatting -d, -i and -r output (0 = none), or running -b jobs" << endl;
+    os << "    -l maximum number of instructions to exec" << endl;
+    os << "    -m specify memory size (default = 0x100)" << endl;
+    os << "    -n number of harts, each run on a thread of its own over the same memory (default = 1)" << endl;
+    os << "    -p decode the blocks of the control flow graph before execution" << endl;
+    os << "    -P count the instructions retired at each pc and show the mnemonics and the n hottest pcs and" << endl;
+    os << "       basic blocks after simulation (0 = all)" << endl;
+    os << "    -q with -n, run the harts in turns of this many instructions each, the same way every time" << endl;
+    os << "    -Q with -n, run the harts at once this many instructions at a time, waiting for each other in between," << endl;
+    os << "       the same way every time only if no hart reads memory that another writes in the same quantum" << endl;
+    os << "    -r show register printing during execution" << endl;
+    os << "    -R with -r, show only the pc and the registers written since the last dump, and all of them every n instructions" << endl;
+    os << "    -s skip never written memory pages in the -z dump" << endl;
+    os << "    -S bytes of stack for each hart with -n, below the end of memory (default = split evenly)" << endl;
+    os << "    -t write a binary trace of every instruction executed, for trace_render" << endl;
+    os << "    -T check the output of the ./rv32i commands in the README.md above test-dir against the files in it," << endl;
+    os << "       -j at a time, with -e or -p added to each of them if given" << endl;
+    os << "    -w maximum number of out of range warnings to print" << endl;
+    os << "    -W only show -i and -r output for instructions first:last (counted from 0)," << endl;
+    os << "       for pc=lo:hi, or for count instructions from the n'th run of pc with hit=pc:n[:count]" << endl;
+    os << "    -z show a dump of the regs & memory after simulation" << endl;
+}
+
 static void usage()
 {
-    cerr << "Usage: rv32i [-d] [-i] [-r] [-z] [-l exec-limit] [-m hex-mem-size] infile" << endl;
-    cerr << "    -d show disassembly before program execution" << endl;
-    cerr << "    -i show instruction printing during execution" << endl;
-    cerr << "    -l maximum number of instructions to exec" << endl;
-    cerr << "    -m specify memory size (default = 0x100)" << endl;
-    cerr << "    -r show register printing during execution" << endl;
-    cerr << "    -z show a dump of the regs & memory after simulation" << endl;
+    usage(cerr);
     exit(1);
 }
 
-static void disassemble(const memory &mem)
+/**
+ * Parses the name of an execution engine
+ *
+ * @param name step, block, jit or threaded
+ * @param e Where to put the engine
+ *
+ * @return False if name is not an engine
+ **************************************************************************/
+static bool parse_engine(const char *name, cpu_single_hart::engine &e)
+{
+    if(strcmp(name, "step") == 0)
+        e = cpu_single_hart::engine_step;
+    else if(strcmp(name, "block") == 0)
+        e = cpu_single_hart::engine_block;
+    else if(strcmp(name, "jit") == 0)
+        e = cpu_single_hart::engine_jit;
+    else if(strcmp(name, "threaded") == 0)
+        e = cpu_single_hart::engine_threaded;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Parses a -W trace window
+ *
+ * @param spec first:last, pc=lo:hi or hit=pc:n[:count]
+ * @param w Where to put the window
+ *
+ * @return False if spec is not a window
+ **************************************************************************/
+static bool parse_window(const char *spec, rv32i_hart::trace_window &w)
 {
-	// Initialize program counter and instruction
-	uint32_t pc = 0;
-	uint32_t insn = 0;
+	uint64_t v[3];
+	int n = 0;
 
-	while(pc < mem.get_size())
+	if(strncmp(spec, "pc=", 3) == 0)
 	{
-		cout << hex::to_hex32(pc) << ": ";
-		insn = mem.get32(pc);       
-		cout << hex::to_hex32(insn) << "  ";
-		cout << rv32i_decode::decode(pc, insn) << endl;
-		pc += 4;
-	}		
+		w.kind = rv32i_hart::trace_window::pcs;
+		spec += 3;
+	}
+	else if(strncmp(spec, "hit=", 4) == 0)
+	{
+		w.kind = rv32i_hart::trace_window::hit;
+		spec += 4;
+	}
+	else
+		w.kind = rv32i_hart::trace_window::insns;
+
+	for(;;)
+	{
+		char *end;
+
+		if(!isdigit((unsigned char)*spec))
+			return false;
+		v[n++] = strtoull(spec, &end, 0);
+		spec = end;
+
+		if(*spec == '\0')
+			break;
+		if(*spec != ':' || n == 3)
+			return false;
+		spec++;
+	}
+
+	switch(w.kind)
+	{
+		case rv32i_hart::trace_window::insns:
+			w.first = v[0];
+			w.last = v[1];
+			return n == 2 && w.first <= w.last;
+
+		case rv32i_hart::trace_window::pcs:
+			w.lo = v[0];
+			w.hi = v[1];
+			return n == 2 && w.lo <= w.hi;
+
+		default:
+			w.lo = v[0];
+			w.hits = v[1];
+			if(n == 3)
+				w.count = v[2];
+			return n >= 2 && w.hits != 0 && w.count != 0;
+	}
 }
 
-int main(int argc, char **argv)
+/**
+ * Parses the options and infile of a run
+ *
+ * @param argc The number of arguments, with the program name first
+ * @param argv The arguments
+ * @param o Where to put the options
+ * @param err Where to say what is wrong with an option, the way
+ *	getopt() would have
+ *
+ * @return False if they are not valid
+ **************************************************************************/
+static bool parse_options(int argc, char **argv, sim_options &o, std::ostream &err)
 {
-    uint32_t memory_limit = 0x100; 
     int opt;
-    int execution_limit = 0;
-    int dflag = 0;
-    int iflag = 0;
-    int rflag = 0;
-    int zflag = 0;
 
-    while((opt = getopt(argc, argv, "m:l:dirz")) != -1)
+    // Starts getopt() over from the beginning, for each batch job, and
+    // leaves the messages to us
+    optind = 0;
+    opterr = 0;
+
+    try
     {
-        switch(opt)
+        while((opt = getopt(argc, argv, ":b:D:m:l:e:F:g:j:n:P:q:Q:R:S:t:T:w:W:cdfiprsz")) != -1)
         {
-            case 'm':
-                memory_limit = stoul(optarg, nullptr, 16);
-                break;
+            switch(opt)
+            {
+                case 'b':
+                    o.batch_name = optarg;
+                    break;
 
-            case 'd':
-                dflag = 1;
-                break;
+                case 'm':
+                    o.memory_limit = stoul(optarg, nullptr, 16);
+                    break;
 
-            case 'i':
-                iflag = 1;
-		        break;
+                case 'c':
+                    o.cflag = 1;
+                    break;
 
-            case 'r':
-                rflag = 1;
-                break;
+                case 'd':
+                    o.dflag = 1;
+                    break;
 
-            case 'z':
-                zflag = 1;
-                break;
+                case 'f':
+                    o.fflag = 1;
+                    break;
 
-            case 'l':
-                execution_limit = std::stoul(optarg, nullptr, 0);
-                break;
+                case 'i':
+                    o.iflag = 1;
+                    break;
+
+                case 'p':
+                    o.pflag = 1;
+                    break;
+
+                case 'r':
+                    o.rflag = 1;
+                    break;
+
+                case 's':
+                    o.sflag = 1;
+                    break;
+
+                case 'z':
+                    o.zflag = 1;
+                    break;
+
+                case 'F':
+                    o.flight_records = std::stoull(optarg, nullptr, 0);
+                    if(o.flight_records == 0)
+                        return false;
+                    break;
+
+                case 'g':
+                    o.cfg_name = optarg;
+                    break;
+
+                case 'j':
+                    o.workers = std::stoi(optarg, nullptr, 0);
+                    break;
+
+                case 'l':
+                    o.execution_limit = std::stoul(optarg, nullptr, 0);
+                    break;
+
+                case 'n':
+                    o.harts = std::stoul(optarg, nullptr, 0);
+                    if(o.harts == 0)
+                        return false;
+                    break;
+
+                case 'P':
+                    o.profile_top = std::stoull(optarg, nullptr, 0);
+                    o.profile = true;
+                    break;
+
+                case 'q':
+                case 'Q':
+                    o.quantum = std::stoull(optarg, nullptr, 0);
+                    o.parallel_quanta = opt == 'Q';
+                    if(o.quantum == 0)
+                        return false;
+                    break;
+
+                case 'R':
+                    o.register_delta = std::stoull(optarg, nullptr, 0);
+                    break;
+
+                case 'S':
+                    o.stack_size = std::stoul(optarg, nullptr, 0);
+                    break;
 
-            default:
-                usage();
+                case 't':
+                    o.trace_name = optarg;
+                    break;
+
+                case 'T':
+                    o.test_dir = optarg;
+                    break;
+
+                case 'w':
+                    o.warning_limit = std::stoull(optarg, nullptr, 0);
+                    break;
+
+                case 'W':
+                    if(!parse_window(optarg, o.window))
+                        return false;
+                    break;
+
+                case 'e':
+                    o.engine_name = optarg;
+                    if(!parse_engine(optarg, o.engine))
+                        return false;
+                    break;
+
+                case 'D':
+                {
+                    std::string spec = optarg;
+                    size_t colon = spec.find(':');
+
+                    if(colon != std::string::npos)
+                    {
+                        o.lockstep_interval = std::stoull(spec.substr(colon + 1), nullptr, 0);
+                        if(o.lockstep_interval == 0)
+                            return false;
+                        spec.erase(colon);
+                    }
+                    if(!parse_engine(spec.c_str(), o.lockstep_engine))
+                        return false;
+                    o.lockstep = true;
+                    break;
+                }
+
+                case ':':
+                    err << argv[0] << ": option requires an argument -- '" << (char)optopt << "'" << endl;
+                    return false;
+
+                default:
+                    err << argv[0] << ": invalid option -- '" << (char)optopt << "'" << endl;
+                    return false;
+            }
         }
     }
+    catch(const std::logic_error &)
+    {
+        // A number that stoul() and friends can't make sense of
+        return false;
+    }
+
+    // Lockstep runs the program its own way, with nothing to show but
+    // where the engine and the reference part
+    if(o.lockstep && (o.dflag || o.iflag || o.pflag || o.rflag || o.zflag || o.profile || o.flight_records || o.harts != 1
+        || o.quantum || !o.trace_name.empty() || !o.cfg_name.empty() || !o.engine_name.empty() || o.window.kind != rv32i_hart::trace_window::all))
+    {
+        err << argv[0] << ": -D can't be used with -d, -e, -F, -g, -i, -n, -p, -P, -q, -Q, -r, -t, -W or -z" << endl;
+        return false;
+    }
+
+    // Each hart renders its own -i and -r output. A binary trace,
+    // flight recorder or profile only follows a single hart.
+    if(o.harts > 1 && (o.flight_records || o.profile || !o.trace_name.empty()))
+    {
+        err << argv[0] << ": -n can't be used with -F, -P or -t" << endl;
+        return false;
+    }
+
+    // Memory is rounded up the way the memory constructor does it
+    uint32_t memory_size = (o.memory_limit + 15) & 0xfffffff0;
+    if(o.harts > 1 && (uint64_t)o.harts * o.stack_size > memory_size)
+    {
+        err << argv[0] << ": -n " << o.harts << " stacks of -S " << hex::to_hex0x32(o.stack_size) << " bytes don't fit in the "
+            << hex::to_hex0x32(memory_size) << " bytes of -m" << endl;
+        return false;
+    }
+
+    if(!o.batch_name.empty() || !o.test_dir.empty())
+        return optind == argc;
 
     if(optind >= argc)
-        usage();
+        return false;
+    o.infile = argv[optind];
+    return true;
+}
+
+/**
+ * Runs the simulator
+ *
+ * @param o The options and infile
+ * @param out Where the disassembly, trace, results and dumps are printed
+ * @param r How the run ended
+ *
+ * @return False if the run could not be set up, after saying why
+ **************************************************************************/
+static bool simulate(const sim_options &o, std::ostream &out, sim_result &r)
+{
+    if(o.lockstep)
+    {
+        // The two harts each load the program into a memory of their
+        // own
+        lockstep check(o.infile, o.memory_limit, o.lockstep_engine, o.lockstep_interval);
 
-    memory mem(memory_limit);
+        check.set_halt_on_fault(o.fflag == 1);
+        lockstep::result result = check.run(o.execution_limit, out);
+        if(result == lockstep::not_loaded)
+            return false;
 
-    if(!mem.load_file(argv[optind]))
-        usage();
+        r.started = true;
+        r.diverged = result == lockstep::differed;
+        r.insns = check.get_insn_counter();
+        r.halted = true;
+        r.halt_reason = r.diverged ? "differs from the reference" : "agrees with the reference";
+        return true;
+    }
+
+    memory mem(o.memory_limit);
+    mem.set_warning_limit(o.warning_limit);
+    mem.set_output(&out);
+
+    if(!mem.load_file(o.infile))
+        return false;
 
-    rv32i_hart sim(mem);
     cpu_single_hart cpu(mem);
+    cpu.set_output(&out);
+
+    // By default there is a worker thread for each of the other CPUs,
+    // and never more than 8 since each -i or -r one needs a memory of
+    // its own
+    int workers = o.workers;
+    if(workers < 0)
+        workers = (int)std::thread::hardware_concurrency() - 1;
+    workers = std::max(0, std::min(workers, 8));
+
+    if(o.dflag == 1)
+        disassembler(mem, o.cflag == 1).run(out, workers);
 
-    if(dflag == 1)
+    // The blocks that -p decodes ahead of time
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> loops;
+
+    if(!o.cfg_name.empty() || o.pflag == 1)
     {
-        disassemble(mem);
-        sim.reset(); //TODO TEST THIS WITH cpu.reset();
+        cfg graph(mem);
+
+        if(!o.cfg_name.empty())
+        {
+            std::ofstream cfg_file(o.cfg_name);
+            const std::string &name = o.cfg_name;
+
+            if(!cfg_file)
+            {
+                cerr << "Can't open file " << name << " for writing" << endl;
+                return false;
+            }
+            if(name.size() >= 5 && name.compare(name.size() - 5, 5, ".json") == 0)
+                graph.write_json(cfg_file);
+            else
+                graph.write_dot(cfg_file);
+        }
+
+        if(o.pflag == 1)
+        {
+            for(const auto &b : graph.get_blocks())
+                starts.push_back(b.first);
+            loops = graph.get_loops();
+        }
     }
 
-    if(iflag == 1)
-        cpu.set_show_instructions(true);
+    if(o.harts > 1)
+    {
+        cpu_multi_hart smp(mem, o.harts, o.stack_size);
+
+        smp.set_output(&out);
+        smp.set_quantum(o.quantum, o.parallel_quanta);
 
-    if(rflag == 1)
-        cpu.set_show_registers(true);
+        for(unsigned i = 0; i < smp.size(); i++)
+        {
+            cpu_single_hart &h = smp.hart(i);
 
-    cpu.run(execution_limit);
+            h.set_halt_on_fault(o.fflag == 1);
+            h.set_engine(o.engine);
+            if(o.pflag == 1)
+                h.preload(starts, loops);
+            h.set_register_delta(o.register_delta);
+            h.set_trace_window(o.window);
+            h.set_show_instructions(o.iflag == 1);
+            h.set_show_registers(o.rflag == 1);
+        }
 
-    if(zflag == 1)
+        smp.run(o.execution_limit);
+
+        if(o.zflag == 1)
+        {
+            smp.dump();
+            mem.dump(o.sflag == 1);
+        }
+
+        // Hart 0 stands for the rest
+        r.started = true;
+        r.halted = smp.hart(0).is_halted();
+        r.halt_reason = smp.hart(0).get_halt_reason();
+        r.insns = smp.get_insn_counter();
+        return true;
+    }
+
+    if(o.fflag == 1)
+        cpu.set_halt_on_fault(true);
+
+    cpu.set_engine(o.engine);
+    cpu.set_register_delta(o.register_delta);
+    cpu.set_trace_window(o.window);
+    cpu.set_profile(o.profile);
+
+    // The recorder is destroyed first, and flushes, before the file is
+    // closed
+    std::ofstream trace_file;
+    std::unique_ptr<trace_recorder> recorder;
+
+    if(!o.trace_name.empty())
+    {
+        trace_file.open(o.trace_name, std::ios::binary);
+        if(!trace_file)
+        {
+            cerr << "Can't open file " << o.trace_name << " for writing" << endl;
+            return false;
+        }
+        recorder.reset(new trace_recorder(trace_file, mem.get_size(), cpu.get_mhartid()));
+        cpu.set_recorder(recorder.get());
+    }
+
+    // A binary trace already has everything a flight recorder would
+    std::unique_ptr<flight_recorder> flight;
+
+    if(o.flight_records && !recorder)
+    {
+        flight.reset(new flight_recorder(o.flight_records));
+        cpu.set_flight_recorder(flight.get());
+    }
+
+    // Unless a binary trace is being written, the workers format -i and
+    // -r output while the hart runs. What is shown in a trace window is
+    // rendered by the hart, so that it can run at full speed up to the
+    // window.
+
+    if((o.iflag == 1 || o.rflag == 1) && !recorder && !flight && !cpu.has_trace_window() && workers > 0)
+    {
+        recorder.reset(new trace_pipeline(cpu, mem, workers, o.iflag == 1, o.rflag == 1));
+        cpu.set_recorder(recorder.get());
+    }
+    else
+    {
+        cpu.set_show_instructions(o.iflag == 1);
+        cpu.set_show_registers(o.rflag == 1);
+    }
+
+    // After the recorder is set, blocks are translated to suit it
+    if(o.pflag == 1)
+        cpu.preload(starts, loops);
+
+    cpu.run(o.execution_limit);
+
+    if(o.profile)
+        profile_report(mem, cpu).write(out, o.profile_top);
+
+    if(o.zflag == 1)
     {
         cpu.dump();
-        mem.dump();
+        mem.dump(o.sflag == 1);
+    }
+
+    r.started = true;
+    r.halted = cpu.is_halted();
+    r.halt_reason = cpu.get_halt_reason();
+    r.insns = cpu.get_insn_counter();
+    return true;
+}
+
+/**
+ * Runs the jobs of a -b manifest
+ *
+ * Each line that isn't blank or a # comment holds the options and infile
+ * of one job, as they would be given to rv32i, and can end with
+ * > outfile to write the job's output there. Each job has a memory and
+ * hart of its own. The jobs are run -j at a time, -d, -i and -r output
+ * is formatted by the job itself. The output of the jobs that have no
+ * outfile is printed in the order of the manifest once they have all
+ * finished, each headed by its line, followed by a summary of every job.
+ *
+ * @param batch The options that -b was given with
+ * @param out Where to print the output of the jobs and the summary
+ * @param base The directory, with its slash, that the relative infiles
+ *	and outfiles of the jobs are in, "" for the current one
+ *
+ * @return The exit status, 1 if any job could not be run
+ **************************************************************************/
+static int run_batch(const sim_options &batch, std::ostream &out, const std::string &base = "")
+{
+    struct job
+    {
+        std::string line;
+        std::string outfile;
+        sim_options o;
+        bool valid;
+        std::string text;
+        sim_result r;
+    };
+    std::vector<job> jobs;
+    std::ifstream manifest(batch.batch_name);
+    std::string line;
+
+    if(!manifest)
+    {
+        cerr << "Can't open file " << batch.batch_name << " for reading" << endl;
+        usage(cerr);
+        return 1;
+    }
+
+    while(std::getline(manifest, line))
+    {
+        std::istringstream words(line);
+        std::vector<std::string> args = { "rv32i" };
+        std::string w;
+        job j;
+
+        while(words >> w)
+        {
+            if(w[0] == '#')
+                break;
+            args.push_back(w);
+        }
+        if(args.size() == 1)
+            continue;
+
+        if(args.size() >= 3 && args[args.size() - 2] == ">")
+        {
+            j.outfile = args.back();
+            args.resize(args.size() - 2);
+        }
+
+        std::vector<char*> argv;
+        for(std::string &a : args)
+            argv.push_back(&a[0]);
+        argv.push_back(nullptr);
+
+        j.line = line;
+        j.valid = parse_options(argv.size() - 1, argv.data(), j.o, cerr) && j.o.batch_name.empty() && j.o.test_dir.empty();
+        j.o.workers = 0;
+        if(!j.o.infile.empty() && j.o.infile[0] != '/')
+            j.o.infile = base + j.o.infile;
+        if(!j.outfile.empty() && j.outfile[0] != '/')
+            j.outfile = base + j.outfile;
+        jobs.push_back(j);
+    }
+
+    unsigned threads = batch.workers > 0 ? batch.workers : std::thread::hardware_concurrency();
+
+    work_pool(threads).run(jobs.size(), [&jobs](size_t i)
+    {
+        job &j = jobs[i];
+
+        if(!j.valid)
+            return;
+
+        try
+        {
+            if(!j.outfile.empty())
+            {
+                std::ofstream f(j.outfile);
+                if(!f)
+                    cerr << "Can't open file " << j.outfile << " for writing" << endl;
+                else
+                    simulate(j.o, f, j.r);
+            }
+            else
+            {
+                std::ostringstream s;
+                simulate(j.o, s, j.r);
+                j.text = s.str();
+            }
+        }
+        catch(const std::exception &e)
+        {
+            cerr << j.line << ": " << e.what() << endl;
+        }
+    });
+
+    int status = 0;
+
+    for(const job &j : jobs)
+    {
+        if(j.outfile.empty() && j.valid)
+            out << "==> " << j.line << " <==" << endl << j.text;
+    }
+
+    // The reason column is as wide as the longest of them
+    std::vector<std::string> reasons;
+    size_t width = strlen("Halt reason");
+
+    for(const job &j : jobs)
+    {
+        reasons.push_back(!j.valid ? "bad options" : !j.r.started ? "not run" : j.r.halted ? j.r.halt_reason : "exec limit");
+        width = std::max(width, reasons.back().size());
     }
 
-    return 0;
+    out << "Job   Instructions  " << std::setw(width) << std::left << "Halt reason" << "  Command" << std::right << endl;
+    for(size_t i = 0; i < jobs.size(); i++)
+    {
+        const job &j = jobs[i];
+
+        out << std::setw(5) << std::left << i << " " << std::setw(13) << std::right << j.r.insns
+            << "  " << std::setw(width) << std::left << reasons[i] << "  " << j.line << std::right << endl;
+
+        if(!j.r.started)
+            status = 1;
+    }
+    return status;
+}
+
+/**
+ * Makes an empty temporary file
+ *
+ * @param name What to end the file's name with, so that it keeps its
+ *	extension
+ *
+ * @return The path of the file, or "" if it couldn't be made
+ **************************************************************************/
+static std::string temp_file(const std::string &name)
+{
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/rv32i-XXXXXX-" + name;
+    int fd = mkstemps(&path[0], name.size() + 1);
+
+    if(fd < 0)
+        return "";
+    close(fd);
+    return path;
+}
+
+/**
+ * Checks the simulator against the golden files of the README commands
+ *
+ * The commands are read from the README.md in the directory above the
+ * test directory, so they are always the ones the README shows. Every
+ * command is run in this process, -j at a time, and its output is
+ * compared with the golden file as it is written. A command that fails
+ * is shown with its first differing line and the lines leading up to it.
+ *
+ * The files a command writes, and the traces it writes for trace_render,
+ * go to temporary files that are checked or rendered once it is done.
+ * A -D command runs the engines it names, without -e or -p. The jobs of
+ * a -b manifest name their infiles from the README's directory, like the
+ * README commands do.
+ *
+ * @param test The options that -T was given with
+ *
+ * @return The exit status, 1 if any of them failed
+ **************************************************************************/
+static int run_regression(const sim_options &test)
+{
+    // A golden file, and what is compared with it as it is written
+    struct golden_file
+    {
+        std::string name;
+        std::vector<std::string> expected;
+        bool found;
+        std::unique_ptr<golden_compare> cmp;
+    };
+    struct check
+    {
+        const regression_case *c;
+        std::string command;
+        sim_options o;
+        bool valid;
+        std::string parse_err;
+        render_options render;
+
+        // Where the files named in c->outputs are written instead, and
+        // the trace that is rendered
+        std::vector<std::string> temps;
+        std::string trace_temp;
+
+        // The output of the command, or of trace_render, first, then
+        // the files it writes
+        std::vector<golden_file> goldens;
+    };
+    std::vector<regression_case> cases;
+    std::string dir = test.test_dir;
+
+    while(dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+
+    size_t slash = dir.rfind('/');
+    std::string readme_dir = slash == std::string::npos ? "" : dir.substr(0, slash + 1);
+    std::string readme_name = readme_dir + "README.md";
+    std::ifstream readme(readme_name);
+    std::string bad;
+
+    if(!readme)
+    {
+        cerr << "Can't open file " << readme_name << " for reading" << endl;
+        return 1;
+    }
+    if(!read_regression_cases(readme, cases, bad))
+    {
+        cerr << readme_name << ": can't make out the command " << bad << endl;
+        return 1;
+    }
+    if(cases.empty())
+    {
+        cerr << readme_name << ": there are no ./rv32i commands to check" << endl;
+        return 1;
+    }
+
+    std::vector<check> checks(cases.size());
+
+    // getopt() isn't thread safe, so everything is parsed up front
+    for(size_t i = 0; i < checks.size(); i++)
+    {
+        check &k = checks[i];
+        const regression_case &c = cases[i];
+        std::istringstream words(c.args);
+        std::vector<std::string> args = { "./rv32i" };
+        std::ostringstream err;
+        std::string w;
+
+        k.c = &c;
+        k.command = c.args;
+        if(!c.rendered.empty())
+            k.command += " && trace_render " + (c.render_args.empty() ? "" : c.render_args + " ") + c.rendered;
+
+        k.goldens.resize(1 + c.outputs.size());
+        for(size_t j = 0; j < k.goldens.size(); j++)
+        {
+            golden_file &g = k.goldens[j];
+
+            g.name = j == 0 ? c.golden : c.outputs[j - 1];
+            std::ifstream golden(dir + "/" + g.name);
+            g.found = (bool)golden;
+            while(std::getline(golden, w))
+                g.expected.push_back(w);
+            if(j == 0)
+                g.cmp.reset(new golden_compare(g.expected, c.head, c.grep));
+            else
+                g.cmp.reset(new golden_compare(g.expected));
+        }
+
+        for(const std::string &name : c.outputs)
+            k.temps.push_back(temp_file(name));
+        if(!c.rendered.empty())
+            k.trace_temp = temp_file(c.rendered);
+        if(std::find(k.temps.begin(), k.temps.end(), "") != k.temps.end() || (!c.rendered.empty() && k.trace_temp.empty()))
+        {
+            cerr << "Can't make a temporary file for " << c.args << endl;
+            return 1;
+        }
+
+        if(c.args.compare(0, 2, "-D") != 0 && c.args.find(" -D") == std::string::npos)
+        {
+            if(!test.engine_name.empty())
+            {
+                args.push_back("-e");
+                args.push_back(test.engine_name);
+            }
+            if(test.pflag == 1)
+                args.push_back("-p");
+        }
+        while(words >> w)
+        {
+            auto out = std::find(c.outputs.begin(), c.outputs.end(), w);
+
+            if(out != c.outputs.end())
+                w = k.temps[out - c.outputs.begin()];
+            else if(w == c.rendered)
+                w = k.trace_temp;
+            args.push_back(w);
+        }
+        args.back() = dir + "/" + args.back();
+
+        std::vector<char*> argv;
+        for(std::string &a : args)
+            argv.push_back(&a[0]);
+        argv.push_back(nullptr);
+
+        k.valid = parse_options(argv.size() - 1, argv.data(), k.o, err);
+        k.parse_err = err.str();
+
+        if(k.valid && !c.rendered.empty())
+        {
+            std::istringstream render_words(c.render_args);
+            std::vector<std::string> render_args = { "./trace_render" };
+
+            while(render_words >> w)
+                render_args.push_back(w);
+            render_args.push_back(k.trace_temp);
+
+            argv.clear();
+            for(std::string &a : render_args)
+                argv.push_back(&a[0]);
+            argv.push_back(nullptr);
+
+            k.valid = parse_render_options(argv.size() - 1, argv.data(), k.render);
+            if(!k.valid)
+                k.parse_err = "./trace_render: can't make out the options " + c.render_args + "\n";
+        }
+    }
+
+    unsigned threads = test.workers > 0 ? test.workers : std::thread::hardware_concurrency();
+    threads = std::min(threads, 8u);
+
+    work_pool(threads).run(checks.size(), [&checks, &readme_dir](size_t i)
+    {
+        check &k = checks[i];
+        std::ostream out(k.goldens[0].cmp.get());
+        std::ostringstream discarded;
+        std::ostream &run_out = k.c->rendered.empty() ? out : discarded;
+        sim_result r;
+
+        for(const golden_file &g : k.goldens)
+        {
+            if(!g.found)
+                return;
+        }
+
+        // Like the README, usage goes in with the rest of the output
+        if(!k.valid)
+        {
+            out << k.parse_err;
+            usage(out);
+        }
+        else if(!k.o.batch_name.empty())
+            run_batch(k.o, run_out, readme_dir);
+        else if(!simulate(k.o, run_out, r))
+            usage(run_out);
+        else if(!k.c->rendered.empty())
+            render_trace(k.render, out, out);
+
+        out.flush();
+        k.goldens[0].cmp->finish();
+
+        for(size_t j = 0; j < k.temps.size(); j++)
+        {
+            std::ifstream written(k.temps[j]);
+            std::ostream file_out(k.goldens[j + 1].cmp.get());
+
+            file_out << written.rdbuf();
+            file_out.flush();
+            k.goldens[j + 1].cmp->finish();
+        }
+    });
+
+    size_t passed = 0;
+
+    for(const check &k : checks)
+    {
+        bool ok = true;
+
+        for(const std::string &t : k.temps)
+            unlink(t.c_str());
+        if(!k.trace_temp.empty())
+            unlink(k.trace_temp.c_str());
+
+        for(const golden_file &g : k.goldens)
+        {
+            if(!g.found)
+            {
+                cout << "FAIL " << k.command << ": can't open " << g.name << endl;
+                ok = false;
+            }
+        }
+        if(!ok)
+            continue;
+
+        for(const golden_file &g : k.goldens)
+        {
+            const golden_compare &cmp = *g.cmp;
+
+            if(cmp.matched())
+                continue;
+            ok = false;
+
+            cout << "FAIL " << k.command << ": " << g.name << " line " << cmp.get_line() << endl;
+            for(const std::string &l : cmp.get_context())
+                cout << "    " << l << endl;
+            if(cmp.expected_missing())
+                cout << "  - (end of file)" << endl;
+            else
+                cout << "  - " << cmp.get_expected() << endl;
+            if(cmp.actual_missing())
+                cout << "  + (end of output)" << endl;
+            else
+                cout << "  + " << cmp.get_actual() << endl;
+        }
+
+        if(ok)
+        {
+            cout << "PASS " << k.command << " > " << k.goldens[0].name << endl;
+            passed++;
+        }
+    }
+
+    cout << passed << " of " << checks.size() << " passed" << endl;
+    return passed == checks.size() ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    sim_options o;
+    sim_result r;
+
+    if(!parse_options(argc, argv, o, cerr))
+        usage();
+
+    if(!o.batch_name.empty())
+        return run_batch(o, cout);
+
+    if(!o.test_dir.empty())
+        return run_regression(o);
+
+    if(!simulate(o, cout, r))
+        usage();
+
+    return r.diverged ? 1 : 0;
 }
@@ -1,67 +1,363 @@
 #include "memory.h"
 #include "hex.h"
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace
+{
+	// The memories the SIGSEGV handler looks after, any number of them.
+	// The slots come in blocks that are chained on as more are needed
+	// and never freed, so the handler can walk them without a lock.
+	constexpr int block_slots = 64;
+
+	struct instance_block
+	{
+		std::atomic<memory*> slots[block_slots];
+		instance_block *next;
+	};
+	std::atomic<instance_block*> instances = { nullptr };
+
+	void enroll(memory *m)
+	{
+		for(instance_block *b = instances.load(); b; b = b->next)
+		{
+			for(std::atomic<memory*> &slot : b->slots)
+			{
+				memory *expected = nullptr;
+				if(slot.compare_exchange_strong(expected, m))
+					return;
+			}
+		}
+
+		instance_block *b = new instance_block();
+		b->slots[0].store(m);
+		b->next = instances.load();
+		while(!instances.compare_exchange_weak(b->next, b))
+			;
+	}
+
+	void withdraw(memory *m)
+	{
+		for(instance_block *b = instances.load(); b; b = b->next)
+		{
+			for(std::atomic<memory*> &slot : b->slots)
+			{
+				memory *expected = m;
+				if(slot.compare_exchange_strong(expected, nullptr))
+					return;
+			}
+		}
+	}
+
+	// The innermost fault_guard on this thread
+	thread_local memory::fault_guard *current_guard = nullptr;
+
+	struct sigaction previous_action;
+	struct sigaction previous_bus_action;
+
+	// A single page of 0xa5 fill, mapped read only wherever a page of
+	// any memory has been loaded from but never stored to. -1 if it
+	// couldn't be made, every touch then allocates.
+	int fill_fd = -1;
+}
 
 memory::memory(uint32_t siz)
 {
 	siz = (siz+15)&0xfffffff0;
-	
-	// Resizes vector to size value and sets every element to 0xa5
-	mem.resize(siz, 0xa5);
+	size = siz;
+	pad = (page_size - (siz & (page_size - 1))) & (page_size - 1);
+
+	// Reserve 4GiB past address 0, plus a page for an access that
+	// starts at the very top of the address space
+	region_len = pad + (1ull << 32) + page_size;
+	void *p = mmap(nullptr, region_len, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(p == MAP_FAILED)
+		throw std::runtime_error("can't reserve the guest address space");
+	region = static_cast<uint8_t*>(p);
+	base = region + pad;
+
+	// Back memory itself with an anonymous file, mapped PROT_NONE over
+	// the front of the reservation and once more to fill pages through
+	size_t len = (size_t)pad + siz;
+	if(len)
+	{
+		backing = memfd_create("rv32i", MFD_CLOEXEC);
+		if(backing < 0 || ftruncate(backing, len) != 0
+			|| mmap(region, len, PROT_NONE, MAP_SHARED|MAP_FIXED, backing, 0) == MAP_FAILED
+			|| (p = mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_SHARED, backing, 0)) == MAP_FAILED)
+		{
+			throw std::runtime_error("can't map guest memory");
+		}
+		fill_view = static_cast<uint8_t*>(p);
+	}
+
+	page_state.reset(new std::atomic<uint8_t>[len >> page_bits]());
+	code_pages.reset(new std::atomic<uint8_t>[(siz >> code_page_bits) + 1]());
+
+	install_handler();
+	enroll(this);
 }
 
 memory::~ memory()
 {
 	// Destructor
-	mem.clear();
+	withdraw(this);
+
+	if(fill_view)
+		munmap(fill_view, (size_t)pad + size);
+	if(backing >= 0)
+		close(backing);
+	munmap(region, region_len);
+}
+
+memory::fault_guard::fault_guard(const memory &m) : mem(m), prev(current_guard)
+{
+	current_guard = this;
+}
+
+memory::fault_guard::~fault_guard()
+{
+	current_guard = prev;
+}
+
+void memory::install_handler()
+{
+	// Memories can be made on several threads at once
+	static std::once_flag installed;
+
+	std::call_once(installed, []
+	{
+		// SA_NODEFER because the handler leaves by siglongjmp() to a
+		// guard that was set up without saving the signal mask
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = on_fault;
+		sa.sa_flags = SA_SIGINFO|SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGSEGV, &sa, &previous_action);
+		sigaction(SIGBUS, &sa, &previous_bus_action);
+
+		int fd = memfd_create("rv32i-fill", MFD_CLOEXEC);
+		void *p;
+		if(fd >= 0 && ftruncate(fd, page_size) == 0
+			&& (p = mmap(nullptr, page_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED)
+		{
+			memset(p, 0xa5, page_size);
+			munmap(p, page_size);
+			fill_fd = fd;
+		}
+		else if(fd >= 0)
+			close(fd);
+	});
+}
+
+void memory::on_fault(int sig, siginfo_t *info, void *uc)
+{
+	uint8_t *addr = static_cast<uint8_t*>(info->si_addr);
+	memory *m = nullptr;
+
+	for(instance_block *b = instances.load(); b && !m; b = b->next)
+	{
+		for(std::atomic<memory*> &slot : b->slots)
+		{
+			memory *p = slot.load();
+			if(p && addr >= p->region && addr < p->region + p->region_len)
+			{
+				m = p;
+				break;
+			}
+		}
+	}
+
+	if(m)
+	{
+		// The first load from a page of memory, or the first store
+		size_t offset = addr - m->region;
+		if(offset < (size_t)m->pad + m->size)
+		{
+			if(sig == SIGBUS)
+			{
+				m->drop_file_page(offset >> page_bits);
+				return;
+			}
+#if defined(__x86_64__)
+			bool store = static_cast<ucontext_t*>(uc)->uc_mcontext.gregs[REG_ERR] & 2;
+#else
+			bool store = true;
+#endif
+			m->populate(offset >> page_bits, store);
+			return;
+		}
+
+		// A guard page, from an unchecked access
+		if(current_guard && &current_guard->mem == m)
+			siglongjmp(current_guard->env, 1);
+	}
+
+	// Not ours, let it fault again with the previous action
+	if(sig == SIGBUS)
+		sigaction(SIGBUS, &previous_bus_action, nullptr);
+	else
+		sigaction(SIGSEGV, &previous_action, nullptr);
+}
+
+void memory::populate(size_t page, bool store) const
+{
+	std::atomic<uint8_t> &state = page_state[page];
+	uint8_t s = state.load();
+
+	// Only one thread changes it, the others wait and then try their
+	// access again
+	for(;;)
+	{
+		if(s == page_ready || s == page_file || (s == page_shared && !store))
+			return;
+		if(s == page_filling)
+		{
+			while((s = state.load()) == page_filling)
+				;
+			continue;
+		}
+		if(state.compare_exchange_weak(s, page_filling))
+			break;
+	}
+
+	uint8_t *host = region + (page << page_bits);
+
+	if(!store && fill_fd >= 0 && mmap(host, page_size, PROT_READ, MAP_SHARED|MAP_FIXED, fill_fd, 0) != MAP_FAILED)
+	{
+		state.store(page_shared);
+		return;
+	}
+
+	// The shared fill is swapped for the page's own in one go, a load
+	// from another thread sees one or the other
+	memset(fill_view + (page << page_bits), 0xa5, page_size);
+	if(s == page_shared)
+		mmap(host, page_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, backing, page << page_bits);
+	else
+		mprotect(host, page_size, PROT_READ|PROT_WRITE);
+	state.store(page_ready);
+}
+
+void memory::drop_file_page(size_t page) const
+{
+	std::atomic<uint8_t> &state = page_state[page];
+	uint8_t s = page_file;
+
+	// Whoever gets there first replaces it, the others wait and then
+	// try their access again
+	if(!state.compare_exchange_strong(s, page_filling))
+	{
+		while(state.load() == page_filling)
+			;
+		return;
+	}
+
+	memset(fill_view + (page << page_bits), 0xa5, page_size);
+	mmap(region + (page << page_bits), page_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, backing, page << page_bits);
+	state.store(page_ready);
 }
 
 bool memory::check_illegal(uint32_t i) const
 {
-	if(i < mem.size()) // Checks if i is less than the size
+	if(i < size) // Checks if i is less than the size
 	{
 		return true;
 	}
 	else // Print warning if address out of range
 	{
-		cout << "WARNING: Address out of range: " << hex::to_hex0x32(i) << endl;
+		*out << "WARNING: Address out of range: " << hex::to_hex0x32(i) << endl;
 		return 0;
 	}
 }	
 
-uint32_t memory::get_size() const
+uint32_t memory::fault(uint32_t addr, bool store) const
 {
-	return mem.size();
+	record_fault(addr, store);
+	return 0;
 }
 
-uint8_t memory::get8(uint32_t addr) const
+void memory::record_fault(uint32_t addr, bool store) const
 {
-	// Checks if check address is true
-	if(check_illegal(addr))
+	std::lock_guard<std::mutex> lock(fault_lock);
+
+	fault_counts &c = faults[addr >> fault_range_bits];
+	if(store)
+		c.stores++;
+	else
+		c.loads++;
+
+	// addr itself may be in range when the access runs off the end
+	if(warnings < warning_limit)
 	{
-		return mem[addr];
+		if(warning_out)
+			warning_out->text("WARNING: Address out of range: ").hex0x32(addr).end_line();
+		else
+		{
+			std::unique_lock<std::mutex> l;
+			if(out_lock)
+				l = std::unique_lock<std::mutex>(*out_lock);
+			*out << "WARNING: Address out of range: " << hex::to_hex0x32(addr) << endl;
+		}
 	}
-	else
+	else if(warnings == warning_limit && warning_limit != 0)
 	{
-		return 0;
+		if(warning_out)
+			warning_out->text("WARNING: Further out of range warnings suppressed").end_line();
+		else
+		{
+			std::unique_lock<std::mutex> l;
+			if(out_lock)
+				l = std::unique_lock<std::mutex>(*out_lock);
+			*out << "WARNING: Further out of range warnings suppressed" << endl;
+		}
 	}
+	warnings++;
+}
+
+void memory::set_warning_limit(uint64_t n)
+{
+	warning_limit = n;
 }
 
-uint16_t memory::get16(uint32_t addr) const
+void memory::dump_faults() const
 {
-	uint16_t sum;
+	if(faults.empty())
+		return;
 
-	// Sets sum to the addresses in little-endian format
-	sum = (get8(addr) | get8(addr+1) << 8);
-	return sum;
+	*out << "Out of range accesses:" << endl;
+	for(auto it = faults.begin(); it != faults.end(); ++it)
+	{
+		uint32_t first = it->first << fault_range_bits;
+		uint32_t last = first + ((1 << fault_range_bits) - 1);
+
+		*out << "  " << hex::to_hex0x32(first) << "-" << hex::to_hex0x32(last) << ": "
+			<< it->second.loads << " loads, " << it->second.stores << " stores" << endl;
+	}
 }
 
-uint32_t memory::get32(uint32_t addr) const
+uint32_t memory::get_size() const
 {
-	uint32_t sum;
+	return size;
+}
 
-	// Sets sum to the addresses in little endiend format
-	sum = get16(addr) | get16(addr+2) << 16;
-	return sum;
+uint8_t memory::get8(uint32_t addr) const
+{
+	// Checks if check address is true
+	if(in_range(addr, 1))
+	{
+		return host_load<uint8_t>(addr);
+	}
+	else
+	{
+		return fault(addr, false);
+	}
 }
 
 int32_t memory::get8_sx(uint32_t addr) const
@@ -83,124 +379,228 @@ int32_t memory::get32_sx(uint32_t addr) const
 void memory::set8(uint32_t addr, uint8_t val)
 {
 	//checks if address is valid
-	if(check_illegal(addr))
+	if(in_range(addr, 1))
+	{
+		host_store(addr, val);
+		written(addr, 1);
+	}
+	else
 	{
-		mem[addr] = val;
+		fault(addr, true);
 	}
 }
 
 void memory::set16(uint32_t addr, uint16_t val)
 {
-	// Shift value 8 bits and increment the address
-	set8(addr+1, val>>8);
-	set8(addr, val);
-	mem[addr] = val;
+	// The whole halfword is stored or none of it is
+	if(!in_range(addr, 2))
+	{
+		fault(addr, true);
+		return;
+	}
+	host_store(addr, val);
+	written(addr, 2);
 }
 
 void memory::set32(uint32_t addr, uint32_t val)
 {
-	// Shift value 8 bits and increment the address
-	// Shift value 16 bits and increment again for next set of 16
-	set16(addr+1, val>>8);
-	set16(addr+2, val>>16);
-	mem[addr] = val;
+	// The whole word is stored or none of it is
+	if(!in_range(addr, 4))
+	{
+		fault(addr, true);
+		return;
+	}
+	host_store(addr, val);
+	written(addr, 4);
 }
 
-void memory::dump() const
+void memory::dump(bool skip_untouched) const
 {
-	string reg = ""; // used for registers
-	int count = 16;  // used for numbering registers 
-	int count2 = 0;  // used for formatting output
+	static const uint8_t fill[16] = { 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5,
+		0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5 };
 
-	for(unsigned u = 0; u < mem.size()/16; u++){
-		if(u != 0)
-		{
-			// Set the register string to the correct
-			// output line in the dump using the to_hex32 function.
-			// Increment the count by a value of 10 in hex
-			reg = hex::to_hex32(count);
-			reg.append(":");
-			cout << reg;
-			count += 16;	
-		}
-		else if (u == 0)
+	for(uint32_t addr = 0; addr < size; addr += 16)
+	{
+		// Pages that have never been touched hold nothing but the
+		// 0xa5 fill, and are left alone so that they stay unallocated
+		const uint8_t *line = base + addr;
+		if(!touched(addr))
 		{
-			// Prints out the default value at the start of the dump
-			cout << "00000000:";
+			if(skip_untouched)
+			{
+				// On to the last line of the page
+				addr = (((pad + addr) | (page_size - 1)) - pad) - 15;
+				continue;
+			}
+			line = fill;
 		}
 
-		// Loop for printing out the hex values of each element in the dump
-		for(int j = count2; j < 16 + count2 ; j++)
+		*out << hex::to_hex32(addr) << ":";
+
+		// Loop for printing out the hex values of each byte, with a
+		// wider gap between the two groups of eight
+		for(int j = 0; j < 16; j++)
 		{
-			// Checks if address is the default 0xa5
-			// Prints a5 or the proper hex value of the current element
-			if(mem[j] == 0xa5)
-			{
-				// Create correct spacing
-				if(j % 8 == 0 && j != 0 && j % 16 != 0 ) cout << "  a5";
-				else cout << " a5";
-			}
-			else
-			{
-				if(j % 8 == 0 && j != 0 && j % 16 != 0) 
-					cout << "  " << hex::to_hex8(mem[j]);
-				else
-					cout << " " << hex::to_hex8(mem[j]);
-			}
+			if(j == 8) *out << " ";
+			*out << " " << hex::to_hex8(line[j]);
 		}
-		cout << " *";
+		*out << " *";
 
 		// Loop for printing out the printable characters in the memory dump
-		for(int k = count2; k < 16 + count2; k++){
+		for(int k = 0; k < 16; k++)
+		{
 			// Checks if address is 0xa5 and if it is printable
-			if(mem[k] == 0xa5 || !isprint(mem[k]))
+			if(line[k] == 0xa5 || !isprint(line[k]))
 			{
-				cout << ".";
+				*out << ".";
 			}
 			else
 			{
 				// Prints address content
-				cout << mem[k];
+				*out << line[k];
 			}
 		}	
 
-		cout << "*";		
-		cout << endl;
-		
-		// Increment the count2 by a hex value of 10
-		count2 += 16;
+		*out << "*";		
+		*out << endl;
 	}
 }
 
 bool memory::load_file(const string& fname)
 {
-	// Create the input file variable and open in binary
-	ifstream infile(fname, ios::in|ios::binary);
+	// Open the file in binary and find out how big it is
+	int fd = open(fname.c_str(), O_RDONLY);
+	struct stat st;
 
 	// Check if file exists or can be opened
-	if(!infile)
+	if(fd < 0 || fstat(fd, &st) != 0)
 	{
-		cout << "Can't open file " << fname << " for reading" << endl;
+		if(fd >= 0)
+			close(fd);
+		*out << "Can't open file " << fname << " for reading" << endl;
 		return false;
 	}
-	
-	// Read one byte at a time and accept whitespaces as
-	// valid characters. Insert that value into the memory 
-	// vector or return an error message.
-	uint8_t i;
-	infile >> std::noskipws;
-	for (uint32_t addr = 0; infile >> i; ++addr)
+
+	// Only a regular file's size is known up front, anything else,
+	// a pipe say, is read until it ends. Reports the first byte that
+	// doesn't fit, as a byte at a time load would have.
+	bool regular = S_ISREG(st.st_mode);
+	if(regular && (uint64_t)st.st_size > size)
+	{
+		close(fd);
+		check_illegal(size);
+		cerr << "Program too big." << endl;
+		return false;
+	}
+
+	// When address 0 is on a host page boundary the whole pages of
+	// a regular file are mapped copy on write straight into memory,
+	// and share the page cache until the guest stores into one
+	uint32_t mapped = 0;
+	if(regular && pad == 0)
+	{
+		mapped = st.st_size & ~(uint64_t)(page_size - 1);
+		if(mapped && mmap(base, mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED)
+			mapped = 0;
+		for(uint32_t page = 0; page < (mapped >> page_bits); page++)
+			page_state[page] = page_file;
+		if(mapped && lseek(fd, mapped, SEEK_SET) != mapped)
+		{
+			close(fd);
+			*out << "Can't open file " << fname << " for reading" << endl;
+			return false;
+		}
+	}
+
+	// The rest is read in and copied, which fills in the pages on the
+	// way. read() can't store into pages that aren't there yet.
+	std::vector<char> buf(1 << 16);
+	uint64_t at = mapped;
+	for(;;)
 	{
-		if(check_illegal(addr))
+		ssize_t n = read(fd, buf.data(), buf.size());
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
 		{
-			mem[addr] = i;
+			close(fd);
+			*out << "Can't open file " << fname << " for reading" << endl;
+			return false;
 		}
-		else
+		if(n == 0)
+			break;
+
+		if(at + n > size)
 		{
+			close(fd);
+			check_illegal(size);
 			cerr << "Program too big." << endl;
 			return false;
 		}
+		memcpy(base + at, buf.data(), n);
+		at += n;
 	}
 
+	close(fd);
 	return true;
 }
+
+void memory::add_code_watcher(code_watcher *w)
+{
+	watchers.push_back(w);
+}
+
+void memory::remove_code_watcher(code_watcher *w)
+{
+	for(size_t i = 0; i < watchers.size(); i++)
+	{
+		if(watchers[i] == w)
+		{
+			watchers.erase(watchers.begin() + i);
+			return;
+		}
+	}
+}
+
+void memory::watch_code(uint32_t addr)
+{
+	if(addr >= size)
+		return;
+
+	code_pages[addr >> code_page_bits].store(1, std::memory_order_relaxed);
+	if(shared)
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void memory::fold_store(uint32_t addr, uint32_t len)
+{
+	uint32_t val = 0;
+
+	// What was stored is read back, the callers don't all have it
+	memcpy(&val, base + addr, len);
+	store_digest = (store_digest ^ ((uint64_t)addr << 32 | val)) * 0x100000001b3ull;
+	store_digest = (store_digest ^ len) * 0x100000001b3ull;
+}
+
+void memory::written(uint32_t addr, uint32_t len)
+{
+	// Only stores that land in a page of cached code are reported,
+	// and only the part of the store that is inside of memory
+	if(addr >= size)
+		return;
+	if(len > size - addr)
+		len = size - addr;
+
+	if(digest_stores)
+		fold_store(addr, len);
+
+	// Pairs with the fence in watch_code()
+	if(shared)
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(!code_pages[addr >> code_page_bits].load(std::memory_order_relaxed)
+		&& !code_pages[(addr + len - 1) >> code_page_bits].load(std::memory_order_relaxed))
+		return;
+
+	for(size_t i = 0; i < watchers.size(); i++)
+		watchers[i]->code_modified(addr, len);
+}
@@ -19,11 +19,28 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <map>
 #include <stdio.h>
 #include <bitset>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <setjmp.h>
+#include <signal.h>
+#include "trace_writer.h"
 
 using namespace std;
 
+// Interface for anything that caches decoded instructions and needs to
+// know when a store lands in code it has cached
+class code_watcher
+{
+	public:
+		virtual ~code_watcher() { }
+		virtual void code_modified(uint32_t addr, uint32_t len) = 0;
+};
+
 class memory
 {
 	public:
@@ -31,15 +48,31 @@ class memory
 		memory(uint32_t s);
 		~memory();
 
+		// The host mappings are owned by the object, so it can't be
+		// copied
+		memory(const memory &) = delete;
+		memory &operator=(const memory &) = delete;
+
 		// Check legality of an address
 		bool check_illegal(uint32_t addr) const;
 
 		// Get appropriate values for any 
-		// given address
+		// given address.
+		//
+		// Access policy: misaligned addresses are allowed and read or
+		// write the same bytes as an aligned access would. An access
+		// with any of its bytes out of range is an access fault as a
+		// whole: it warns once with the address it was made at, a
+		// load returns 0 and a store changes nothing.
+		//
+		// Memory may be shared by harts on different threads. An
+		// aligned access is a single relaxed host atomic, so it is
+		// never torn and sees either the whole of another hart's
+		// store or none of it. A misaligned one has no such promise.
 		uint32_t get_size() const;		
 		uint8_t get8(uint32_t addr) const;	
-		uint16_t get16(uint32_t addr) const;	
-		uint32_t get32(uint32_t addr) const;
+		uint16_t get16(uint32_t addr) const { return in_range(addr, 2) ? host_load<uint16_t>(addr) : fault(addr, false); }
+		uint32_t get32(uint32_t addr) const { return in_range(addr, 4) ? host_load<uint32_t>(addr) : fault(addr, false); }
 
 		int32_t get8_sx(uint32_t addr) const;
 		int32_t get16_sx(uint32_t addr) const;
@@ -51,15 +84,234 @@ class memory
 		void set16(uint32_t addr, uint16_t val);
 		void set32(uint32_t addr, uint32_t val);	
 
-		// Display the memory dump
-		void dump() const;			
+		// The word at an aligned, in range addr. A page that has never
+		// been touched reads as the fill, and is left unallocated.
+		uint32_t peek32(uint32_t addr) const { return touched(addr) ? host_load<uint32_t>(addr) : 0xa5a5a5a5; }
+
+		// True when all len bytes starting at addr are in memory
+		bool in_range(uint32_t addr, uint32_t len) const { return addr < size && len <= size - addr; }
+
+		// Counts an out of range access against its range of
+		// addresses and warns about it, up to the warning limit
+		void record_fault(uint32_t addr, bool store) const;
+
+		// Print at most n warnings, 0 for none at all
+		void set_warning_limit(uint64_t n);
+		uint64_t get_warning_limit() const { return warning_limit; }
+
+		// The number of out of range accesses so far, which the limit
+		// is checked against
+		uint64_t get_warning_count() const { return warnings; }
+		void set_warning_count(uint64_t n) { warnings = n; }
+
+		// Append the warnings to w, in line with whatever else is
+		// written there, rather than printing them straight to the
+		// output. nullptr goes back to the output.
+		void set_warning_writer(trace_writer *w) { warning_out = w; }
+
+		// Where dumps, warnings and load errors are printed, std::cout
+		// unless changed
+		void set_output(std::ostream *os) { out = os; }
+		std::ostream &get_output() const { return *out; }
+
+		// Taken around warnings printed straight to the output, when
+		// harts on other threads print there too. nullptr for none.
+		void set_output_lock(std::mutex *m) { out_lock = m; }
+
+		// Display the out of range access counts, if there were any
+		void dump_faults() const;
+
+		// Set up by code that uses the unchecked accessors below. An
+		// out of range access through one of them lands on a guard
+		// page and jumps back to env, before anything is loaded or
+		// stored. Guards nest, the innermost one on the thread is used.
+		struct fault_guard
+		{
+			fault_guard(const memory &m);
+			~fault_guard();
+
+			sigjmp_buf env;
+			const memory &mem;
+			fault_guard *prev;
+		};
+
+		// The same accesses without any range check, only to be made
+		// while a fault_guard is set up
+		uint8_t get8_unchecked(uint32_t addr) const { return host_load<uint8_t>(addr); }
+		uint16_t get16_unchecked(uint32_t addr) const { return host_load<uint16_t>(addr); }
+		uint32_t get32_unchecked(uint32_t addr) const { return host_load<uint32_t>(addr); }
+		void set8_unchecked(uint32_t addr, uint8_t val) { host_store(addr, val); written(addr, 1); }
+		void set16_unchecked(uint32_t addr, uint16_t val) { host_store(addr, val); written(addr, 2); }
+		void set32_unchecked(uint32_t addr, uint32_t val) { host_store(addr, val); written(addr, 4); }
+
+		// Display the memory dump, leaving out pages that have never
+		// been touched when skip_untouched is set
+		void dump(bool skip_untouched = false) const;
 		
 		// Check for successful file load
 		bool load_file(const string& fname);	
 
+		// Register for notification of stores into cached code
+		void add_code_watcher(code_watcher *w);
+		void remove_code_watcher(code_watcher *w);
+
+		// Mark the page holding addr as containing cached code. The
+		// code is read after this returns, so that a store from
+		// another hart that lands in between is still reported.
+		void watch_code(uint32_t addr);
+
+		// Set while harts on more than one thread share memory. A
+		// hart that watches code and one that stores into it then
+		// each fence between their store and their load, or both
+		// could miss the other's store and the cached code would
+		// never be dropped.
+		void set_shared(bool b) { shared = b; }
+		bool is_shared() const { return shared; }
+
+		// Keep a running digest of the address, size and value of
+		// every store, in the order they are made. Two harts that
+		// made the same stores have the same digest. Turn it on
+		// before a hart starts translating code, whose stores only
+		// go through written() while it is on.
+		void set_store_digest(bool b) { digest_stores = b; }
+		uint64_t get_store_digest() const { return store_digest; }
+		bool is_digesting_stores() const { return digest_stores; }
+
+		// For translated code, which makes its own loads and stores
+		// while a fault_guard is set up: where guest address 0 is in
+		// the host, and a flag for every 1 << code_page_bits bytes
+		// that is set when a store there has to be passed to
+		// written()
+		static constexpr uint32_t code_page_bits = 12;
+		uint8_t *get_host_base() const { return base; }
+		const std::atomic<uint8_t> *get_code_pages() const { return code_pages.get(); }
+
+		// Tell the watchers about a store into a code page, and digest
+		// it
+		void written(uint32_t addr, uint32_t len);
+
 	private:
-		// Vector used to store each address
-		vector <uint8_t> mem; 
+		// The whole 4GiB guest address space is reserved in the host,
+		// placed so that the end of memory falls on a host page
+		// boundary. Everything past the end stays PROT_NONE as a guard.
+		// The pages of memory itself are PROT_NONE too until they are
+		// first touched. A load from one has the SIGSEGV handler map
+		// in a read only page of 0xa5 fill that every such page
+		// shares. Only the first store gives a page memory of its own,
+		// filled with 0xa5 and opened up, so nothing is allocated for
+		// pages that are only ever read.
+		static constexpr uint32_t page_bits = 12;
+		static constexpr uint32_t page_size = 1 << page_bits;
+
+		// States of a page of memory. A page_file page is mapped
+		// copy on write from the loaded file, and raises SIGBUS if
+		// the file is cut short under it.
+		enum { page_untouched, page_filling, page_shared, page_ready, page_file };
+
+		static void on_fault(int sig, siginfo_t *info, void *uc);
+		static void install_handler();
+
+		// Makes a page of memory usable for a load or a store, from
+		// any thread or from within the signal handler
+		void populate(size_t page, bool store) const;
+
+		// Gives a page_file page whose part of the file is gone
+		// memory of its own, filled with 0xa5 as if untouched
+		void drop_file_page(size_t page) const;
+
+		size_t host_page(uint32_t addr) const { return (pad + addr) >> page_bits; }
+		bool touched(uint32_t addr) const { return page_state[host_page(addr)] >= page_ready; }
+
+		// Reports an out of range access, returns the value it loads
+		uint32_t fault(uint32_t addr, bool store) const;
+
+		// Out of range accesses are counted for each 64KiB range of
+		// addresses
+		static constexpr uint32_t fault_range_bits = 16;
+
+		struct fault_counts
+		{
+			uint64_t loads = { 0 };
+			uint64_t stores = { 0 };
+		};
+		// Held while counting and warning, harts on other threads
+		// can fault at the same time
+		mutable std::mutex fault_lock;
+		mutable map<uint32_t, fault_counts> faults;
+		mutable uint64_t warnings = { 0 };
+		uint64_t warning_limit = { UINT64_MAX };
+		trace_writer *warning_out = { nullptr };
+		std::ostream *out = { &std::cout };
+		std::mutex *out_lock = { nullptr };
+
+		// One unaligned-safe host load or store of a little-endian
+		// value. base is aligned to 16, so an aligned guest address is
+		// an aligned host one, and that is made as a relaxed atomic.
+		// On the usual hosts that is the same plain move as memcpy().
+		template<typename T> T host_load(uint32_t addr) const
+		{
+			T v;
+			if((addr & (sizeof(T) - 1)) == 0)
+				v = __atomic_load_n(reinterpret_cast<const T*>(base + addr), __ATOMIC_RELAXED);
+			else
+				memcpy(&v, base + addr, sizeof(v));
+			return little_endian(v);
+		}
+		template<typename T> void host_store(uint32_t addr, T v)
+		{
+			v = little_endian(v);
+			if((addr & (sizeof(T) - 1)) == 0)
+				__atomic_store_n(reinterpret_cast<T*>(base + addr), v, __ATOMIC_RELAXED);
+			else
+				memcpy(base + addr, &v, sizeof(v));
+		}
+
+		static uint8_t little_endian(uint8_t v) { return v; }
+		static uint16_t little_endian(uint16_t v)
+		{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			return __builtin_bswap16(v);
+#else
+			return v;
+#endif
+		}
+		static uint32_t little_endian(uint32_t v)
+		{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			return __builtin_bswap32(v);
+#else
+			return v;
+#endif
+		}
+
+		bool digest_stores = { false };
+		uint64_t store_digest = { 0 };
+		void fold_store(uint32_t addr, uint32_t len);
+
+		// The size of memory, and where guest address 0 is in the host
+		uint32_t size;
+		uint8_t *base = { nullptr };
+
+		// The reservation, the pad in front of address 0 that puts the
+		// end of memory on a page boundary, and the state of each
+		// host page from the start of the reservation to the end of
+		// memory
+		uint8_t *region = { nullptr };
+		size_t region_len = { 0 };
+		uint32_t pad = { 0 };
+		std::unique_ptr<std::atomic<uint8_t>[]> page_state;
+
+		// Memory is backed by an anonymous file, which is mapped a
+		// second time so that pages can be filled before they are
+		// opened up in the guest view
+		int backing = { -1 };
+		uint8_t *fill_view = { nullptr };
+
+		// Set for every page that a watcher has cached code from. A
+		// hart can cache code while another one stores next to it.
+		std::unique_ptr<std::atomic<uint8_t>[]> code_pages;
+		vector <code_watcher*> watchers;
+		bool shared = { false };
 };
 
 #endif
@@ -0,0 +1,152 @@
+#include "profile_report.h"
+#include <algorithm>
+#include <iomanip>
+#include "hex.h"
+
+using namespace std;
+
+/**
+ * Prints the report
+ *
+ * Mnemonics come first, most retired first, then the pcs, then the
+ * blocks by cycles. Ties are in address order. The pairs that the
+ * threaded engine fused, if it fused any, are counted up front.
+ *
+ * @param os The stream to print to
+ * @param top The most pcs and blocks to show, 0 for all of them
+ **************************************************************************/
+void profile_report::write(std::ostream &os, size_t top) const
+{
+	std::vector<uint64_t> counts = hart.get_pc_profile();
+	uint64_t insns[id_count] = {};
+	uint64_t total = 0;
+
+	for(uint32_t i = 0; i < counts.size(); i++)
+	{
+		if(counts[i])
+		{
+			insns[classify(mem.peek32(i * 4))] += counts[i];
+			total += counts[i];
+		}
+	}
+
+	os << "Profile: " << total << " instructions retired" << endl;
+	if(hart.get_fused_counter())
+		os << hart.get_fused_counter() << " instruction pairs fused" << endl;
+	if(total == 0)
+		return;
+
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize precision = os.precision();
+	os << std::fixed << std::setprecision(2);
+
+	auto percent = [total](uint64_t n) { return 100.0 * n / total; };
+
+	std::vector<int> ids;
+	for(int id = 0; id < id_count; id++)
+	{
+		if(insns[id])
+			ids.push_back(id);
+	}
+	std::stable_sort(ids.begin(), ids.end(), [insns](int a, int b) { return insns[a] > insns[b]; });
+
+	os << "By mnemonic:" << endl;
+	for(int id : ids)
+	{
+		os << "  " << std::setw(mnemonic_width) << std::left << mnemonic(insn_id(id)) << std::right
+			<< std::setw(12) << insns[id] << std::setw(8) << percent(insns[id]) << "%" << endl;
+	}
+
+	std::vector<uint32_t> pcs;
+	for(uint32_t i = 0; i < counts.size(); i++)
+	{
+		if(counts[i])
+			pcs.push_back(i);
+	}
+	size_t n = top && top < pcs.size() ? top : pcs.size();
+	std::partial_sort(pcs.begin(), pcs.begin() + n, pcs.end(),
+		[&counts](uint32_t a, uint32_t b) { return counts[a] > counts[b] || (counts[a] == counts[b] && a < b); });
+
+	os << "By pc:" << endl;
+	for(size_t i = 0; i < n; i++)
+	{
+		uint32_t pc = pcs[i] * 4;
+
+		os << "  " << hex::to_hex32(pc) << std::setw(12) << counts[pcs[i]] << std::setw(8) << percent(counts[pcs[i]])
+			<< "%  " << decode(pc, mem.peek32(pc)) << endl;
+	}
+
+	std::vector<hot_block> runs = blocks(counts);
+	n = top && top < runs.size() ? top : runs.size();
+	std::partial_sort(runs.begin(), runs.begin() + n, runs.end(),
+		[](const hot_block &a, const hot_block &b) { return a.cycles > b.cycles || (a.cycles == b.cycles && a.start < b.start); });
+
+	os << "By basic block, at 1 cycle per instruction:" << endl;
+	for(size_t i = 0; i < n; i++)
+	{
+		const hot_block &b = runs[i];
+
+		os << "  " << hex::to_hex32(b.start) << "-" << hex::to_hex32(b.start + (b.len - 1) * 4)
+			<< std::setw(12) << b.cycles << std::setw(8) << percent(b.cycles) << "%  entered "
+			<< b.entries << " times" << endl;
+	}
+
+	os.flags(flags);
+	os.precision(precision);
+}
+
+/**
+ * Splits the instructions that were run into blocks
+ *
+ * A block carries on to the next word as long as it was retired the
+ * same number of times and the last one doesn't end a block. Anything
+ * that jumped into the middle of a block, or left it part way through,
+ * shows up as a change in the count and splits it there.
+ *
+ * @param counts The times each word was retired
+ *
+ * @return The blocks in address order
+ **************************************************************************/
+std::vector<profile_report::hot_block> profile_report::blocks(const std::vector<uint64_t> &counts) const
+{
+	std::vector<hot_block> runs;
+	bool open = false;
+
+	for(uint32_t i = 0; i < counts.size(); i++)
+	{
+		if(!counts[i])
+		{
+			open = false;
+			continue;
+		}
+
+		if(open && counts[i] == runs.back().entries)
+		{
+			runs.back().len++;
+			runs.back().cycles += counts[i];
+		}
+		else
+			runs.push_back({ i * 4, 1, counts[i], counts[i] });
+
+		open = !ends_block(classify(mem.peek32(i * 4)));
+	}
+	return runs;
+}
+
+const char *profile_report::mnemonic(insn_id id)
+{
+	static const char *const names[id_count] =
+	{
+		"none", "illegal",
+		"lui", "auipc", "jal", "jalr",
+		"beq", "bne", "blt", "bge", "bltu", "bgeu",
+		"lb", "lh", "lw", "lbu", "lhu",
+		"sb", "sh", "sw",
+		"addi", "slti", "sltiu", "xori", "ori", "andi",
+		"slli", "srli", "srai",
+		"add", "sub", "sll", "slt", "sltu", "xor", "srl", "sra", "or", "and",
+		"ebreak", "csrrs"
+	};
+
+	return names[id];
+}
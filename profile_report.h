@@ -0,0 +1,52 @@
+#ifndef PROFILE_REPORT_H
+#define PROFILE_REPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+#include "hex.h"
+#include "memory.h"
+#include "rv32i_decode.h"
+#include "rv32i_hart.h"
+
+// The hot spots of a run, from the counts a hart keeps with its profile
+// on: the instructions retired of each mnemonic, at each pc, and in each
+// basic block.
+//
+// The blocks are the ones that were run: straight-line runs of
+// instructions that were all retired the same number of times, ending at
+// a branch, jal, jalr, ebreak, csrrs or illegal instruction. With no
+// timing model every instruction costs 1 cycle.
+//
+// The instructions are classified and disassembled from memory as it is
+// at the end of the run, so code that was stored over is counted as what
+// replaced it.
+class profile_report : public rv32i_decode
+{
+	public:
+		profile_report(const memory &mem, const rv32i_hart &hart) : mem(mem), hart(hart) {}
+
+		// Prints the report, with only the top pcs and blocks, or
+		// all of them for 0
+		void write(std::ostream &os, size_t top) const;
+
+	private:
+		struct hot_block
+		{
+			uint32_t start;
+			uint32_t len;		// in instructions
+			uint64_t entries;
+			uint64_t cycles;
+		};
+
+		// The blocks that were run, in address order
+		std::vector<hot_block> blocks(const std::vector<uint64_t> &counts) const;
+
+		static const char *mnemonic(insn_id id);
+
+		const memory &mem;
+		const rv32i_hart &hart;
+};
+
+#endif
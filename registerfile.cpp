@@ -1,8 +1,6 @@
 #include "registerfile.h"
 #include "hex.h"
 #include <cstdint>
-#include <iostream>
-#include <iomanip>
 
 registerfile::registerfile()
 {
@@ -12,6 +10,7 @@ registerfile::registerfile()
 void registerfile::reset()
 {
 	reg[0] = 0x0;
+	written = 0;
 
 	for (int i = 1; i < 32; i++)
 	{
@@ -28,6 +27,7 @@ void registerfile::set(uint32_t r, int32_t val)
 	else
 	{
 		reg[r] = val;
+		written |= 1u << r;
 	}
 }
 
@@ -44,51 +44,47 @@ int32_t registerfile::get(uint32_t r) const
 	}
 }
 
-void registerfile::dump(const std::string &hdr) const
+void registerfile::dump(trace_writer &out, const std::string &hdr) const
 {
+	static const char *const names[4] = { " x0 ", " x8 ", "x16 ", "x24 " };
+
 	// Dump contents
 	for(size_t i = 0; i < 32; i++)
 	{
 		// Print new line
 		if (i != 0 && i % 8 == 0)
 		{
-			std::cout << std::endl;
+			out.end_line();
 		}
 		if (i % 8 == 0)
 		{
-			std::string h;
-			if (i == 0)
-			{
-				h = "x0";
-			}
-			else if (i == 8)
-			{
-			    h = "x8";
-            }
-            else if(i == 16)
-            {
-                h = "x16";
-            }
-            else if(i == 24)
-            {
-                h = "x24";
-            }
-			std::cout << hdr << std::dec << std::right << std::setw(3) << std::setfill(' ') << h << " ";
-        }
+			out.text(hdr).text(names[i / 8]);
+		}
 
-        //print contents of the register
-        if(i % 8 == 7)
-        {
-            std::cout << hex::to_hex32(reg[i]);
-        }
+		//print contents of the register
+		if(i % 8 == 7)
+		{
+			out.hex32(reg[i]);
+		}
 		else if (i % 4 == 0 && i != 0 && i % 8 != 0)
 		{
-			std::cout << " " << hex::to_hex32(reg[i]) << " ";
+			out.text(" ").hex32(reg[i]).text(" ");
+		}
+		else
+		{
+			out.hex32(reg[i]).text(" ");
+		}
+	}
+	out.end_line();
+}
+
+void registerfile::dump_changed(trace_writer &out, uint32_t mask) const
+{
+	for(size_t i = 1; i < 32; i++)
+	{
+		if(mask & (1u << i))
+		{
+			out.text(" x").dec(i).text(" ").hex32(reg[i]);
 		}
-        else
-        {
-            std::cout << hex::to_hex32(reg[i]) << " ";
-        }
-    }
-	std::cout << std::endl;
+	}
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <string>
+#include "trace_writer.h"
 
 using namespace std;
 
@@ -13,10 +14,25 @@ class registerfile
 		void reset();
 		void set(uint32_t r, int32_t val);
 		int32_t get(uint32_t r) const;
-		void dump(const std::string &hdr) const;
+		void dump(trace_writer &out, const std::string &hdr) const;
+
+		// Renders " xN value" for each register in mask, a bit for
+		// each register, without ending the line
+		void dump_changed(trace_writer &out, uint32_t mask) const;
+
+		// The registers set since the last take_written(), a bit for
+		// each. Clears them.
+		uint32_t take_written() { uint32_t w = written; written = 0; return w; }
+		void set_written(uint32_t mask) { written = mask; }
+
+		// Direct access to the registers for translated code. x0 is
+		// always left holding zero. Writes through it are not seen by
+		// take_written().
+		int32_t *data() { return reg; }
 
 	private:
 		int32_t reg[32];
+		uint32_t written = { 0 };
 };
 
 #endif
@@ -0,0 +1,267 @@
+#include "regression.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+	// The words of a shell command line, with double quotes taken off
+	std::vector<std::string> split_words(const std::string &line)
+	{
+		std::vector<std::string> words;
+		size_t i = 0;
+
+		for(;;)
+		{
+			while(i < line.size() && isspace((unsigned char)line[i]))
+				i++;
+			if(i == line.size())
+				return words;
+
+			std::string w;
+			bool quoted = false;
+			for(; i < line.size() && (quoted || !isspace((unsigned char)line[i])); i++)
+			{
+				if(line[i] == '"')
+					quoted = !quoted;
+				else
+					w += line[i];
+			}
+			words.push_back(w);
+		}
+	}
+
+	std::string base_name(const std::string &path)
+	{
+		size_t slash = path.rfind('/');
+
+		return slash == std::string::npos ? path : path.substr(slash + 1);
+	}
+
+	// The directory of a path, with its slash, or "" for none
+	std::string dir_name(const std::string &path)
+	{
+		size_t slash = path.rfind('/');
+
+		return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+	}
+}
+
+/**
+ * Reads the regression cases from a README
+ *
+ * @param readme The README
+ * @param cases Where to add the cases, in the order of the README
+ * @param err Where to put the line that couldn't be read
+ *
+ * @return False if a command line couldn't be read
+ **************************************************************************/
+bool read_regression_cases(std::istream &readme, std::vector<regression_case> &cases, std::string &err)
+{
+	std::string line;
+
+	while(std::getline(readme, line))
+	{
+		std::vector<std::string> words = split_words(line);
+		std::vector<std::string> args;
+		regression_case c;
+		size_t i = 1;
+
+		if(words.empty() || words[0] != "./rv32i")
+			continue;
+
+		for(; i < words.size() && words[i] != "|" && words[i] != ">"; i++)
+			args.push_back(words[i]);
+
+		bool ok = !args.empty();
+		if(ok && i < words.size() && words[i] == "|")
+		{
+			if(i + 2 < words.size() && words[i + 1] == "head" && words[i + 2][0] == '-')
+				ok = (c.head = strtoul(words[i + 2].c_str() + 1, nullptr, 10)) != 0;
+			else if(i + 2 < words.size() && words[i + 1] == "grep")
+				c.grep = words[i + 2];
+			else
+				ok = false;
+			i += 3;
+		}
+		ok = ok && i + 1 < words.size() && words[i] == ">";
+
+		// The output of a run that writes a trace can be thrown away,
+		// when it is the rendering of the trace that is checked
+		std::string golden = ok ? words[i + 1] : "";
+		i += 2;
+		if(ok && golden == "/dev/null")
+		{
+			std::vector<std::string> render;
+
+			ok = i + 1 < words.size() && words[i] == "&&" && words[i + 1] == "./trace_render";
+			for(i += 2; ok && i < words.size() && words[i] != ">"; i++)
+				render.push_back(words[i]);
+
+			ok = ok && !render.empty() && i + 1 < words.size() && c.head == 0 && c.grep.empty();
+			if(ok)
+			{
+				c.rendered = base_name(render.back());
+				render.pop_back();
+				for(const std::string &w : render)
+					c.render_args += (c.render_args.empty() ? "" : " ") + w;
+				golden = words[i + 1];
+			}
+		}
+
+		if(!ok)
+		{
+			err = line;
+			return false;
+		}
+		c.golden = base_name(golden);
+
+		// The infile is the last of them, and the files next to the
+		// golden file are written by the command
+		bool rendered = c.rendered.empty();
+		for(size_t j = 0; j < args.size(); j++)
+		{
+			std::string w = args[j];
+
+			if(j + 1 == args.size())
+				w = base_name(w);
+			else if(!dir_name(golden).empty() && dir_name(w) == dir_name(golden))
+			{
+				w = base_name(w);
+				if(w == c.rendered)
+					rendered = true;
+				else
+					c.outputs.push_back(w);
+			}
+			c.args += (c.args.empty() ? "" : " ") + w;
+		}
+
+		// trace_render has to be given the trace the command wrote
+		if(!rendered)
+		{
+			err = line;
+			return false;
+		}
+		cases.push_back(c);
+	}
+	return true;
+}
+
+/**
+ * Constructor
+ *
+ * @param expected The lines of the golden file, without their newlines
+ * @param head The number of lines to compare, 0 for all of them
+ * @param grep Only the lines this matches are compared, if not empty
+ **************************************************************************/
+golden_compare::golden_compare(const std::vector<std::string> &expected, size_t head, const std::string &grep)
+	: expected(expected), head(head), filtered(!grep.empty())
+{
+	if(filtered)
+		this->grep.assign(grep);
+}
+
+int golden_compare::overflow(int ch)
+{
+	if(ch == traits_type::eof())
+		return traits_type::not_eof(ch);
+
+	char c = ch;
+	xsputn(&c, 1);
+	return ch;
+}
+
+/**
+ * Takes in what has been written, a line at a time
+ *
+ * @param s The characters written
+ * @param n How many there are
+ *
+ * @return n, everything is always taken
+ **************************************************************************/
+std::streamsize golden_compare::xsputn(const char *s, std::streamsize n)
+{
+	const char *end = s + n;
+
+	while(s < end)
+	{
+		const char *nl = static_cast<const char*>(memchr(s, '\n', end - s));
+
+		if(!nl)
+		{
+			if(!differs)
+				partial.append(s, end);
+			break;
+		}
+
+		if(!differs)
+		{
+			partial.append(s, nl);
+			take(partial);
+		}
+		partial.clear();
+		s = nl + 1;
+	}
+	return n;
+}
+
+/**
+ * Compares the next line that gets past the filters
+ *
+ * @param l The line, without its newline
+ **************************************************************************/
+void golden_compare::take(const std::string &l)
+{
+	if(differs || (head && kept == head))
+		return;
+	if(filtered && !std::regex_search(l, grep))
+		return;
+
+	if(kept == expected.size())
+	{
+		mismatch(nullptr, &l);
+		return;
+	}
+	if(l != expected[kept])
+	{
+		mismatch(&expected[kept], &l);
+		return;
+	}
+
+	context.push_back(l);
+	if(context.size() > context_lines)
+		context.pop_front();
+	kept++;
+}
+
+void golden_compare::finish()
+{
+	if(!partial.empty())
+	{
+		take(partial);
+		partial.clear();
+	}
+
+	if(!differs && kept < expected.size())
+		mismatch(&expected[kept], nullptr);
+}
+
+/**
+ * Records the first difference
+ *
+ * @param e The expected line, or nullptr if there were no more
+ * @param a The line written, or nullptr if there were no more
+ **************************************************************************/
+void golden_compare::mismatch(const std::string *e, const std::string *a)
+{
+	differs = true;
+	line_no = kept + 1;
+	no_expected = e == nullptr;
+	no_actual = a == nullptr;
+	if(e)
+		expected_line = *e;
+	if(a)
+		actual_line = *a;
+}
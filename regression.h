@@ -0,0 +1,101 @@
+#ifndef REGRESSION_H
+#define REGRESSION_H
+
+#include <stddef.h>
+#include <deque>
+#include <istream>
+#include <regex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// One of the command lines in the README that made a file in Test-Files.
+// The infile is the last of args, and is looked for in the test
+// directory, as is the golden file. Like the pipes after some of them,
+// only the first head lines are kept when head isn't 0, and only the
+// lines that grep matches when it isn't empty.
+//
+// Any other argument that names a file next to the golden file is one
+// that the command writes, such as a -g graph. It is kept in args by its
+// name alone, and listed in outputs to be checked against the golden
+// file of that name. A trace that is rendered straight after by
+// trace_render with render_args is the rendered one instead, and it is
+// the rendering that is checked against the golden file.
+struct regression_case
+{
+	std::string args;
+	std::string golden;
+	size_t head = { 0 };
+	std::string grep;
+	std::vector<std::string> outputs;
+	std::string rendered;
+	std::string render_args;
+};
+
+// Reads the cases from the ./rv32i command lines of a README, which
+// look like
+//
+//	./rv32i args dir/infile [| head -n | grep "regex"] > dir/golden ...
+//	./rv32i -t dir/trace args dir/infile > /dev/null && ./trace_render render_args dir/trace > dir/golden ...
+//
+// Anything after the golden file is left alone. Returns false, with the
+// line in err, for a command line that doesn't look like that.
+bool read_regression_cases(std::istream &readme, std::vector<regression_case> &cases, std::string &err);
+
+// A stream buffer that checks what is written to it, line by line,
+// against the lines of a golden file, without keeping any more of it
+// than the lines leading up to the first difference.
+class golden_compare : public std::streambuf
+{
+	public:
+		// The lines before the first difference that are kept to show
+		// where it is
+		static constexpr size_t context_lines = 3;
+
+		// Only the first head lines are compared when head isn't 0,
+		// and only the lines that grep matches when it isn't empty
+		golden_compare(const std::vector<std::string> &expected, size_t head = 0, const std::string &grep = "");
+
+		// Checks a last line without a newline, and that nothing
+		// expected is missing from the end. Call once writing is done.
+		void finish();
+
+		bool matched() const { return !differs; }
+
+		// The first line that differs, counted from 1, with the lines
+		// before it and what was expected and written there. A line
+		// that is missing is empty, with missing set.
+		size_t get_line() const { return line_no; }
+		const std::deque<std::string> &get_context() const { return context; }
+		const std::string &get_expected() const { return expected_line; }
+		const std::string &get_actual() const { return actual_line; }
+		bool expected_missing() const { return no_expected; }
+		bool actual_missing() const { return no_actual; }
+
+	protected:
+		int overflow(int ch) override;
+		std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+	private:
+		// Filters and compares a whole line
+		void take(const std::string &l);
+		void mismatch(const std::string *expected, const std::string *actual);
+
+		const std::vector<std::string> &expected;
+		size_t head;
+		bool filtered;
+		std::regex grep;
+
+		std::string partial;
+		size_t kept = { 0 };
+		size_t line_no = { 0 };
+		bool differs = { false };
+
+		std::deque<std::string> context;
+		std::string expected_line;
+		std::string actual_line;
+		bool no_expected = { false };
+		bool no_actual = { false };
+};
+
+#endif
@@ -9,6 +9,14 @@
 using namespace std;
 
 std::string rv32i_decode::decode(uint32_t addr, uint32_t insn)
+{
+	trace_writer out(nullptr, 64);
+
+	decode(out, addr, insn);
+	return out.str();
+}
+
+void rv32i_decode::decode(trace_writer &out, uint32_t addr, uint32_t insn)
 {
 	// Variables necessary for decoding
 	uint32_t opcode = get_opcode(insn);
@@ -18,105 +26,238 @@ std::string rv32i_decode::decode(uint32_t addr, uint32_t insn)
 
 	switch(opcode)
 	{
-		default:	   return render_illegal_insn(insn);
+		default:	   return render_illegal_insn(out, insn);
+
+		case opcode_lui:   return render_lui(out, insn);
+		case opcode_auipc: return render_auipc(out, insn);
+		case opcode_rtype:
+			switch(funct3)
+			{
+				default:  	  return render_illegal_insn(out, insn);
+				case funct3_add:
+					switch(funct7)
+					{
+						default:  	  return render_illegal_insn(out, insn);
+						case funct7_add:  return render_rtype(out, insn, "add");
+						case funct7_sub:  return render_rtype(out, insn, "sub");
+					}
+				case funct3_sll:  return render_rtype(out, insn, "sll");
+				case funct3_slt:  return render_rtype(out, insn, "slt");
+				case funct3_sltu: return render_rtype(out, insn, "sltu");
+				case funct3_xor:  return render_rtype(out, insn, "xor");
+			 	case funct3_srx:
+					switch(funct7)
+					{
+						default:         return render_illegal_insn(out, insn);
+						case funct7_srl: return render_rtype(out, insn, "srl");
+						case funct7_sra: return render_rtype(out, insn, "sra");
+					}
+				case funct3_or:   return render_rtype(out, insn, "or");
+				case funct3_and:  return render_rtype(out, insn, "and");
+			}
+		case opcode_stype:
+			switch(funct3)
+			{
+				default: 	return render_illegal_insn(out, insn);
+				case funct3_sb: return render_stype(out, insn, "sb");
+				case funct3_sh: return render_stype(out, insn, "sh");
+				case funct3_sw: return render_stype(out, insn, "sw");
+			}
+		case opcode_alu_imm:
+			switch(funct3)
+			{
+				default:          return render_illegal_insn(out, insn);
+				case funct3_sll:  return render_itype_alu(out, insn, "slli", imm_i);
+				case funct3_add:  return render_itype_alu(out, insn, "addi", imm_i);
+				case funct3_slt:  return render_itype_alu(out, insn, "slti", imm_i);
+				case funct3_sltu: return render_itype_alu(out, insn, "sltiu", imm_i);
+				case funct3_xor:  return render_itype_alu(out, insn, "xori", imm_i);
+				case funct3_or:   return render_itype_alu(out, insn, "ori", imm_i);
+				case funct3_and:  return render_itype_alu(out, insn, "andi", imm_i);
+			  	case funct3_srx:
+					switch(funct7)
+					{
+						default:         return render_illegal_insn(out, insn);
+						case funct7_srl: return render_itype_alu(out, insn, "srli", imm_i);
+						case funct7_sra: return render_itype_alu(out, insn, "srai", imm_i%XLEN);
+					}					
+			}
+		case opcode_load_imm:
+			switch(funct3)
+			{
+				default:	 return render_illegal_insn(out, insn);
+				case funct3_lb:  return render_itype_load(out, insn, "lb");
+				case funct3_lh:  return render_itype_load(out, insn, "lh");
+				case funct3_lw:  return render_itype_load(out, insn, "lw");
+				case funct3_lbu: return render_itype_load(out, insn, "lbu");
+				case funct3_lhu: return render_itype_load(out, insn, "lhu");
+			}
+		case opcode_btype:
+			switch(funct3)
+			{
+				default:	  return render_illegal_insn(out, insn);
+				case funct3_beq:  return render_btype(out, addr, insn, "beq");
+				case funct3_bne:  return render_btype(out, addr, insn, "bne");
+				case funct3_blt:  return render_btype(out, addr, insn, "blt");
+				case funct3_bge:  return render_btype(out, addr, insn, "bge");
+				case funct3_bltu: return render_btype(out, addr, insn, "bltu");
+				case funct3_bgeu: return render_btype(out, addr, insn, "bgeu");
+			}
+		case opcode_jal:  return render_jal(out, addr, insn);
+		case opcode_jalr: return render_jalr(out, insn);	
+		case opcode_system:
+			switch(insn)
+			{
+				default:  
+					switch(funct3)
+					{
+						default: 	     return render_illegal_insn(out, insn);
+						case funct3_csrrw:   return render_csrrx(out, insn, "csrrw");
+						case funct3_csrrs:   return render_csrrx(out, insn, "csrrs");
+						case funct3_csrrc:   return render_csrrx(out, insn, "csrrc");
+						case funct3_csrrwi:  return render_csrrxi(out, insn, "csrrwi");
+			 			case funct3_csrrsi:  return render_csrrxi(out, insn, "csrrsi");
+						case funct3_csrrci:  return render_csrrxi(out, insn, "csrrci");   
+					}
+				case insn_ecall:  return render_ecall(out, insn);
+				case insn_ebreak: return render_ebreak(out, insn);
+			}
+	}
+}
+
+rv32i_decode::insn_id rv32i_decode::classify(uint32_t insn)
+{
+	// Variables necessary for decoding
+	uint32_t opcode = get_opcode(insn);
+	uint32_t funct3 = get_funct3(insn);
+	uint32_t funct7 = get_funct7(insn);
+
+	switch(opcode)
+	{
+		default:	   return id_illegal;
 
-		case opcode_lui:   return render_lui(insn);
-		case opcode_auipc: return render_auipc(insn);
+		case opcode_lui:   return id_lui;
+		case opcode_auipc: return id_auipc;
 		case opcode_rtype:
 			switch(funct3)
 			{
-				default:  	  return render_illegal_insn(insn);
+				default:  	  return id_illegal;
 				case funct3_add:
 					switch(funct7)
 					{
-						default:  	  return render_illegal_insn(insn);
-						case funct7_add:  return render_rtype(insn, "add");
-						case funct7_sub:  return render_rtype(insn, "sub");
+						default:  	  return id_illegal;
+						case funct7_add:  return id_add;
+						case funct7_sub:  return id_sub;
 					}
-				case funct3_sll:  return render_rtype(insn, "sll");
-				case funct3_slt:  return render_rtype(insn, "slt");
-				case funct3_sltu: return render_rtype(insn, "sltu");
-				case funct3_xor:  return render_rtype(insn, "xor");
+				case funct3_sll:  return id_sll;
+				case funct3_slt:  return id_slt;
+				case funct3_sltu: return id_sltu;
+				case funct3_xor:  return id_xor;
 			 	case funct3_srx:
 					switch(funct7)
 					{
-						default:         return render_illegal_insn(insn);
-						case funct7_srl: return render_rtype(insn, "srl");
-						case funct7_sra: return render_rtype(insn, "sra");
+						default:         return id_illegal;
+						case funct7_srl: return id_srl;
+						case funct7_sra: return id_sra;
 					}
-				case funct3_or:   return render_rtype(insn, "or");
-				case funct3_and:  return render_rtype(insn, "and");
+				case funct3_or:   return id_or;
+				case funct3_and:  return id_and;
 			}
 		case opcode_stype:
 			switch(funct3)
 			{
-				default: 	return render_illegal_insn(insn);
-				case funct3_sb: return render_stype(insn, "sb");
-				case funct3_sh: return render_stype(insn, "sh");
-				case funct3_sw: return render_stype(insn, "sw");
+				default: 	return id_illegal;
+				case funct3_sb: return id_sb;
+				case funct3_sh: return id_sh;
+				case funct3_sw: return id_sw;
 			}
 		case opcode_alu_imm:
 			switch(funct3)
 			{
-				default:          return render_illegal_insn(insn);
-				case funct3_sll:  return render_itype_alu(insn, "slli", imm_i);
-				case funct3_add:  return render_itype_alu(insn, "addi", imm_i);
-				case funct3_slt:  return render_itype_alu(insn, "slti", imm_i);
-				case funct3_sltu: return render_itype_alu(insn, "sltiu", imm_i);
-				case funct3_xor:  return render_itype_alu(insn, "xori", imm_i);
-				case funct3_or:   return render_itype_alu(insn, "ori", imm_i);
-				case funct3_and:  return render_itype_alu(insn, "andi", imm_i);
+				default:          return id_illegal;
+				case funct3_sll:  return id_slli;
+				case funct3_add:  return id_addi;
+				case funct3_slt:  return id_slti;
+				case funct3_sltu: return id_sltiu;
+				case funct3_xor:  return id_xori;
+				case funct3_or:   return id_ori;
+				case funct3_and:  return id_andi;
 			  	case funct3_srx:
 					switch(funct7)
 					{
-						default:         return render_illegal_insn(insn);
-						case funct7_srl: return render_itype_alu(insn, "srli", imm_i);
-						case funct7_sra: return render_itype_alu(insn, "srai", imm_i%XLEN);
+						default:         return id_illegal;
+						case funct7_srl: return id_srli;
+						case funct7_sra: return id_srai;
 					}					
 			}
 		case opcode_load_imm:
 			switch(funct3)
 			{
-				default:	 return render_illegal_insn(insn);
-				case funct3_lb:  return render_itype_load(insn, "lb");
-				case funct3_lh:  return render_itype_load(insn, "lh");
-				case funct3_lw:  return render_itype_load(insn, "lw");
-				case funct3_lbu: return render_itype_load(insn, "lbu");
-				case funct3_lhu: return render_itype_load(insn, "lhu");
+				default:	 return id_illegal;
+				case funct3_lb:  return id_lb;
+				case funct3_lh:  return id_lh;
+				case funct3_lw:  return id_lw;
+				case funct3_lbu: return id_lbu;
+				case funct3_lhu: return id_lhu;
 			}
 		case opcode_btype:
 			switch(funct3)
 			{
-				default:	  return render_illegal_insn(insn);
-				case funct3_beq:  return render_btype(addr, insn, "beq");
-				case funct3_bne:  return render_btype(addr, insn, "bne");
-				case funct3_blt:  return render_btype(addr, insn, "blt");
-				case funct3_bge:  return render_btype(addr, insn, "bge");
-				case funct3_bltu: return render_btype(addr, insn, "bltu");
-				case funct3_bgeu: return render_btype(addr, insn, "bgeu");
+				default:	  return id_illegal;
+				case funct3_beq:  return id_beq;
+				case funct3_bne:  return id_bne;
+				case funct3_blt:  return id_blt;
+				case funct3_bge:  return id_bge;
+				case funct3_bltu: return id_bltu;
+				case funct3_bgeu: return id_bgeu;
 			}
-		case opcode_jal:  return render_jal(addr, insn);
-		case opcode_jalr: return render_jalr(insn);	
+		case opcode_jal:  return id_jal;
+		case opcode_jalr: return id_jalr;
 		case opcode_system:
 			switch(insn)
 			{
 				default:  
 					switch(funct3)
 					{
-						default: 	     return render_illegal_insn(insn);
-						case funct3_csrrw:   return render_csrrx(insn, "csrrw");
-						case funct3_csrrs:   return render_csrrx(insn, "csrrs");
-						case funct3_csrrc:   return render_csrrx(insn, "csrrc");
-						case funct3_csrrwi:  return render_csrrxi(insn, "csrrwi");
-			 			case funct3_csrrsi:  return render_csrrxi(insn, "csrrsi");
-						case funct3_csrrci:  return render_csrrxi(insn, "csrrci");   
+						default: 	     return id_illegal;
+						case funct3_csrrs:   return id_csrrs;
 					}
-				case insn_ecall:  return render_ecall(insn);
-				case insn_ebreak: return render_ebreak(insn);
+				case insn_ebreak: return id_ebreak;
 			}
 	}
 }
 
+/**
+ * Determines whether an instruction ends a basic block
+ *
+ * The block engine, the control flow graph and the profile all split
+ * code into blocks here.
+ *
+ * @param id The instruction
+ *
+ * @return True for anything that can change the pc or halt the hart
+ **************************************************************************/
+bool rv32i_decode::ends_block(insn_id id)
+{
+	switch(id)
+	{
+		case id_beq:
+		case id_bne:
+		case id_blt:
+		case id_bge:
+		case id_bltu:
+		case id_bgeu:
+		case id_jal:
+		case id_jalr:
+		case id_ebreak:
+		case id_csrrs:
+		case id_illegal:
+			return true;
+		default:
+			return false;
+	}
+}
+
 uint32_t rv32i_decode::get_opcode(uint32_t insn)
 {
 	return (insn & 0x0000007f);
@@ -206,166 +347,154 @@ int32_t rv32i_decode::get_imm_j(uint32_t insn)
     return imm_j;
 }
 
-std::string rv32i_decode::render_illegal_insn(uint32_t insn)
+void rv32i_decode::render_illegal_insn(trace_writer &out, uint32_t insn)
 {
-    return "ERROR: UNIMPLEMENTED INSTRUCTION";
+    out.text("ERROR: UNIMPLEMENTED INSTRUCTION");
 }
 
-std::string rv32i_decode::render_lui(uint32_t insn)
+void rv32i_decode::render_lui(trace_writer &out, uint32_t insn)
 {
     uint32_t rd = get_rd(insn);
     int32_t imm_u = get_imm_u(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic("lui") << render_reg(rd) << "," << hex::to_hex0x20(imm_u);
-
-    return os.str();
+    render_mnemonic(out, "lui");
+    render_reg(out, rd);
+    out.text(",").hex0x20(imm_u);
 }
 
-std::string rv32i_decode::render_auipc(uint32_t insn)
+void rv32i_decode::render_auipc(trace_writer &out, uint32_t insn)
 {
     uint32_t rd = get_rd(insn);
     int32_t imm_u = get_imm_u(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic("auipc") << render_reg(rd) << "," << hex::to_hex0x20(imm_u);
-
-    return os.str();
+    render_mnemonic(out, "auipc");
+    render_reg(out, rd);
+    out.text(",").hex0x20(imm_u);
 }
 
-std::string rv32i_decode::render_jal(uint32_t addr, uint32_t insn)
+void rv32i_decode::render_jal(trace_writer &out, uint32_t addr, uint32_t insn)
 {
     uint32_t rd = get_rd(insn);
     int32_t pcrel_21 = get_imm_j(insn) + addr;
 
-    std::ostringstream os;
-    os << render_mnemonic("jal") << render_reg(rd) << ",0x" << hex::to_hex32(pcrel_21);
-
-    return os.str();
+    render_mnemonic(out, "jal");
+    render_reg(out, rd);
+    out.text(",0x").hex32(pcrel_21);
 }
 
-std::string rv32i_decode::render_jalr(uint32_t insn)
+void rv32i_decode::render_jalr(trace_writer &out, uint32_t insn)
 {
     uint32_t rd = get_rd(insn);
     uint32_t rs1 = get_rs1(insn);
     int32_t imm_i = get_imm_i(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic("jalr") << render_reg(rd) << "," << render_base_disp(rs1, imm_i);
-
-    return os.str();
+    render_mnemonic(out, "jalr");
+    render_reg(out, rd);
+    out.text(",");
+    render_base_disp(out, rs1, imm_i);
 }
 
-std::string rv32i_decode::render_btype(uint32_t addr, uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_btype(trace_writer &out, uint32_t addr, uint32_t insn, const char* mnemonic)
 {
     uint32_t rs1 = get_rs1(insn);
     uint32_t rs2 = get_rs2(insn);
     int32_t pcrel_13 = get_imm_b(insn) + addr;
 
-    std::ostringstream os;
-    os << render_mnemonic(mnemonic) << render_reg(rs1) << ",x" << rs2 << ",0x" << hex::to_hex32(pcrel_13);
-
-    return os.str();
+    render_mnemonic(out, mnemonic);
+    render_reg(out, rs1);
+    out.text(",x").dec(rs2).text(",0x").hex32(pcrel_13);
 }
 
-std::string rv32i_decode::render_itype_load(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_itype_load(trace_writer &out, uint32_t insn, const char* mnemonic)
 {
     uint32_t rd = get_rd(insn);
     uint32_t rs1 = get_rs1(insn);
     int32_t imm_i = get_imm_i(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic(mnemonic) << render_reg(rd) << "," << render_base_disp(rs1, imm_i);
-
-    return os.str();
+    render_mnemonic(out, mnemonic);
+    render_reg(out, rd);
+    out.text(",");
+    render_base_disp(out, rs1, imm_i);
 }
 
-std::string rv32i_decode::render_stype(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_stype(trace_writer &out, uint32_t insn, const char* mnemonic)
 {
     uint32_t rs1 = get_rs1(insn);
     uint32_t rs2 = get_rs2(insn);
     int32_t imm_s = get_imm_s(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic(mnemonic) << render_reg(rs2) << "," << render_base_disp(rs1, imm_s);
-
-    return os.str();
+    render_mnemonic(out, mnemonic);
+    render_reg(out, rs2);
+    out.text(",");
+    render_base_disp(out, rs1, imm_s);
 }
 
-std::string rv32i_decode::render_itype_alu(uint32_t insn, const char* mnemonic, int32_t imm_i)
+void rv32i_decode::render_itype_alu(trace_writer &out, uint32_t insn, const char* mnemonic, int32_t imm_i)
 {
     uint32_t rd = get_rd(insn);
     uint32_t rs1 = get_rs1(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic(mnemonic) << render_reg(rd) << ",x" << rs1 << "," << imm_i;
-
-    return os.str();
+    render_mnemonic(out, mnemonic);
+    render_reg(out, rd);
+    out.text(",x").dec(rs1).text(",").dec(imm_i);
 }
 
-std::string rv32i_decode::render_rtype(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_rtype(trace_writer &out, uint32_t insn, const char* mnemonic)
 {
     uint32_t rd = get_rd(insn);
     uint32_t rs1 = get_rs1(insn);
     uint32_t rs2 = get_rs2(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic(mnemonic) << render_reg(rd) << ",x" << rs1 << ",x" << rs2;
-    return os.str();
+    render_mnemonic(out, mnemonic);
+    render_reg(out, rd);
+    out.text(",x").dec(rs1).text(",x").dec(rs2);
 }
 
-std::string rv32i_decode::render_ecall(uint32_t insn)
+void rv32i_decode::render_ecall(trace_writer &out, uint32_t insn)
 {
-    return ("ecall");
+    out.text("ecall");
 }
 
-std::string rv32i_decode::render_ebreak(uint32_t insn)
+void rv32i_decode::render_ebreak(trace_writer &out, uint32_t insn)
 {
-    return ("ebreak");
+    out.text("ebreak");
 }
 
-std::string rv32i_decode::render_csrrx(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_csrrx(trace_writer &out, uint32_t insn, const char* mnemonic)
 {
     uint32_t rd = get_rd(insn);
     int32_t csr = get_imm_i(insn);
     uint32_t rs1 = get_rs1(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic(mnemonic) << render_reg(rd) << "," << hex::to_hex0x12(csr) << ",x" << rs1;
-
-    return os.str();
+    render_mnemonic(out, mnemonic);
+    render_reg(out, rd);
+    out.text(",").hex0x12(csr).text(",x").dec(rs1);
 }
 
-std::string rv32i_decode::render_csrrxi(uint32_t insn, const char* mnemonic)
+void rv32i_decode::render_csrrxi(trace_writer &out, uint32_t insn, const char* mnemonic)
 {
     uint32_t rd = get_rd(insn);
     int32_t csr = get_imm_i(insn);
     uint32_t zimm = get_rs1(insn);
 
-    std::ostringstream os;
-    os << render_mnemonic(mnemonic) << render_reg(rd) << "," << hex::to_hex0x12(csr) << "," << zimm;
-
-    return os.str();
+    render_mnemonic(out, mnemonic);
+    render_reg(out, rd);
+    out.text(",").hex0x12(csr).text(",").dec(zimm);
 }
 
-std::string rv32i_decode::render_reg(int r)
+void rv32i_decode::render_reg(trace_writer &out, int r)
 {
-    std::ostringstream os;
-    os << "x" << r;
-    return os.str();
+    out.text("x").dec(r);
 }
 
-std::string rv32i_decode::render_base_disp(uint32_t base, int32_t disp)
+void rv32i_decode::render_base_disp(trace_writer &out, uint32_t base, int32_t disp)
 {
-    std::ostringstream os;
-    os << disp << "(x" << base << ")";
-
-    return os.str();
+    out.dec(disp).text("(x").dec(base).text(")");
 }
 
-std::string rv32i_decode::render_mnemonic(const std::string &m)
+void rv32i_decode::render_mnemonic(trace_writer &out, const char *m)
 {
-    std::ostringstream os;
-    os << std::setw(mnemonic_width) << setfill(' ') << left << m;
-    return os.str();
-}
\ No newline at end of file
+    size_t start = out.mark();
+
+    out.text(m).pad(start, mnemonic_width);
+}
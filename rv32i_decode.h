@@ -3,6 +3,7 @@
 #include <string>
 #include <cstdint>
 #include "memory.h"
+#include "trace_writer.h"
 
 class rv32i_decode : public hex
 {
@@ -11,9 +12,34 @@ public:
 	///@parm addr The memory address where the insn is stored.
 	static std::string decode(uint32_t addr, uint32_t insn);
 
+	// The same, rendered onto the end of out
+	static void decode(trace_writer &out, uint32_t addr, uint32_t insn);
+
 protected:
 	static constexpr int mnemonic_width = 8;
 
+	// Compact IDs for the instructions the simulator executes. id_none
+	// is never returned by classify() and marks an empty decode slot.
+	enum insn_id
+	{
+		id_none, id_illegal,
+		id_lui, id_auipc, id_jal, id_jalr,
+		id_beq, id_bne, id_blt, id_bge, id_bltu, id_bgeu,
+		id_lb, id_lh, id_lw, id_lbu, id_lhu,
+		id_sb, id_sh, id_sw,
+		id_addi, id_slti, id_sltiu, id_xori, id_ori, id_andi,
+		id_slli, id_srli, id_srai,
+		id_add, id_sub, id_sll, id_slt, id_sltu, id_xor, id_srl, id_sra, id_or, id_and,
+		id_ebreak, id_csrrs,
+		id_count
+	};
+
+	static insn_id classify(uint32_t insn);
+
+	// True for a branch, jal, jalr, ebreak, csrrs or illegal
+	// instruction, the ones that end a basic block
+	static bool ends_block(insn_id id);
+
 	static constexpr uint32_t opcode_lui			= 0b0110111;
 	static constexpr uint32_t opcode_auipc			= 0b0010111;
 	static constexpr uint32_t opcode_jal			= 0b1101111;
@@ -81,30 +107,30 @@ protected:
 
 	static constexpr uint32_t XLEN = 32;
 
-	static std::string render_illegal_insn(uint32_t insn);
-	static std::string render_lui(uint32_t insn);
-	static std::string render_auipc(uint32_t insn);
+	static void render_illegal_insn(trace_writer &out, uint32_t insn);
+	static void render_lui(trace_writer &out, uint32_t insn);
+	static void render_auipc(trace_writer &out, uint32_t insn);
 
 	///@parm addr The memory address where the insn is stored.
-	static std::string render_jal(uint32_t addr, uint32_t insn);
+	static void render_jal(trace_writer &out, uint32_t addr, uint32_t insn);
 
-	static std::string render_jalr(uint32_t insn);
+	static void render_jalr(trace_writer &out, uint32_t insn);
 
 	///@parm addr The memory address where the insn is stored.
-	static std::string render_btype(uint32_t addr, uint32_t insn, const char *mnemonic);
-
-	static std::string render_itype_load(uint32_t insn, const char *mnemonic);
-	static std::string render_stype(uint32_t insn, const char *mnemonic);
-	static std::string render_itype_alu(uint32_t insn, const char *mnemonic, int32_t imm_i);
-	static std::string render_rtype(uint32_t insn, const char *mnemonic);
-	static std::string render_ecall(uint32_t insn);
-	static std::string render_ebreak(uint32_t insn);
-	static std::string render_csrrx(uint32_t insn, const char *mnemonic);
-	static std::string render_csrrxi(uint32_t insn, const char *mnemonic);
-
-	static std::string render_reg(int r);
-	static std::string render_base_disp(uint32_t base, int32_t disp);
-	static std::string render_mnemonic(const std::string &m);
+	static void render_btype(trace_writer &out, uint32_t addr, uint32_t insn, const char *mnemonic);
+
+	static void render_itype_load(trace_writer &out, uint32_t insn, const char *mnemonic);
+	static void render_stype(trace_writer &out, uint32_t insn, const char *mnemonic);
+	static void render_itype_alu(trace_writer &out, uint32_t insn, const char *mnemonic, int32_t imm_i);
+	static void render_rtype(trace_writer &out, uint32_t insn, const char *mnemonic);
+	static void render_ecall(trace_writer &out, uint32_t insn);
+	static void render_ebreak(trace_writer &out, uint32_t insn);
+	static void render_csrrx(trace_writer &out, uint32_t insn, const char *mnemonic);
+	static void render_csrrxi(trace_writer &out, uint32_t insn, const char *mnemonic);
+
+	static void render_reg(trace_writer &out, int r);
+	static void render_base_disp(trace_writer &out, uint32_t base, int32_t disp);
+	static void render_mnemonic(trace_writer &out, const char *m);
 };
 
 #endif
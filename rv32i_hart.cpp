@@ -1,10 +1,14 @@
 #include "hex.h"
 #include "rv32i_decode.h"
+#include "rv32i_jit.h"
 #include "rv32i_hart.h"
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <cstdint>
 #include <string>
+#include <memory>
+#include <unordered_map>
 
 using namespace std;
 
@@ -19,8 +23,12 @@ void rv32i_hart::reset()
     pc = 0;
     regs.reset();
     insn_counter = 0;
+    fused_counter = 0;
+    changed_regs = 0;
+    regs_dumped = false;
     halt = false;
     halt_reason = "none";
+    std::fill(pc_profile.begin(), pc_profile.end(), 0);
 }
 
 /**
@@ -33,16 +41,59 @@ void rv32i_hart::reset()
  **************************************************************************/
 void rv32i_hart::dump(const std::string &hdr) const
 {
-	regs.dump(hdr);
+	trace_writer w(out);
 
-	std::cout << " pc " << hex::to_hex32(pc) << endl;
+	dump(w, hdr);
+}
+
+/**
+ * Renders the entire state of the hart onto the end of out
+ *
+ * @param out Where the registers are rendered
+ * @param hdr A header string used in printing
+ **************************************************************************/
+void rv32i_hart::dump(trace_writer &out, const std::string &hdr) const
+{
+	regs.dump(out, hdr);
+
+	out.text(hdr).text(" pc ").hex32(pc).end_line();
+}
+
+/**
+ * Renders the pc and the registers written since the last dump
+ *
+ * @param out Where the registers are rendered
+ * @param hdr A header string used in printing
+ **************************************************************************/
+void rv32i_hart::dump_changes(trace_writer &out, const std::string &hdr) const
+{
+	out.text(hdr).text(" pc ").hex32(pc);
+	regs.dump_changed(out, changed_regs);
+	out.end_line();
+}
+
+/**
+ * Carries on the register dumps of a run from part way through
+ *
+ * @param insns The number of instructions run so far
+ * @param changed The registers written by the last of them
+ **************************************************************************/
+void rv32i_hart::resume_dumps(uint64_t insns, uint32_t changed)
+{
+	insn_counter = insns;
+	regs.set_written(changed);
+	regs_dumped = true;
 }
 
 /**
  * Used to tell the program how to execute a given instruction
  *
  * Tracks the instruction counter while checking the register & instruction
- * flags in order to determine the output.
+ * flags in order to determine the output. With a register delta, the
+ * registers are dumped in full only every so often, and in between just
+ * the ones written since the dump before. Aligned instructions inside of
+ * memory are taken from the decode cache, and are only fetched and decoded
+ * the first time they are executed.
  *
  * @param hdr A header string used in printing
  **************************************************************************/
@@ -53,151 +104,1200 @@ void rv32i_hart::tick(const std::string &hdr)
 	if (halt) return;
 	else
 	{
+		bool show_insns = show_instructions;
+		bool show_regs = show_registers;
+
+		if(window.kind != trace_window::all && !in_window())
+			show_insns = show_regs = false;
+
 		insn_counter++;
-		if(show_registers) dump(hdr);
+		changed_regs = regs.take_written();
+
+		// Only the first dump after a gap needs to be a full one,
+		// apart from every register_delta instructions
+		if(show_regs)
+		{
+			if(register_delta && regs_dumped && (insn_counter - 1) % register_delta)
+				dump_changes(trace_out, hdr);
+			else
+				dump(trace_out, hdr);
+		}
+		regs_dumped = show_regs;
+
+		decoded_insn *d = uncached ? nullptr : lookup(pc);
+
+		// Misaligned or out of range pc, or the reference, fetch and
+		// decode the slow way
+		if(!d)
+		{
+			insn = mem.get32(pc);
+
+			if(pc_counts && mem.in_range(pc, 4))
+				profile(pc, 1);
+			if(show_insns)
+				trace_out.text(hdr).hex32(pc).text(": ").hex32(insn).text("  ");
+			exec(insn, show_insns);
+			return;
+		}
 
-		insn = mem.get32(pc);
+		trace_record *r = recorder ? record(*d) : nullptr;
+
+		if(pc_counts)
+			profile(pc, 1);
 
 		// Check if instruction will execute without rendering anything
-		if(show_instructions) 
+		if(show_insns)
 		{
-			cout << hdr << hex::to_hex32(pc) << ": " << hex::to_hex32(insn) << "  ";
-			exec(insn, &std::cout);	
+			trace_out.text(hdr).hex32(pc).text(": ").hex32(d->insn).text("  ");
+			(this->*trace_table[d->id])(d);
 		}
-		else exec(insn, nullptr);
+		else (this->*exec_table[d->id])(d);
+
+		if(r)
+			record_result(*r, *d);
+	}
+}
+
+/**
+ * Checks whether the next instruction is inside the trace window
+ *
+ * The hit'th run of the instruction at the start of a hit window turns
+ * it into a window of instructions from there on. hits and count are
+ * both at least 1.
+ *
+ * @return True if the instruction is to be shown
+ **************************************************************************/
+bool rv32i_hart::in_window()
+{
+	switch(window.kind)
+	{
+		default:
+			return true;
+
+		case trace_window::hit:
+			if(pc != window.lo || --window.hits != 0)
+				return false;
+
+			window.kind = trace_window::insns;
+			window.first = insn_counter;
+			if(window.count - 1 > UINT64_MAX - insn_counter)
+				window.last = UINT64_MAX;
+			else
+				window.last = insn_counter + window.count - 1;
+			return true;
+
+		case trace_window::insns:
+			return insn_counter >= window.first && insn_counter <= window.last;
+
+		case trace_window::pcs:
+			return pc >= window.lo && pc <= window.hi;
+	}
+}
+
+/**
+ * Works out how far the hart can run before the trace window opens
+ *
+ * Windows of instructions are known in advance. The others depend on the
+ * pc, so every instruction has to be checked by tick().
+ *
+ * @return The number of instructions that can be run without tick(), or
+ *	UINT64_MAX if nothing more will ever be shown
+ **************************************************************************/
+uint64_t rv32i_hart::untraced_budget() const
+{
+	if(!show_instructions && !show_registers)
+		return UINT64_MAX;
+
+	switch(window.kind)
+	{
+		default:
+			return 0;
+
+		case trace_window::insns:
+			if(insn_counter < window.first)
+				return window.first - insn_counter;
+			return insn_counter > window.last ? UINT64_MAX : 0;
 	}
 }
 
 /**
  * Executes a given instruction 
  *
- * Uses a switch/case to determine which execute function will be
- * called. Defaults to an illegal instruction if none is found.
+ * Decodes the instruction and calls the execute function for its
+ * compact ID.
  *
  * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param show Render out the details of what is simulated
+ **************************************************************************/
+void rv32i_hart::exec(uint32_t insn, bool show)
+{
+	decoded_insn d;
+
+	predecode(insn, d);
+	trace_record *r = recorder ? record(d) : nullptr;
+
+	if(show)
+		(this->*trace_table[d.id])(&d);
+	else
+		(this->*exec_table[d.id])(&d);
+
+	if(r)
+		record_result(*r, d);
+}
+
+/**
+ * Starts the binary trace record for an instruction
+ *
+ * Everything that depends on the state before the instruction runs is
+ * filled in here: the address of a load or store, the value it loads
+ * or stores, and whether it raises an access fault. rd_value is set up
+ * for a load in case the access faults and the handler never returns.
+ *
+ * @param d The predecoded instruction about to be executed
+ *
+ * @return The record, to be finished by record_result()
  **************************************************************************/
-void rv32i_hart::exec(uint32_t insn, std::ostream* pos)
+trace_record *rv32i_hart::record(const decoded_insn &d)
 {
-	// Variables necessary for decoding
-	uint32_t opcode = get_opcode(insn);
-	uint32_t funct3 = get_funct3(insn);
-	uint32_t funct7 = get_funct7(insn);
+	trace_record &r = recorder->next();
+	uint32_t len;
 
-	switch(opcode)
+	r.pc = pc;
+	r.insn = d.insn;
+	r.rd_value = 0;
+	r.mem_addr = 0;
+	r.mem_value = 0;
+	r.flags = 0;
+
+	switch(d.id)
 	{
-		default:	   exec_illegal_insn(insn, pos); return;
+		default:	return &r;
+
+		case id_lb:
+		case id_lbu:
+		case id_sb:	len = 1; break;
+		case id_lh:
+		case id_lhu:
+		case id_sh:	len = 2; break;
+		case id_lw:
+		case id_sw:	len = 4; break;
+	}
 
-		case opcode_lui:   exec_lui(insn, pos); return;
-		case opcode_auipc: exec_auipc(insn, pos); return;
-		case opcode_rtype:
-			switch(funct3)
-			{
-				default:  	  exec_illegal_insn(insn, pos); return;
-				case funct3_add:
-					switch(funct7)
-					{
-						default:  	  exec_illegal_insn(insn, pos); return;
-						case funct7_add:  return exec_add(insn, pos); return;
-						case funct7_sub:  return exec_sub(insn, pos); return;
-					}
-			    case funct3_sll:  exec_sll(insn, pos); return;
-				case funct3_slt:  exec_slt(insn, pos); return;
-				case funct3_sltu: exec_sltu(insn, pos); return;
-				case funct3_xor:  exec_xor(insn, pos); return;
-			 	case funct3_srx:
-					switch(funct7)
-					{
-						default:         exec_illegal_insn(insn, pos); return;
-						case funct7_srl: exec_srl(insn, pos); return;
-						case funct7_sra: exec_sra(insn, pos); return;
-					}
-				case funct3_or:   exec_or(insn, pos); return;
-				case funct3_and:  exec_and(insn, pos); return;
-			}
-		case opcode_stype:
-			switch(funct3)
-			{
-				default: 	exec_illegal_insn(insn, pos); return;
-				case funct3_sb: exec_sb(insn, pos); return;
-				case funct3_sh: exec_sh(insn, pos); return;
-				case funct3_sw: exec_sw(insn, pos); return;
-			}
-		case opcode_alu_imm:
-			switch(funct3)
-			{
-				default:          exec_illegal_insn(insn, pos); return;
-				case funct3_sll:  exec_slli(insn, pos); return;
-				case funct3_add:  exec_addi(insn, pos); return;
-				case funct3_slt:  exec_slti(insn, pos); return;
-				case funct3_sltu: exec_sltiu(insn, pos); return;
-				case funct3_xor:  exec_xori(insn, pos); return;
-				case funct3_or:   exec_ori(insn, pos); return;
-				case funct3_and:  exec_andi(insn, pos); return;
-			  	case funct3_srx:
-					switch(funct7)
-					{
-						default:         exec_illegal_insn(insn, pos); return;
-						case funct7_srl: exec_srli(insn, pos); return;
-						case funct7_sra: exec_srai(insn, pos); return;
-					}					
-			}
-		case opcode_load_imm:
-			switch(funct3)
-			{
-				default:	 exec_illegal_insn(insn, pos); return;
-				case funct3_lb:  exec_lb(insn, pos); return;
-				case funct3_lh:  exec_lh(insn, pos); return;
-				case funct3_lw:  exec_lw(insn, pos); return;
-				case funct3_lbu: exec_lbu(insn, pos); return;
-				case funct3_lhu: exec_lhu(insn, pos); return;
-			}
-		case opcode_btype:
-			switch(funct3)
+	uint32_t addr = regs.get(d.rs1) + d.imm;
+	bool ok = mem.in_range(addr, len);
+
+	r.mem_addr = addr;
+	if(!ok && halt_on_fault)
+		r.flags = trace_recorder::flag_fault;
+
+	// An out of range load gives 0
+	switch(d.id)
+	{
+		default:	break;
+
+		case id_lb:	r.mem_value = ok ? (int8_t)mem.get8_unchecked(addr) : 0; break;
+		case id_lbu:	r.mem_value = ok ? mem.get8_unchecked(addr) : 0; break;
+		case id_lh:	r.mem_value = ok ? (int16_t)mem.get16_unchecked(addr) : 0; break;
+		case id_lhu:	r.mem_value = ok ? mem.get16_unchecked(addr) : 0; break;
+		case id_lw:	r.mem_value = ok ? mem.get32_unchecked(addr) : 0; break;
+		case id_sb:	r.mem_value = regs.get(d.rs2) & 0x000000ff; return &r;
+		case id_sh:	r.mem_value = regs.get(d.rs2) & 0x0000ffff; return &r;
+		case id_sw:	r.mem_value = regs.get(d.rs2); return &r;
+	}
+
+	if(r.flags & trace_recorder::flag_fault)
+		r.rd_value = regs.get(d.rd);
+	else
+		r.rd_value = d.rd ? r.mem_value : 0;
+	return &r;
+}
+
+/**
+ * Records instructions that were run as translated code
+ *
+ * The pc and instruction word come from the block, everything else from
+ * the trail the code left behind.
+ *
+ * @param addr The address of the first instruction
+ * @param d The slots of the instructions
+ * @param n The number of instructions run
+ **************************************************************************/
+void rv32i_hart::record_trail(uint32_t addr, const decoded_insn *d, uint32_t n)
+{
+	for(uint32_t i = 0; i < n; i++)
+	{
+		trace_record &r = recorder->next();
+		const rv32i_jit::trail_entry &t = trail[i];
+
+		r.pc = addr + i * 4;
+		r.insn = d[i].insn;
+		r.rd_value = 0;
+		r.mem_addr = 0;
+		r.mem_value = 0;
+		r.flags = 0;
+
+		switch(d[i].id)
+		{
+			default:
+				if(writes_rd(d[i].id) && d[i].rd)
+					r.rd_value = t.rd_value;
+				break;
+
+			case id_lb:
+			case id_lbu:
+			case id_lh:
+			case id_lhu:
+			case id_lw:
+				r.mem_addr = t.mem_addr;
+				r.mem_value = t.mem_value;
+				r.rd_value = d[i].rd ? t.mem_value : 0;
+				break;
+
+			case id_sb:	r.mem_addr = t.mem_addr; r.mem_value = t.mem_value & 0x000000ff; break;
+			case id_sh:	r.mem_addr = t.mem_addr; r.mem_value = t.mem_value & 0x0000ffff; break;
+			case id_sw:	r.mem_addr = t.mem_addr; r.mem_value = t.mem_value; break;
+		}
+	}
+}
+
+/**
+ * Finishes the binary trace record for an instruction that has run
+ *
+ * @param r The record from record()
+ * @param d The predecoded instruction that was executed
+ **************************************************************************/
+void rv32i_hart::record_result(trace_record &r, const decoded_insn &d)
+{
+	if(writes_rd(d.id))
+		r.rd_value = regs.get(d.rd);
+}
+
+/**
+ * Determines whether an instruction has an rd
+ *
+ * @param id The instruction
+ *
+ * @return False for the instructions that have no rd
+ **************************************************************************/
+bool rv32i_hart::writes_rd(insn_id id)
+{
+	switch(id)
+	{
+		default:
+			return true;
+
+		case id_illegal:
+		case id_beq:
+		case id_bne:
+		case id_blt:
+		case id_bge:
+		case id_bltu:
+		case id_bgeu:
+		case id_sb:
+		case id_sh:
+		case id_sw:
+		case id_ebreak:
+			return false;
+	}
+}
+
+/**
+ * Renders a binary trace record on its own
+ *
+ * Without the registers from before the instruction, this can only show
+ * the disassembly and what the instruction left behind: the value of rd,
+ * and the address and value of a load or store.
+ *
+ * @param out Where the record is rendered
+ * @param hdr A header string used in printing
+ * @param r The record
+ **************************************************************************/
+void rv32i_hart::render_record(trace_writer &out, const std::string &hdr, const trace_record &r)
+{
+	insn_id id = classify(r.insn);
+	uint32_t rd = (r.insn >> 7) & 0x1f;
+	const char *access = nullptr;
+	bool store = false;
+
+	switch(id)
+	{
+		default:	break;
+
+		case id_sb:	store = true; // fall through
+		case id_lb:
+		case id_lbu:	access = "m8("; break;
+		case id_sh:	store = true; // fall through
+		case id_lh:
+		case id_lhu:	access = "m16("; break;
+		case id_sw:	store = true; // fall through
+		case id_lw:	access = "m32("; break;
+	}
+
+	out.text(hdr).hex32(r.pc).text(": ").hex32(r.insn).text("  ");
+	size_t start = out.mark();
+	decode(out, r.pc, r.insn);
+
+	if(r.flags & trace_recorder::flag_fault)
+		out.pad(start, instruction_width).text("// ").text(access).hex0x32(r.mem_addr).text(") is out of range");
+	else if(store)
+		out.pad(start, instruction_width).text("// ").text(access).hex0x32(r.mem_addr).text(") = ").hex0x32(r.mem_value);
+	else if(writes_rd(id) && rd != 0)
+	{
+		out.pad(start, instruction_width).text("// x").dec(rd).text(" = ");
+		if(access)
+			out.text(access).hex0x32(r.mem_addr).text(") = ");
+		out.hex0x32(r.rd_value);
+	}
+	out.end_line();
+}
+
+/**
+ * Executes an instruction again from its binary trace record
+ *
+ * The recorded instruction word is put into memory at the pc, and a
+ * load's recorded value at its address, so the hart runs and renders it
+ * just as it did when it was recorded. The registers are rebuilt as
+ * each instruction runs, which is why a trace is always replayed from
+ * its first record.
+ *
+ * @param r The record of the instruction
+ * @param hdr A header string used in printing
+ **************************************************************************/
+void rv32i_hart::replay(const trace_record &r, const std::string &hdr)
+{
+	pc = r.pc;
+	if(mem.in_range(pc, 4) && mem.get32(pc) != r.insn)
+		mem.set32(pc, r.insn);
+
+	switch(classify(r.insn))
+	{
+		default:	break;
+
+		case id_lb:
+		case id_lbu:
+			if(mem.in_range(r.mem_addr, 1))
+				mem.set8(r.mem_addr, r.mem_value);
+			break;
+		case id_lh:
+		case id_lhu:
+			if(mem.in_range(r.mem_addr, 2))
+				mem.set16(r.mem_addr, r.mem_value);
+			break;
+		case id_lw:
+			if(mem.in_range(r.mem_addr, 4))
+				mem.set32(r.mem_addr, r.mem_value);
+			break;
+	}
+
+	halt_on_fault = r.flags & trace_recorder::flag_fault;
+	tick(hdr);
+}
+
+/**
+ * Finds the decode cache slot for an address
+ *
+ * The slot is filled from memory on the first lookup and then reused
+ * until a store into that word invalidates it.
+ *
+ * @param addr The address of the instruction
+ *
+ * @return The slot, or nullptr if addr is misaligned or out of range
+ **************************************************************************/
+rv32i_hart::decoded_insn *rv32i_hart::lookup(uint32_t addr)
+{
+	if((addr & 3) || addr > mem.get_size() - 4)
+		return nullptr;
+
+	std::unique_ptr<decoded_insn[]> &page = dcache[addr >> dcache_page_bits];
+	if(!page)
+	{
+		// Value initialized, so every slot starts out empty
+		page.reset(new decoded_insn[dcache_page_slots + 1]());
+	}
+
+	uint32_t slot = (addr >> 2) & (dcache_page_slots - 1);
+	decoded_insn *d = &page[slot];
+	if(d->id == id_none)
+	{
+		// Watched before it is read, see watch_code()
+		mem.watch_code(addr);
+		predecode(mem.get32(addr), *d);
+
+		// Pair it up with whichever neighbours are already cached.
+		// Pairs never span pages, the last slot's neighbour is the
+		// empty one on the end.
+		if(slot > 0)
+			page[slot - 1].fused = pair(page[slot - 1], *d);
+		d->fused = pair(*d, d[1]);
+	}
+	return d;
+}
+
+/**
+ * Invalidates any decode cache slots that were just stored into
+ *
+ * @param addr The first address written
+ * @param len The number of bytes written
+ **************************************************************************/
+void rv32i_hart::code_modified(uint32_t addr, uint32_t len)
+{
+	uint32_t last = (addr + len - 1) & ~3u;
+
+	for(uint32_t a = addr & ~3u; ; a += 4)
+	{
+		std::unique_ptr<decoded_insn[]> &page = dcache[a >> dcache_page_bits];
+		uint32_t slot = (a >> 2) & (dcache_page_slots - 1);
+		if(page && page[slot].id != id_none)
+		{
+			page[slot] = decoded_insn();
+			if(slot > 0)
+				page[slot - 1].fused = fuse_none;
+			blocks_stale = true;
+		}
+
+		if(a == last)
+			break;
+	}
+}
+
+/**
+ * Executes basic blocks until the budget would be overrun
+ *
+ * The halt and budget checks are made once per block rather than once
+ * per instruction. After each block the successor is taken from the
+ * block's links when the new pc matches one of them, otherwise it is
+ * looked up and linked in for the next time.
+ *
+ * Loads and stores are made without range checks. One that is out of
+ * range faults back to here, where the instructions of the block ahead
+ * of it are counted from the pc and it is run again with the checks.
+ *
+ * With a recorder every instruction is recorded as it runs, translated
+ * code through the trail it leaves.
+ *
+ * @param budget The most instructions that may be executed
+ *
+ * @return The number of instructions that were executed
+ **************************************************************************/
+uint64_t rv32i_hart::run_blocks(uint64_t budget)
+{
+	// Kept in memory across the jump back from a fault
+	volatile uint64_t executed = 0;
+	basic_block *volatile b = nullptr;
+	volatile bool native = false;
+
+	memory::fault_guard guard(mem);
+	if(sigsetjmp(guard.env, 0))
+	{
+		uint32_t at = lookup(pc) - b->insns;
+		uint64_t done = at + 1;
+
+		// Along with the passes a translated loop made before
+		if(native)
+			done += loop.done;
+		if(pc_counts)
+			profile_passes(pc - at * 4, b->len, done);
+
+		// The interpreter records an instruction before running it,
+		// translated code leaves it to be done here
+		if(recorder && native)
+		{
+			record_trail(pc - at * 4, b->insns, at);
+			record(b->insns[at]);
+		}
+		retry_access();
+		executed += done;
+		insn_counter += done;
+		return executed;
+	}
+
+	while(!halt)
+	{
+		if(blocks_stale)
+		{
+			blocks.clear();
+			if(jit)
+				jit->reset();
+			blocks_stale = false;
+			b = nullptr;
+		}
+
+		if(!b && !(b = find_block(pc)))
+			break;
+
+		if(b->len > budget - executed)
+			break;
+
+		// Translated code runs as much of the block as it can and
+		// the interpreter picks up from wherever it stopped
+		uint32_t start = pc;
+		uint32_t i = 0;
+		if(b->native)
+		{
+			loop.done = 0;
+			loop.room = std::min<uint64_t>(budget - executed, 1u << 31);
+			native = true;
+			uint64_t r = b->native(this, regs.data(), trail.data());
+			native = false;
+			pc = r;
+			i = r >> 32;
+			if(recorder)
+				record_trail(start, b->insns, i);
+		}
+		else if(jit && ++b->hits == rv32i_jit::hot_threshold)
+			translate_block(pc, b);
+
+		// A store into cached code ends the block right away
+		if(recorder)
+		{
+			while(i < b->len && !blocks_stale)
 			{
-				default:	  exec_illegal_insn(insn, pos); return;
-				case funct3_beq:  exec_beq(insn, pos); return;
-				case funct3_bne:  exec_bne(insn, pos); return;
-				case funct3_blt:  exec_blt(insn, pos); return;
-				case funct3_bge:  exec_bge(insn, pos); return;
-				case funct3_bltu: exec_bltu(insn, pos); return;
-				case funct3_bgeu: exec_bgeu(insn, pos); return;
+				const decoded_insn *d = &b->insns[i++];
+				trace_record *r = record(*d);
+				(this->*exec_table[d->id])(d);
+				record_result(*r, *d);
 			}
-		case opcode_jal:  exec_jal(insn, pos); return;
-		case opcode_jalr: exec_jalr(insn, pos); return;
-		case opcode_system:
-			switch(insn)
+		}
+		else
+		{
+			while(i < b->len && !blocks_stale)
 			{
-				default:  
-					switch(funct3)
-					{
-						default: 	     exec_illegal_insn(insn, pos); return;
-						case funct3_csrrs:   exec_csrrs(insn, pos); return;
-					}
-				case insn_ebreak: exec_ebreak(insn, pos); return;
+				const decoded_insn *d = &b->insns[i++];
+				(this->*exec_table[d->id])(d);
 			}
+		}
+		executed += i;
+		insn_counter += i;
+		if(pc_counts)
+			profile_passes(start, b->len, i);
+
+		if(blocks_stale)
+			continue;
+
+		// Follow or make a link to the successor block
+		basic_block *prev = b;
+		if(pc == prev->next_pc[0] && prev->next[0])
+			b = prev->next[0];
+		else if(pc == prev->next_pc[1] && prev->next[1])
+			b = prev->next[1];
+		else if((b = find_block(pc)))
+		{
+			int slot = prev->next[0] ? 1 : 0;
+			prev->next_pc[slot] = pc;
+			prev->next[slot] = b;
+		}
 	}
 
-					
+	return executed;
 }
 
+/**
+ * Executes instructions by chaining from one handler to the next
+ *
+ * There is no decode switch here: each slot is dispatched through the
+ * untraced handler table by its compact ID, and the handler hands back
+ * the next slot to run. Straight-line code just steps to the following
+ * slot.
+ *
+ * Loads and stores are made without range checks. One that is out of
+ * range faults back to here and is run again with the checks.
+ *
+ * @param budget The most instructions that may be executed
+ *
+ * @return The number of instructions that were executed
+ **************************************************************************/
+uint64_t rv32i_hart::run_threaded(uint64_t budget)
+{
+	// Kept in memory across the jump back from a fault
+	volatile uint64_t executed = 0;
+
+	memory::fault_guard guard(mem);
+	if(sigsetjmp(guard.env, 0))
+	{
+		retry_access();
+		executed++;
+		insn_counter += executed;
+		return executed;
+	}
+
+	const decoded_insn *d = lookup(pc);
+
+	while(d && executed < budget)
+	{
+		// Slots past the end of a page or that have been stored over
+		// are empty, and are filled in on the way past
+		if(d->id == id_none && !(d = lookup(pc)))
+			break;
+
+		// A fused pair only runs as one when both halves fit in the
+		// budget, so the limit always stops on the same instruction.
+		// Each half needs a record of its own when recording.
+		if(d->fused != fuse_none && budget - executed >= 2 && !recorder)
+		{
+			if(pc_counts)
+				profile(pc, 2);
+			d = (this->*fused_table[d->fused])(d);
+			executed += 2;
+			fused_counter++;
+			continue;
+		}
+
+		if(pc_counts)
+			profile(pc, 1);
+		if(recorder)
+		{
+			const decoded_insn *cur = d;
+			trace_record *r = record(*cur);
+
+			d = (this->*exec_table[cur->id])(cur);
+			record_result(*r, *cur);
+		}
+		else
+			d = (this->*exec_table[d->id])(d);
+		executed++;
+	}
+
+	insn_counter += executed;
+	return executed;
+}
+
+/**
+ * Moves the pc for a jump or branch
+ *
+ * @param d The slot of the jump or branch
+ * @param target The address to continue at
+ *
+ * @return The following slot when target is the next instruction,
+ *	otherwise the cached slot for target, or nullptr if there isn't one
+ **************************************************************************/
+const rv32i_hart::decoded_insn *rv32i_hart::jump_to(const decoded_insn *d, uint32_t target)
+{
+	bool sequential = (target == pc + 4);
+
+	pc = target;
+	return sequential ? d + 1 : lookup(pc);
+}
+
+/**
+ * Runs the load or store at pc again with range checks
+ *
+ * Called when an unchecked access has faulted. Nothing was loaded or
+ * stored and the pc has not moved, so this finishes the instruction the
+ * way the checked accessors would have: a warning, and a load of 0 or
+ * a dropped store. Or it halts the hart when access faults do that.
+ **************************************************************************/
+void rv32i_hart::retry_access()
+{
+	decoded_insn d;
+	predecode(mem.get32(pc), d);
+
+	uint32_t addr = regs.get(d.rs1) + d.imm;
+	if(halt_on_fault)
+	{
+		access_fault(addr, d.id == id_sb || d.id == id_sh || d.id == id_sw);
+		return;
+	}
+
+	switch(d.id)
+	{
+		case id_lb:	regs.set(d.rd, mem.get8_sx(addr)); break;
+		case id_lh:	regs.set(d.rd, mem.get16_sx(addr)); break;
+		case id_lw:	regs.set(d.rd, mem.get32_sx(addr)); break;
+		case id_lbu:	regs.set(d.rd, mem.get8(addr)); break;
+		case id_lhu:	regs.set(d.rd, mem.get16(addr)); break;
+		case id_sb:	mem.set8(addr, regs.get(d.rs2)); break;
+		case id_sh:	mem.set16(addr, regs.get(d.rs2)); break;
+		case id_sw:	mem.set32(addr, regs.get(d.rs2)); break;
+		default:	break;
+	}
+	pc += 4;
+}
+
+/**
+ * Raises an access fault for an out of range load or store
+ *
+ * The instruction does not complete, the pc is left pointing at it.
+ *
+ * @param addr The address of the access
+ * @param store True for a store, false for a load
+ *
+ * @return nullptr, as the hart has halted
+ **************************************************************************/
+const rv32i_hart::decoded_insn *rv32i_hart::access_fault(uint32_t addr, bool store)
+{
+	mem.record_fault(addr, store);
+	halt = true;
+	halt_reason = store ? "Store access fault" : "Load access fault";
+	return nullptr;
+}
+
+/**
+ * Determines if two neighbouring instructions can be fused
+ *
+ * Only the idioms compilers emit are matched, and the first instruction
+ * always writes a real register that the second one then reads.
+ *
+ * @param d The first instruction
+ * @param n The instruction after it, which may be an empty slot
+ *
+ * @return The kind of pair, or fuse_none
+ **************************************************************************/
+rv32i_hart::fuse_kind rv32i_hart::pair(const decoded_insn &d, const decoded_insn &n)
+{
+	if(d.rd == 0)
+		return fuse_none;
+
+	switch(d.id)
+	{
+		case id_lui:
+			if(n.id == id_addi && n.rs1 == d.rd)
+				return fuse_lui_addi;
+			break;
+
+		case id_auipc:
+			if(n.id == id_jalr && n.rs1 == d.rd)
+				return fuse_auipc_jalr;
+			break;
+
+		case id_slt:
+		case id_sltu:
+		case id_slti:
+		case id_sltiu:
+			if((n.id == id_beq || n.id == id_bne) && n.rs1 == d.rd && n.rs2 == 0)
+				return fuse_slt_branch;
+			break;
+
+		case id_addi:
+			if(n.id == id_bne && (n.rs1 == d.rd || n.rs2 == d.rd))
+				return fuse_addi_bne;
+			break;
+
+		default:
+			break;
+	}
+	return fuse_none;
+}
+
+// The handler for each kind of fused pair
+const rv32i_hart::exec_fn rv32i_hart::fused_table[fuse_count] =
+{
+	nullptr, &rv32i_hart::fused_lui_addi, &rv32i_hart::fused_auipc_jalr,
+	&rv32i_hart::fused_slt_branch, &rv32i_hart::fused_addi_bne
+};
+
+/**
+ * Loads a 32 bit constant with a lui and addi pair
+ *
+ * @param d The slot of the lui
+ *
+ * @return The slot after the addi
+ **************************************************************************/
+const rv32i_hart::decoded_insn *rv32i_hart::fused_lui_addi(const decoded_insn *d)
+{
+	const decoded_insn *n = d + 1;
+
+	regs.set(d->rd, d->imm);
+	regs.set(n->rd, (uint32_t)d->imm + n->imm);
+	pc += 8;
+	return d + 2;
+}
+
+/**
+ * Makes a pc relative call or jump with an auipc and jalr pair
+ *
+ * @param d The slot of the auipc
+ *
+ * @return The slot of the target, or nullptr if it isn't in the cache
+ **************************************************************************/
+const rv32i_hart::decoded_insn *rv32i_hart::fused_auipc_jalr(const decoded_insn *d)
+{
+	const decoded_insn *n = d + 1;
+	uint32_t base = pc + d->imm;
+
+	regs.set(d->rd, base);
+	regs.set(n->rd, pc + 8);
+	pc += 4;
+	return jump_to(n, (base + n->imm) & 0xfffffffe);
+}
+
+/**
+ * Branches on the result of a set less than
+ *
+ * @param d The slot of the slt, sltu, slti or sltiu
+ *
+ * @return The slot to run next, or nullptr if there isn't one
+ **************************************************************************/
+const rv32i_hart::decoded_insn *rv32i_hart::fused_slt_branch(const decoded_insn *d)
+{
+	const decoded_insn *n = d + 1;
+	int32_t lhs = regs.get(d->rs1);
+	bool lt;
+
+	switch(d->id)
+	{
+		case id_slt:	lt = lhs < regs.get(d->rs2); break;
+		case id_sltu:	lt = (uint32_t)lhs < (uint32_t)regs.get(d->rs2); break;
+		case id_slti:	lt = lhs < d->imm; break;
+		default:	lt = (uint32_t)lhs < (uint32_t)d->imm; break;
+	}
+
+	regs.set(d->rd, lt);
+	pc += 4;
+	return jump_to(n, lt == (n->id == id_bne) ? pc + n->imm : pc + 4);
+}
+
+/**
+ * Steps a loop counter with an addi and bne pair
+ *
+ * @param d The slot of the addi
+ *
+ * @return The slot to run next, or nullptr if there isn't one
+ **************************************************************************/
+const rv32i_hart::decoded_insn *rv32i_hart::fused_addi_bne(const decoded_insn *d)
+{
+	const decoded_insn *n = d + 1;
+
+	regs.set(d->rd, (uint32_t)regs.get(d->rs1) + d->imm);
+	pc += 4;
+	return jump_to(n, regs.get(n->rs1) != regs.get(n->rs2) ? pc + n->imm : pc + 4);
+}
+
+/**
+ * Finds or builds the basic block that starts at an address
+ *
+ * Blocks never cross a decode cache page, so their instructions can be
+ * run straight out of the cache.
+ *
+ * @param addr The address of the first instruction
+ *
+ * @return The block, or nullptr if addr cannot be run from the cache
+ **************************************************************************/
+rv32i_hart::basic_block *rv32i_hart::find_block(uint32_t addr)
+{
+	std::unique_ptr<basic_block> &b = blocks[addr];
+	if(b)
+		return b.get();
+
+	decoded_insn *first = lookup(addr);
+	if(!first)
+	{
+		blocks.erase(addr);
+		return nullptr;
+	}
+
+	uint32_t len = 1;
+	for(uint32_t a = addr; !ends_block(first[len - 1].id); len++)
+	{
+		a += 4;
+		if((a & ((1 << dcache_page_bits) - 1)) == 0 || !lookup(a))
+			break;
+	}
+
+	b.reset(new basic_block());
+	b->insns = first;
+	b->len = len;
+	return b.get();
+}
+
+/**
+ * Turns the profile on or off
+ *
+ * The counters start from 0 each time it is turned on.
+ *
+ * @param b True to count the instructions retired
+ **************************************************************************/
+void rv32i_hart::set_profile(bool b)
+{
+	if(!b)
+	{
+		std::vector<uint64_t>().swap(pc_profile);
+		pc_counts = nullptr;
+		return;
+	}
+
+	pc_profile.assign(mem.get_size() / 4 + 1, 0);
+	pc_counts = pc_profile.data();
+}
+
+/**
+ * Adds up the profile
+ *
+ * @return The times the instruction at each pc was retired, indexed by
+ *	pc / 4, empty if the profile is off
+ **************************************************************************/
+std::vector<uint64_t> rv32i_hart::get_pc_profile() const
+{
+	std::vector<uint64_t> counts(pc_profile.size());
+	uint64_t n = 0;
+
+	for(size_t i = 0; i < counts.size(); i++)
+	{
+		n += pc_profile[i];
+		counts[i] = n;
+	}
+	return counts;
+}
+
+/**
+ * Sets where the binary trace records go
+ *
+ * Blocks that were translated without a trail, or with one that is no
+ * longer wanted, are dropped to be translated again.
+ *
+ * @param r The recorder, or nullptr to stop recording
+ **************************************************************************/
+void rv32i_hart::set_recorder(trace_recorder *r)
+{
+	if(jit && (r != nullptr) != (recorder != nullptr))
+		blocks_stale = true;
+	recorder = r;
+}
+
+/**
+ * Turns translation of hot basic blocks on or off
+ *
+ * @param b True to translate blocks into native code
+ **************************************************************************/
+void rv32i_hart::set_jit(bool b)
+{
+	if(!b)
+	{
+		jit.reset();
+		blocks_stale = true;
+		return;
+	}
+
+	if(!jit)
+	{
+		static_assert(sizeof(std::atomic<uint8_t>) == 1, "code page flags are read as bytes");
+
+		// Loads and stores are made inline unless the stores have to
+		// be digested
+		rv32i_jit::helpers h = { jit_lb, jit_lh, jit_lw, jit_lbu, jit_lhu, jit_sb, jit_sh, jit_sw };
+		h.host_base = mem.get_host_base();
+		h.pc_offset = reinterpret_cast<char*>(&pc) - reinterpret_cast<char*>(this);
+		if(!mem.is_digesting_stores())
+			h.code_pages = reinterpret_cast<const uint8_t*>(mem.get_code_pages());
+		h.code_page_bits = memory::code_page_bits;
+		h.fence = mem.is_shared();
+		h.written = jit_written;
+		h.loop_offset = reinterpret_cast<char*>(&loop) - reinterpret_cast<char*>(this);
+		jit.reset(new rv32i_jit(h));
+	}
+}
+
+/**
+ * Fills the decode cache and builds basic blocks before running
+ *
+ * This saves decoding the hot loops of a short run while they are
+ * executed for the first time, and with translation on they are
+ * translated straight away rather than after hot_threshold runs.
+ * Illegal instructions are left alone, those starts are most likely in
+ * memory that was never touched.
+ *
+ * @param starts The addresses of the blocks
+ * @param loops The addresses of the blocks that are the tops of loops
+ **************************************************************************/
+void rv32i_hart::preload(const std::vector<uint32_t> &starts, const std::vector<uint32_t> &loops)
+{
+	auto wanted = [this](uint32_t addr)
+	{
+		return (addr & 3) == 0 && mem.in_range(addr, 4) && classify(mem.peek32(addr)) != id_illegal;
+	};
+
+	for(uint32_t addr : starts)
+		if(wanted(addr))
+			find_block(addr);
+
+	if(!jit)
+		return;
+
+	for(uint32_t addr : loops)
+	{
+		basic_block *b = wanted(addr) ? find_block(addr) : nullptr;
+		if(b && !b->native)
+			translate_block(addr, b);
+	}
+}
+
+/**
+ * Translates a basic block into native code
+ *
+ * @param addr The address of the first instruction in the block
+ * @param b The block
+ **************************************************************************/
+void rv32i_hart::translate_block(uint32_t addr, basic_block *b)
+{
+	std::vector<uint32_t> insns(b->len);
+
+	for(uint32_t i = 0; i < b->len; i++)
+		insns[i] = b->insns[i].insn;
+
+	b->native = jit->compile(addr, insns, recorder != nullptr);
+	if(recorder && trail.size() < b->len)
+		trail.resize(b->len);
+}
+
+uint32_t rv32i_hart::jit_lb(void *ctx, uint32_t addr, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	return (int8_t)h->mem.get8_unchecked(addr);
+}
+
+uint32_t rv32i_hart::jit_lh(void *ctx, uint32_t addr, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	return (int16_t)h->mem.get16_unchecked(addr);
+}
+
+uint32_t rv32i_hart::jit_lw(void *ctx, uint32_t addr, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	return h->mem.get32_unchecked(addr);
+}
+
+uint32_t rv32i_hart::jit_lbu(void *ctx, uint32_t addr, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	return h->mem.get8_unchecked(addr);
+}
+
+uint32_t rv32i_hart::jit_lhu(void *ctx, uint32_t addr, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	return h->mem.get16_unchecked(addr);
+}
+
+uint32_t rv32i_hart::jit_sb(void *ctx, uint32_t addr, uint32_t val, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	h->mem.set8_unchecked(addr, val);
+	return h->blocks_stale;
+}
+
+uint32_t rv32i_hart::jit_sh(void *ctx, uint32_t addr, uint32_t val, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	h->mem.set16_unchecked(addr, val);
+	return h->blocks_stale;
+}
+
+uint32_t rv32i_hart::jit_sw(void *ctx, uint32_t addr, uint32_t val, uint32_t pc)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->pc = pc;
+	h->mem.set32_unchecked(addr, val);
+	return h->blocks_stale;
+}
+
+uint32_t rv32i_hart::jit_written(void *ctx, uint32_t addr, uint32_t len)
+{
+	rv32i_hart *h = static_cast<rv32i_hart*>(ctx);
+	h->mem.written(addr, len);
+	return h->blocks_stale;
+}
+
+/**
+ * Decodes an instruction into a decode cache slot
+ *
+ * Looks up the compact ID and execute function for the instruction, and
+ * extracts the register numbers and the sign extended immediate value
+ * for its format.
+ *
+ * @param insn The instruction to be decoded
+ * @param d The slot to fill in
+ **************************************************************************/
+void rv32i_hart::predecode(uint32_t insn, decoded_insn &d)
+{
+	d.insn = insn;
+	d.id = classify(insn);
+	d.fused = fuse_none;
+	d.rd = get_rd(insn);
+	d.rs1 = get_rs1(insn);
+	d.rs2 = get_rs2(insn);
+
+	switch(d.id)
+	{
+		default:	d.imm = get_imm_i(insn); return;
+
+		case id_lui:
+		case id_auipc:	d.imm = get_imm_u(insn); return;
+		case id_jal:	d.imm = get_imm_j(insn); return;
+		case id_beq:
+		case id_bne:
+		case id_blt:
+		case id_bge:
+		case id_bltu:
+		case id_bgeu:	d.imm = get_imm_b(insn); return;
+		case id_sb:
+		case id_sh:
+		case id_sw:	d.imm = get_imm_s(insn); return;
+		case id_slli:
+		case id_srli:
+		case id_srai:	d.imm = get_imm_i(insn)%XLEN; return;
+		case id_csrrs:	d.imm = get_imm_i(insn) & 0x00000fff; return;
+	}
+}
+
+// The execute function for each compact instruction ID, without and
+// with rendering
+const rv32i_hart::exec_fn rv32i_hart::exec_table[id_count] =
+{
+	nullptr, &rv32i_hart::exec_illegal_insn<false>,
+	&rv32i_hart::exec_lui<false>, &rv32i_hart::exec_auipc<false>, &rv32i_hart::exec_jal<false>, &rv32i_hart::exec_jalr<false>,
+	&rv32i_hart::exec_beq<false>, &rv32i_hart::exec_bne<false>, &rv32i_hart::exec_blt<false>,
+	&rv32i_hart::exec_bge<false>, &rv32i_hart::exec_bltu<false>, &rv32i_hart::exec_bgeu<false>,
+	&rv32i_hart::exec_lb<false>, &rv32i_hart::exec_lh<false>, &rv32i_hart::exec_lw<false>, &rv32i_hart::exec_lbu<false>, &rv32i_hart::exec_lhu<false>,
+	&rv32i_hart::exec_sb<false>, &rv32i_hart::exec_sh<false>, &rv32i_hart::exec_sw<false>,
+	&rv32i_hart::exec_addi<false>, &rv32i_hart::exec_slti<false>, &rv32i_hart::exec_sltiu<false>,
+	&rv32i_hart::exec_xori<false>, &rv32i_hart::exec_ori<false>, &rv32i_hart::exec_andi<false>,
+	&rv32i_hart::exec_slli<false>, &rv32i_hart::exec_srli<false>, &rv32i_hart::exec_srai<false>,
+	&rv32i_hart::exec_add<false>, &rv32i_hart::exec_sub<false>, &rv32i_hart::exec_sll<false>, &rv32i_hart::exec_slt<false>, &rv32i_hart::exec_sltu<false>,
+	&rv32i_hart::exec_xor<false>, &rv32i_hart::exec_srl<false>, &rv32i_hart::exec_sra<false>, &rv32i_hart::exec_or<false>, &rv32i_hart::exec_and<false>,
+	&rv32i_hart::exec_ebreak<false>, &rv32i_hart::exec_csrrs<false>
+};
+
+const rv32i_hart::exec_fn rv32i_hart::trace_table[id_count] =
+{
+	nullptr, &rv32i_hart::exec_illegal_insn<true>,
+	&rv32i_hart::exec_lui<true>, &rv32i_hart::exec_auipc<true>, &rv32i_hart::exec_jal<true>, &rv32i_hart::exec_jalr<true>,
+	&rv32i_hart::exec_beq<true>, &rv32i_hart::exec_bne<true>, &rv32i_hart::exec_blt<true>,
+	&rv32i_hart::exec_bge<true>, &rv32i_hart::exec_bltu<true>, &rv32i_hart::exec_bgeu<true>,
+	&rv32i_hart::exec_lb<true>, &rv32i_hart::exec_lh<true>, &rv32i_hart::exec_lw<true>, &rv32i_hart::exec_lbu<true>, &rv32i_hart::exec_lhu<true>,
+	&rv32i_hart::exec_sb<true>, &rv32i_hart::exec_sh<true>, &rv32i_hart::exec_sw<true>,
+	&rv32i_hart::exec_addi<true>, &rv32i_hart::exec_slti<true>, &rv32i_hart::exec_sltiu<true>,
+	&rv32i_hart::exec_xori<true>, &rv32i_hart::exec_ori<true>, &rv32i_hart::exec_andi<true>,
+	&rv32i_hart::exec_slli<true>, &rv32i_hart::exec_srli<true>, &rv32i_hart::exec_srai<true>,
+	&rv32i_hart::exec_add<true>, &rv32i_hart::exec_sub<true>, &rv32i_hart::exec_sll<true>, &rv32i_hart::exec_slt<true>, &rv32i_hart::exec_sltu<true>,
+	&rv32i_hart::exec_xor<true>, &rv32i_hart::exec_srl<true>, &rv32i_hart::exec_sra<true>, &rv32i_hart::exec_or<true>, &rv32i_hart::exec_and<true>,
+	&rv32i_hart::exec_ebreak<true>, &rv32i_hart::exec_csrrs<true>
+};
+
 /**
  * Flags any illegal instruction that may be executed
  *
  * Sets the halt and halt_reason variables and renders out an error 
  * message if the instruction is trying to execute
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_illegal_insn(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_illegal_insn(const decoded_insn *d)
 {
-	(void)insn;
-	
-	if(pos) *pos << render_illegal_insn(insn);
+	if(trace) render_illegal_insn(trace_out, d->insn);
 
 	halt = true;
 	halt_reason = "Illegal instruction";
+	return nullptr;
 }
 
 /**
@@ -206,22 +1306,25 @@ void rv32i_hart::exec_illegal_insn(uint32_t insn, std::ostream* pos)
  * Sets register rd to imm_u. Renders out the details of what is 
  * simulating. 
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_lui(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_lui(const decoded_insn *d)
 {
-   	uint32_t rd = get_rd(insn);
-   	int32_t imm_u = get_imm_u(insn);
+   	uint32_t rd = d->rd;
+   	int32_t imm_u = d->imm;
 
-   	if(pos)
+   	if(trace)
     {
-		std::string s = render_lui(insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(imm_u) << std::endl;
+		size_t start = trace_out.mark();
+		render_lui(trace_out, d->insn);
+		trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(imm_u).end_line();
     }
 	regs.set(rd, imm_u);
-	pc += 4;   
+	pc += 4;
+	return d + 1;
 }
 
 /**
@@ -230,24 +1333,27 @@ void rv32i_hart::exec_lui(uint32_t insn, std::ostream* pos)
  * Sets register rd to the value of the address and imm_u value. Renders out the 
  * details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_auipc(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_auipc(const decoded_insn *d)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_u = get_imm_u(insn);
+	uint32_t rd = d->rd;
+	int32_t imm_u = d->imm;
 	int32_t val = imm_u + pc;
 
-	if(pos)
+	if(trace)
 	{
-		std::string s = render_auipc(insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(pc) << " + " << hex::to_hex0x32(imm_u) << " = " << hex::
-			to_hex0x32(val) << std::endl;
+		size_t start = trace_out.mark();
+		render_auipc(trace_out, d->insn);
+		trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(pc).text(" + ")
+			.hex0x32(imm_u).text(" = ").hex0x32(val).end_line();
 	}
 	regs.set(rd, val);
 	pc += 4;
+	return d + 1;
 }
 
 /**
@@ -257,24 +1363,26 @@ void rv32i_hart::exec_auipc(uint32_t insn, std::ostream* pos)
  * new address given by the pc and imm_j value. Renders out the 
  * details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_jal(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_jal(const decoded_insn *d)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_j = get_imm_j(insn);
+	uint32_t rd = d->rd;
+	int32_t imm_j = d->imm;
 	int32_t val = pc + imm_j;
 
-	if(pos)
+	if(trace)
 	{
-		std::string s = render_jal(pc, insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(pc + 4) << ",  pc = " << hex::
-			to_hex0x32(pc) << " + " << hex::to_hex0x32(imm_j) << " = " << hex::to_hex0x32(val) << std::endl;
+		size_t start = trace_out.mark();
+		render_jal(trace_out, pc, d->insn);
+		trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(pc + 4)
+			.text(",  pc = ").hex0x32(pc).text(" + ").hex0x32(imm_j).text(" = ").hex0x32(val).end_line();
 	}
 	regs.set(rd, pc + 4);
-	pc = val;
+	return jump_to(d, val);
 }
 
 /**
@@ -284,25 +1392,28 @@ void rv32i_hart::exec_jal(uint32_t insn, std::ostream* pos)
  * new address given by the rs1 and imm_i value. Renders out the
  * details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_jalr(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_jalr(const decoded_insn *d)
 {
-	uint32_t rd = get_rd(insn);
-	int32_t imm_i = get_imm_i(insn);
-	uint32_t rs1 = get_rs1(insn);
+	uint32_t rd = d->rd;
+	int32_t imm_i = d->imm;
+	uint32_t rs1 = d->rs1;
 	int32_t val = (regs.get(rs1) + imm_i) & 0xfffffffe;
 
-	if(pos)
+	if(trace)
 	{
-		std::string s = render_jalr(insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(pc + 4) << ",  pc = (" << hex::to_hex0x32(imm_i) << " + " << hex::
-			to_hex0x32(regs.get(rs1)) << ") & 0xfffffffe = " << hex::to_hex0x32(val) << std::endl;
+		size_t start = trace_out.mark();
+		render_jalr(trace_out, d->insn);
+		trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(pc + 4)
+			.text(",  pc = (").hex0x32(imm_i).text(" + ").hex0x32(regs.get(rs1)).text(") & 0xfffffffe = ")
+			.hex0x32(val).end_line();
 	}
 	regs.set(rd, pc + 4);
-	pc = val;
+	return jump_to(d, val);
 }
 
 /**
@@ -311,14 +1422,16 @@ void rv32i_hart::exec_jalr(uint32_t insn, std::ostream* pos)
  * Sets t_addr to pc and imm_b if rs1 and rs2 are equal. Renders out the
  * details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_beq(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_beq(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_b = get_imm_b(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_b = d->imm;
     int32_t t_addr;
 
     if((uint32_t)regs.get(rs1) == (uint32_t)regs.get(rs2))
@@ -330,14 +1443,14 @@ void rv32i_hart::exec_beq(uint32_t insn, std::ostream* pos)
         t_addr = pc + 4;
     }
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_btype(pc, insn, "beq");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// pc += (" << hex::to_hex0x32(regs.get(rs1)) << " == " << hex::to_hex0x32(regs.get(rs2)) << " ? " << hex::
-            to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(t_addr) << std::endl;
+        size_t start = trace_out.mark();
+        render_btype(trace_out, pc, d->insn, "beq");
+        trace_out.pad(start, instruction_width).text("// pc += (").hex0x32(regs.get(rs1)).text(" == ")
+            .hex0x32(regs.get(rs2)).text(" ? ").hex0x32(imm_b).text(" : 4) = ").hex0x32(t_addr).end_line();
     }
-    pc = t_addr;
+    return jump_to(d, t_addr);
 }
 
 /**
@@ -346,14 +1459,16 @@ void rv32i_hart::exec_beq(uint32_t insn, std::ostream* pos)
  * Sets t_addr to pc and imm_b if rs1 and rs2 are not equal. Renders out the
  * details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  ***************************************************************************/
-void rv32i_hart::exec_bne(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_bne(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_b = get_imm_b(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_b = d->imm;
     int32_t t_addr;
 
     if(regs.get(rs1) != regs.get(rs2))
@@ -365,14 +1480,14 @@ void rv32i_hart::exec_bne(uint32_t insn, std::ostream* pos)
         t_addr = pc + 4;
     }
     
-    if(pos)
+    if(trace)
     {
-	    std::string s = render_btype(pc, insn, "bne");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-	    *pos << "// pc += (" << hex::to_hex0x32(regs.get(rs1)) << " != " << hex::to_hex0x32(regs.get(rs2)) << " ? " << hex::
-            to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(t_addr) << std::endl; 
+	    size_t start = trace_out.mark();
+	    render_btype(trace_out, pc, d->insn, "bne");
+	    trace_out.pad(start, instruction_width).text("// pc += (").hex0x32(regs.get(rs1)).text(" != ")
+	    	.hex0x32(regs.get(rs2)).text(" ? ").hex0x32(imm_b).text(" : 4) = ").hex0x32(t_addr).end_line();
     }
-    pc = t_addr; 
+    return jump_to(d, t_addr);
 }
 
 /**
@@ -381,14 +1496,16 @@ void rv32i_hart::exec_bne(uint32_t insn, std::ostream* pos)
  * Sets t_addr to pc and imm_b if rs1 is less than rs2. Renders out the
  * details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_blt(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_blt(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_b = get_imm_b(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_b = d->imm;
     int32_t t_addr;
 
     if(regs.get(rs1) < regs.get(rs2))
@@ -400,14 +1517,14 @@ void rv32i_hart::exec_blt(uint32_t insn, std::ostream* pos)
         t_addr = pc + 4;
     }
     
-    if(pos)
+    if(trace)
     {
-        std::string s = render_btype(pc, insn, "blt");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-	    *pos << "// pc += (" << hex::to_hex0x32(regs.get(rs1)) << " < " << hex::to_hex0x32(regs.get(rs2)) << " ? " << hex::
-            to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(t_addr) << std::endl;
+        size_t start = trace_out.mark();
+        render_btype(trace_out, pc, d->insn, "blt");
+        trace_out.pad(start, instruction_width).text("// pc += (").hex0x32(regs.get(rs1)).text(" < ")
+            .hex0x32(regs.get(rs2)).text(" ? ").hex0x32(imm_b).text(" : 4) = ").hex0x32(t_addr).end_line();
     }
-    pc = t_addr;  
+    return jump_to(d, t_addr);
 }
 
 /**
@@ -416,14 +1533,16 @@ void rv32i_hart::exec_blt(uint32_t insn, std::ostream* pos)
  * Sets t_addr to pc and imm_b if rs1 is greater than or equal to rs2. 
  * Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_bge(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_bge(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_b = get_imm_b(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_b = d->imm;
     int32_t t_addr;
 
     if(regs.get(rs1) >= regs.get(rs2))
@@ -435,14 +1554,14 @@ void rv32i_hart::exec_bge(uint32_t insn, std::ostream* pos)
         t_addr = pc + 4;
     }
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_btype(pc, insn, "bge");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-	    *pos << "// pc += (" << hex::to_hex0x32(regs.get(rs1)) << " >= " << hex::to_hex0x32(regs.get(rs2)) << " ? " << hex::
-            to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(t_addr) << std::endl;
+        size_t start = trace_out.mark();
+        render_btype(trace_out, pc, d->insn, "bge");
+        trace_out.pad(start, instruction_width).text("// pc += (").hex0x32(regs.get(rs1)).text(" >= ")
+            .hex0x32(regs.get(rs2)).text(" ? ").hex0x32(imm_b).text(" : 4) = ").hex0x32(t_addr).end_line();
     }
-    pc = t_addr;
+    return jump_to(d, t_addr);
 }
 
 /**
@@ -451,14 +1570,16 @@ void rv32i_hart::exec_bge(uint32_t insn, std::ostream* pos)
  * Sets t_addr to pc and imm_b if rs1 is less than rs2. Renders out the
  * details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_bltu(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_bltu(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_b = get_imm_b(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_b = d->imm;
     int32_t t_addr;
 
     if((uint32_t)regs.get(rs1) < (uint32_t)regs.get(rs2))
@@ -470,14 +1591,14 @@ void rv32i_hart::exec_bltu(uint32_t insn, std::ostream* pos)
         t_addr = pc + 4;
     }
     
-    if(pos)
+    if(trace)
     {
-        std::string s = render_btype(pc, insn, "bltu");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// pc += (" << hex::to_hex0x32(regs.get(rs1)) << " <U " << hex::to_hex0x32(regs.get(rs2)) << " ? " << hex::
-            to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(t_addr) << std::endl;
+        size_t start = trace_out.mark();
+        render_btype(trace_out, pc, d->insn, "bltu");
+        trace_out.pad(start, instruction_width).text("// pc += (").hex0x32(regs.get(rs1)).text(" <U ")
+            .hex0x32(regs.get(rs2)).text(" ? ").hex0x32(imm_b).text(" : 4) = ").hex0x32(t_addr).end_line();
     }
-    pc = t_addr;
+    return jump_to(d, t_addr);
 }
 
 /**
@@ -486,14 +1607,16 @@ void rv32i_hart::exec_bltu(uint32_t insn, std::ostream* pos)
  * Sets t_addr to pc and imm_b if rs1 is greater than or equal to rs2.
  * Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_bgeu(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_bgeu(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_b = get_imm_b(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_b = d->imm;
     int32_t t_addr;
 
     if((uint32_t)regs.get(rs1) >= (uint32_t)regs.get(rs2))
@@ -505,14 +1628,14 @@ void rv32i_hart::exec_bgeu(uint32_t insn, std::ostream* pos)
         t_addr = pc + 4;
     }
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_btype(pc, insn, "bgeu");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// pc += (" << hex::to_hex0x32(regs.get(rs1)) << " >=U " << hex::to_hex0x32(regs.get(rs2)) << " ? " << hex::
-            to_hex0x32(imm_b) << " : 4) = " << hex::to_hex0x32(t_addr) << std::endl;
+        size_t start = trace_out.mark();
+        render_btype(trace_out, pc, d->insn, "bgeu");
+        trace_out.pad(start, instruction_width).text("// pc += (").hex0x32(regs.get(rs1)).text(" >=U ")
+            .hex0x32(regs.get(rs2)).text(" ? ").hex0x32(imm_b).text(" : 4) = ").hex0x32(t_addr).end_line();
     }
-    pc = t_addr;
+    return jump_to(d, t_addr);
 }
 
 /**
@@ -521,16 +1644,22 @@ void rv32i_hart::exec_bgeu(uint32_t insn, std::ostream* pos)
  * Sets rd to the sign extended value given by rs1 and imm_i. Renders out 
  * the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_lb(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_lb(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rd = get_rd(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rd = d->rd;
+    int32_t imm_i = d->imm;
     uint32_t t_addr = regs.get(rs1) + imm_i;
-    uint32_t val = mem.get8(t_addr);
+
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 1))
+        return access_fault(t_addr, false);
+
+    uint32_t val = (trace ? mem.get8(t_addr) : mem.get8_unchecked(t_addr));
     int32_t num = 0x80;
 
     val = 0xff & (int32_t)val;
@@ -540,15 +1669,16 @@ void rv32i_hart::exec_lb(uint32_t insn, std::ostream* pos)
         val += 0xffffff00;
     }
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_load(insn, "lb");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = sx(m8(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::
-            to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_load(trace_out, d->insn, "lb");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = sx(m8(").hex0x32(regs.get(rs1))
+            .text(" + ").hex0x32(imm_i).text(")) = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -557,16 +1687,22 @@ void rv32i_hart::exec_lb(uint32_t insn, std::ostream* pos)
  * Sets rd to the sign extended 16-bit little-endian half word value given 
  * by rs1 and imm_i. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_lh(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_lh(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rd = get_rd(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rd = d->rd;
+    int32_t imm_i = d->imm;
     uint32_t t_addr = regs.get(rs1) + imm_i;
-    uint32_t val = mem.get16(t_addr);
+
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 2))
+        return access_fault(t_addr, false);
+
+    uint32_t val = (trace ? mem.get16(t_addr) : mem.get16_unchecked(t_addr));
 
     val = 0xffff & (int32_t)val;
     int32_t num = 0x8000;
@@ -576,15 +1712,16 @@ void rv32i_hart::exec_lh(uint32_t insn, std::ostream* pos)
         val += 0xffff0000;
     }
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_load(insn, "lh");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = sx(m16(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::
-		    to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_load(trace_out, d->insn, "lh");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = sx(m16(").hex0x32(regs.get(rs1))
+            .text(" + ").hex0x32(imm_i).text(")) = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -593,26 +1730,33 @@ void rv32i_hart::exec_lh(uint32_t insn, std::ostream* pos)
  * Sets rd to the sign extended 32-bit little-endian half word value given
  * by rs1 and imm_i. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_lw(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_lw(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rd = get_rd(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rd = d->rd;
+    int32_t imm_i = d->imm;
     uint32_t t_addr = regs.get(rs1) + imm_i;
-    uint32_t val = mem.get32(t_addr);
 
-    if(pos)
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 4))
+        return access_fault(t_addr, false);
+
+    uint32_t val = (trace ? mem.get32(t_addr) : mem.get32_unchecked(t_addr));
+
+    if(trace)
     {
-        std::string s = render_itype_load(insn, "lw");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = sx(m32(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::
-		    to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_load(trace_out, d->insn, "lw");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = sx(m32(").hex0x32(regs.get(rs1))
+            .text(" + ").hex0x32(imm_i).text(")) = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -621,26 +1765,33 @@ void rv32i_hart::exec_lw(uint32_t insn, std::ostream* pos)
  * Sets rd to the zero extended value given by rs1 and imm_i. Renders out 
  * the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_lbu(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_lbu(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rd = get_rd(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rd = d->rd;
+    int32_t imm_i = d->imm;
     uint32_t t_addr = regs.get(rs1) + imm_i;
-    uint32_t val = mem.get8(t_addr) & 0x000000ff;
 
-    if(pos)
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 1))
+        return access_fault(t_addr, false);
+
+    uint32_t val = (trace ? mem.get8(t_addr) : mem.get8_unchecked(t_addr)) & 0x000000ff;
+
+    if(trace)
     {
-        std::string s = render_itype_load(insn, "lbu");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = zx(m8(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::
-		    to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_load(trace_out, d->insn, "lbu");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = zx(m8(").hex0x32(regs.get(rs1))
+            .text(" + ").hex0x32(imm_i).text(")) = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -649,26 +1800,33 @@ void rv32i_hart::exec_lbu(uint32_t insn, std::ostream* pos)
  * Sets rd to the sign extended 16-bit little-endian half word value given
  * by rs1 and imm_i. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_lhu(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_lhu(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rd = get_rd(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rd = d->rd;
+    int32_t imm_i = d->imm;
     uint32_t t_addr = regs.get(rs1) + imm_i;
-    uint32_t val = mem.get16(t_addr) & 0x0000ffff;
 
-    if(pos)
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 2))
+        return access_fault(t_addr, false);
+
+    uint32_t val = (trace ? mem.get16(t_addr) : mem.get16_unchecked(t_addr)) & 0x0000ffff;
+
+    if(trace)
     {
-        std::string s = render_itype_load(insn, "lhu");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = zx(m16(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::
-		    to_hex0x32(imm_i) << ")) = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_load(trace_out, d->insn, "lhu");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = zx(m16(").hex0x32(regs.get(rs1))
+            .text(" + ").hex0x32(imm_i).text(")) = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -677,26 +1835,33 @@ void rv32i_hart::exec_lhu(uint32_t insn, std::ostream* pos)
  * Sets t_addr, given by rs1 and imm_s, to the 8 LSBs of rs2. Renders out 
  * the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sb(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sb(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_s = get_imm_s(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_s = d->imm;
     uint32_t t_addr = regs.get(rs1) + imm_s;
     uint32_t val = regs.get(rs2) & 0x000000ff;
 
-    if(pos)
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 1))
+        return access_fault(t_addr, true);
+
+    if(trace)
     {
-        std::string s = render_stype(insn, "sb");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// m8(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::to_hex0x32(imm_s) << ") = " << hex::
-		    to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_stype(trace_out, d->insn, "sb");
+        trace_out.pad(start, instruction_width).text("// m8(").hex0x32(regs.get(rs1)).text(" + ")
+            .hex0x32(imm_s).text(") = ").hex0x32(val).end_line();
     }
-    mem.set8(t_addr, val);
+    if(trace) mem.set8(t_addr, val);
+    else mem.set8_unchecked(t_addr, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -705,26 +1870,33 @@ void rv32i_hart::exec_sb(uint32_t insn, std::ostream* pos)
  * Sets t_addr, given by rs1 and imm_s, to the 16 LSBs of rs2. Renders out
  * the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sh(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sh(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_s = get_imm_s(insn); 
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_s = d->imm; 
     uint32_t t_addr = regs.get(rs1) + imm_s;
     uint32_t val = regs.get(rs2) & 0x0000ffff;
 
-    if(pos)
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 2))
+        return access_fault(t_addr, true);
+
+    if(trace)
     {
-        std::string s = render_stype(insn, "sh");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// m16(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::to_hex0x32(imm_s) << ") = " << hex::
-		    to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_stype(trace_out, d->insn, "sh");
+        trace_out.pad(start, instruction_width).text("// m16(").hex0x32(regs.get(rs1)).text(" + ")
+            .hex0x32(imm_s).text(") = ").hex0x32(val).end_line();
     }
-    mem.set16(t_addr, val);
+    if(trace) mem.set16(t_addr, val);
+    else mem.set16_unchecked(t_addr, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -733,26 +1905,33 @@ void rv32i_hart::exec_sh(uint32_t insn, std::ostream* pos)
  * Sets t_addr, given by rs1 and imm_s, to rs2. Renders out
  * the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sw(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sw(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
-    int32_t imm_s = get_imm_s(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
+    int32_t imm_s = d->imm;
     uint32_t t_addr = regs.get(rs1) + imm_s;
     uint32_t val = regs.get(rs2);
 
-    if(pos)
+    if(trace && halt_on_fault && !mem.in_range(t_addr, 4))
+        return access_fault(t_addr, true);
+
+    if(trace)
     {
-        std::string s = render_stype(insn, "sw");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// m32(" << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::to_hex0x32(imm_s) << ") = " << hex::
-		    to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_stype(trace_out, d->insn, "sw");
+        trace_out.pad(start, instruction_width).text("// m32(").hex0x32(regs.get(rs1)).text(" + ")
+            .hex0x32(imm_s).text(") = ").hex0x32(val).end_line();
     }
-    mem.set32(t_addr, val);
+    if(trace) mem.set32(t_addr, val);
+    else mem.set32_unchecked(t_addr, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -760,25 +1939,28 @@ void rv32i_hart::exec_sw(uint32_t insn, std::ostream* pos)
  *
  * Sets rd to rs1 plus imm_i. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_addi(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_addi(const decoded_insn *d)
 {
-    int32_t rs1 = get_rs1(insn);
-    int32_t rd = get_rd(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rs1 = d->rs1;
+    int32_t rd = d->rd;
+    int32_t imm_i = d->imm;
     uint32_t sum = regs.get(rs1) + imm_i;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_alu(insn, "addi", imm_i);
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::
-		    to_hex0x32(imm_i) << " = " << hex::to_hex0x32(sum) << std::endl; 
+        size_t start = trace_out.mark();
+        render_itype_alu(trace_out, d->insn, "addi", imm_i);
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" + ").hex0x32(imm_i).text(" = ").hex0x32(sum).end_line();
     }
     regs.set(rd, sum);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -787,26 +1969,29 @@ void rv32i_hart::exec_addi(uint32_t insn, std::ostream* pos)
  * Sets rd to 1 if the signed int value in rs1 is less than imm_i, else
  * sets it to zero. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_slti(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_slti(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t imm_i = d->imm;
 
     int32_t val = (regs.get(rs1) < imm_i) ? 1 : 0;
 
-    if(pos)
+    if(trace)
     {
-	    std::string s = render_itype_alu(insn, "slti", imm_i);
-	    *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-	    *pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(regs.get(rs1)) << " < " << 
-            std::dec << imm_i << ") ? 1 : 0 = " << hex::to_hex0x32(val) << std::endl;
+	    size_t start = trace_out.mark();
+	    render_itype_alu(trace_out, d->insn, "slti", imm_i);
+	    trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = (").hex0x32(regs.get(rs1))
+	    	.text(" < ").dec(imm_i).text(") ? 1 : 0 = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -815,26 +2000,29 @@ void rv32i_hart::exec_slti(uint32_t insn, std::ostream* pos)
  * Sets rd to 1 if the unsigned int value in rs1 is less than imm_i, else
  * sets it to zero. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sltiu(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sltiu(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t imm_i = d->imm;
 
     int32_t val = ((uint32_t)regs.get(rs1) < (uint32_t)imm_i) ? 1 : 0;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_alu(insn, "sltiu", imm_i);
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(regs.get(rs1)) << " <U " << 
-		    std::dec << imm_i << ") ? 1 : 0 = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_alu(trace_out, d->insn, "sltiu", imm_i);
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = (").hex0x32(regs.get(rs1))
+            .text(" <U ").dec(imm_i).text(") ? 1 : 0 = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -843,26 +2031,29 @@ void rv32i_hart::exec_sltiu(uint32_t insn, std::ostream* pos)
  * Sets rd to the bitwise xor of rs1 and imm_i. Renders out the details of 
  * what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_xori(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_xori(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t imm_i = d->imm;
 
     int32_t val = regs.get(rs1) ^ imm_i;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_alu(insn, "xori", imm_i);
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " ^ " << hex::
-		    to_hex0x32(imm_i) << " = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_alu(trace_out, d->insn, "xori", imm_i);
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" ^ ").hex0x32(imm_i).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -871,26 +2062,29 @@ void rv32i_hart::exec_xori(uint32_t insn, std::ostream* pos)
  * Sets rd to the bitwise or of rs1 and imm_i. Renders out the details of
  * what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_ori(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_ori(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t imm_i = d->imm;
 
     int32_t val = regs.get(rs1) | imm_i;
 
-    if(pos)
+    if(trace)
     {
-       	std::string s = render_itype_alu(insn, "ori", imm_i);
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " | " << hex::
-		    to_hex0x32(imm_i) << " = " << hex::to_hex0x32(val) << std::endl;
+       	size_t start = trace_out.mark();
+       	render_itype_alu(trace_out, d->insn, "ori", imm_i);
+       	trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+       	    .text(" | ").hex0x32(imm_i).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -899,26 +2093,29 @@ void rv32i_hart::exec_ori(uint32_t insn, std::ostream* pos)
  * Sets rd to the bitwise and of rs1 and imm_i. Renders out the details of
  * what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_andi(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_andi(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t imm_i = get_imm_i(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t imm_i = d->imm;
 
     int32_t val = (regs.get(rs1) & imm_i);
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_alu(insn, "andi", imm_i);
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " & " << hex::
-		    to_hex0x32(imm_i) << " = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_alu(trace_out, d->insn, "andi", imm_i);
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" & ").hex0x32(imm_i).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -927,26 +2124,29 @@ void rv32i_hart::exec_andi(uint32_t insn, std::ostream* pos)
  * Sets rd to left shift of rs1 by the number of bits given
  * in shamt_i. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_slli(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_slli(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t shift = get_imm_i(insn)%XLEN;
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t shift = d->imm;
 
     int32_t val = regs.get(rs1) << shift;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_alu(insn, "slli", get_imm_i(insn));
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " << " << 
-		    std::dec << shift << " = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_alu(trace_out, d->insn, "slli", get_imm_i(d->insn));
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" << ").dec(shift).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -955,26 +2155,29 @@ void rv32i_hart::exec_slli(uint32_t insn, std::ostream* pos)
  * Sets rd to the logic right shift of rs1 by the number of bits given 
  * in shamt_i. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_srli(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_srli(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t shift = get_imm_i(insn)%XLEN;
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t shift = d->imm;
 
     int32_t val = (uint32_t)regs.get(rs1) >> shift;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_alu(insn, "srli", get_imm_i(insn));
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " >> " << 
-		std::dec << shift << " = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_alu(trace_out, d->insn, "srli", get_imm_i(d->insn));
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" >> ").dec(shift).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -983,26 +2186,29 @@ void rv32i_hart::exec_srli(uint32_t insn, std::ostream* pos)
  * Sets rd to the arithmetic right shift of rs1 by the number of bits given
  * in shamt_i. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_srai(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_srai(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t shift = get_imm_i(insn)%XLEN;
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t shift = d->imm;
 
     int32_t val = regs.get(rs1) >> shift;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_itype_alu(insn, "srai", (int32_t)get_imm_i(insn)%XLEN);
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " >> " << 
-		    std::dec << shift << " = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_itype_alu(trace_out, d->insn, "srai", (int32_t)get_imm_i(d->insn)%XLEN);
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" >> ").dec(shift).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1010,26 +2216,29 @@ void rv32i_hart::exec_srai(uint32_t insn, std::ostream* pos)
  *
  * Sets rd to rs1 plus rs2. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_add(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_add(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t val = regs.get(rs1) + regs.get(rs2);
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "add");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " + " << hex::
-		    to_hex0x32(regs.get(rs2)) << " = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "add");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" + ").hex0x32(regs.get(rs2)).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
-    pc += 4; 
+    pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1037,26 +2246,29 @@ void rv32i_hart::exec_add(uint32_t insn, std::ostream* pos)
  *
  * Sets rd to rs1 minus rs2. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sub(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sub(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t val = regs.get(rs1) - regs.get(rs2);
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "sub");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " - " << hex::
-		    to_hex0x32(regs.get(rs2)) << " = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "sub");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" - ").hex0x32(regs.get(rs2)).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
-    pc += 4; 
+    pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1064,27 +2276,30 @@ void rv32i_hart::exec_sub(uint32_t insn, std::ostream* pos)
  *
  * Sets rd to the 5 LSB of rs2. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sll(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sll(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t shamt = regs.get(rs2) & 0x01f;
     int32_t val = regs.get(rs1) << shamt;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "sll");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " << " << 
-		    std::dec << shamt << " = " << hex::to_hex0x32(val) << std::endl; 
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "sll");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" << ").dec(shamt).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1093,26 +2308,29 @@ void rv32i_hart::exec_sll(uint32_t insn, std::ostream* pos)
  * Sets rd to 1 if the signed int value in rs1 is less than rs2, else
  * sets it to zero. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_slt(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_slt(const decoded_insn *d)
 {
-    uint32_t rd = get_rd(insn);
-    uint32_t rs1 = get_rs1(insn);
-    uint32_t rs2 = get_rs2(insn);
+    uint32_t rd = d->rd;
+    uint32_t rs1 = d->rs1;
+    uint32_t rs2 = d->rs2;
 
     int32_t val = (regs.get(rs1) < regs.get(rs2)) ? 1 : 0;
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "slt");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(regs.get(rs1)) << " < " << hex::
-            to_hex0x32(regs.get(rs2)) << ") ? 1 : 0 = " << hex::to_hex0x32(val) << std::endl;
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "slt");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = (").hex0x32(regs.get(rs1))
+            .text(" < ").hex0x32(regs.get(rs2)).text(") ? 1 : 0 = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1121,26 +2339,29 @@ void rv32i_hart::exec_slt(uint32_t insn, std::ostream* pos)
  * Sets rd to 1 if the unsigned int value in rs1 is less than rs2, else
  * sets it to zero. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sltu(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sltu(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t val = ((uint32_t)regs.get(rs1) < (uint32_t)regs.get(rs2)) ? 1 : 0; 
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "sltu");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = (" << hex::to_hex0x32(regs.get(rs1)) << " <U " << hex::
-		    to_hex0x32(regs.get(rs2)) << ") ? 1 : 0 = " << hex::to_hex0x32(val) << std::endl; 
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "sltu");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = (").hex0x32(regs.get(rs1))
+            .text(" <U ").hex0x32(regs.get(rs2)).text(") ? 1 : 0 = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1149,26 +2370,29 @@ void rv32i_hart::exec_sltu(uint32_t insn, std::ostream* pos)
  * Sets rd to the bitwise xor of rs1 and rs2. Renders out the details of
  * what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_xor(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_xor(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t val = regs.get(rs1) ^ regs.get(rs2); 
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "xor");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " ^ " << hex::
-		    to_hex0x32(regs.get(rs2)) << " = " << hex::to_hex0x32(val) << std::endl; 
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "xor");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" ^ ").hex0x32(regs.get(rs2)).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1177,27 +2401,30 @@ void rv32i_hart::exec_xor(uint32_t insn, std::ostream* pos)
  * Sets rd to the logic right shift of rs1 by the number of bits given
  * in rs2. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_srl(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_srl(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t shift = regs.get(rs2) & 0x0000001f;
     int32_t val = (uint32_t)regs.get(rs1) >> shift; 
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "srl");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " >> " << 
-		    std::dec << shift << " = " << hex::to_hex0x32(val) << std::endl; 
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "srl");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" >> ").dec(shift).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1206,27 +2433,30 @@ void rv32i_hart::exec_srl(uint32_t insn, std::ostream* pos)
  * Sets rd to the arithmetic right shift of rs1 by the number of bits given
  * in rs2. Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_sra(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_sra(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t shift = regs.get(rs2) & 0x0000001f;
     int32_t val = regs.get(rs1) >> shift; 
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "sra");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " >> " << 
-		    std::dec << shift << " = " << hex::to_hex0x32(val) << std::endl; 
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "sra");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" >> ").dec(shift).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1235,26 +2465,29 @@ void rv32i_hart::exec_sra(uint32_t insn, std::ostream* pos)
  * Sets rd to the bitwise or of rs1 and rs2. Renders out the details of 
  * what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_or(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_or(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t val = regs.get(rs1) | regs.get(rs2); 
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "or");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " | " << hex::
-		    to_hex0x32(regs.get(rs2)) << " = " << hex::to_hex0x32(val) << std::endl; 
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "or");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" | ").hex0x32(regs.get(rs2)).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1263,26 +2496,29 @@ void rv32i_hart::exec_or(uint32_t insn, std::ostream* pos)
  * Sets rd to the bitwise and of rs1 and rs2. Renders out the details of
  * what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_and(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_and(const decoded_insn *d)
 {
-    int32_t rd = get_rd(insn);
-    int32_t rs1 = get_rs1(insn);
-    int32_t rs2 = get_rs2(insn);
+    int32_t rd = d->rd;
+    int32_t rs1 = d->rs1;
+    int32_t rs2 = d->rs2;
 
     int32_t val = regs.get(rs1) & regs.get(rs2); 
 
-    if(pos)
+    if(trace)
     {
-        std::string s = render_rtype(insn, "and");
-        *pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-        *pos << "// " << render_reg(rd) << " = " << hex::to_hex0x32(regs.get(rs1)) << " & " << hex::
-		    to_hex0x32(regs.get(rs2)) << " = " << hex::to_hex0x32(val) << std::endl; 
+        size_t start = trace_out.mark();
+        render_rtype(trace_out, d->insn, "and");
+        trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").hex0x32(regs.get(rs1))
+            .text(" & ").hex0x32(regs.get(rs2)).text(" = ").hex0x32(val).end_line();
     }
     regs.set(rd, val);
     pc += 4;
+    return d + 1;
 }
 
 /**
@@ -1291,35 +2527,40 @@ void rv32i_hart::exec_and(uint32_t insn, std::ostream* pos)
  * Sets halt to true and explains the reasoning. Renders out the details of
  * what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_ebreak(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_ebreak(const decoded_insn *d)
 {
-	if(pos)
+	if(trace)
 	{
-		std::string s = render_ebreak(insn);
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// HALT" << std::endl;
+		size_t start = trace_out.mark();
+		render_ebreak(trace_out, d->insn);
+		trace_out.pad(start, instruction_width).text("// HALT").end_line();
 	}
 	halt = true;
 	halt_reason = "EBREAK instruction";
+	return nullptr;
 }
 
 /**
  * Simulates the execution of a csrrs instruction
  *
  * Checks the values of the csr and rs1 to find any illegal CSR instructions.
- * Sets rd to the mhartid. Renders out the details of what is simulating.
+ * Sets rd to the mhartid-> Renders out the details of what is simulating.
  *
- * @param insn The instruction to be executed
- * @param pos A pointer to the output stream object
+ * @param d The predecoded instruction to be executed
+ *
+ * @return The slot to run next, or nullptr if there isn't one
  **************************************************************************/
-void rv32i_hart::exec_csrrs(uint32_t insn, std::ostream* pos)
+template<bool trace>
+const rv32i_hart::decoded_insn *rv32i_hart::exec_csrrs(const decoded_insn *d)
 {
-	uint32_t rd = get_rd(insn);
-	uint32_t rs1 = get_rs1(insn);
-	int32_t csr = get_imm_i(insn) & 0x00000fff;
+	uint32_t rd = d->rd;
+	uint32_t rs1 = d->rs1;
+	int32_t csr = d->imm;
 
 	if(csr != 0xf14 || rs1 != 0)
 	{
@@ -1327,16 +2568,17 @@ void rv32i_hart::exec_csrrs(uint32_t insn, std::ostream* pos)
 		halt_reason = "Illegal CSR in CRSS instruction";
 	}
 	
-	if(pos)
+	if(trace)
 	{
-		std::string s = render_csrrx(insn, "csrrs");
-		*pos << std::setw(instruction_width) << std::setfill(' ') << std::left << s;
-		*pos << "// " << render_reg(rd) << " = " << std::dec << mhartid << std::endl;
+		size_t start = trace_out.mark();
+		render_csrrx(trace_out, d->insn, "csrrs");
+		trace_out.pad(start, instruction_width).text("// x").dec(rd).text(" = ").dec(mhartid).end_line();
 	}
 
-	if(!halt)
-	{
-		regs.set(rd, mhartid);
-		pc += 4;
-	}
+	if(halt)
+		return nullptr;
+
+	regs.set(rd, mhartid);
+	pc += 4;
+	return d + 1;
 }
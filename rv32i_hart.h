@@ -2,13 +2,21 @@
 #define HART_H
 #include "registerfile.h"
 #include "memory.h"
+#include "rv32i_jit.h"
+#include "trace_recorder.h"
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
-class rv32i_hart : public rv32i_decode
+class rv32i_hart : public rv32i_decode, public code_watcher
 {
 
 	public:
-		// Constructor initializing the memory
-		rv32i_hart(memory &m) : mem (m) { }
+		// Constructor initializing the memory and registering for
+		// stores into cached code
+		rv32i_hart(memory &m) : dcache((m.get_size() >> dcache_page_bits) + 1), mem (m) { mem.add_code_watcher(this); }
+		~rv32i_hart() { mem.remove_code_watcher(this); }
 
 		// Determine if instructions will be showin in output
 		void set_show_instructions(bool b) { show_instructions = b; }
@@ -16,86 +24,388 @@ class rv32i_hart : public rv32i_decode
 		// Determine if registers will be showin in output
 		void set_show_registers(bool b) { show_registers = b; }
 
+		// With show_registers, dump only the pc and the registers
+		// written since the last dump, and all of them every n
+		// instructions. 0 dumps all of them every time.
+		void set_register_delta(uint64_t n) { register_delta = n; }
+		uint64_t get_register_delta() const { return register_delta; }
+
+		bool get_show_instructions() const { return show_instructions; }
+		bool get_show_registers() const { return show_registers; }
+
+		// The part of a run that instructions and registers are shown
+		// for. Instructions are counted from 0 and the ranges include
+		// both ends.
+		struct trace_window
+		{
+			enum
+			{
+				all,		// the whole run
+				insns,		// instructions first to last
+				pcs,		// instructions at pc lo to hi
+				hit		// count instructions from the hits'th
+						// time the one at lo is run, both
+						// at least 1
+			} kind = { all };
+
+			uint64_t first = { 0 };
+			uint64_t last = { UINT64_MAX };
+			uint32_t lo = { 0 };
+			uint32_t hi = { UINT32_MAX };
+			uint64_t hits = { 1 };
+			uint64_t count = { UINT64_MAX };
+		};
+
+		void set_trace_window(const trace_window &w) { window = w; }
+		bool has_trace_window() const { return window.kind != trace_window::all; }
+
+		// The number of instructions that can be run without
+		// rendering anything before the window might open. 0 when the
+		// next one has to go through tick().
+		uint64_t untraced_budget() const;
+
 		// Determine if the hart has been halted for any reason
 		bool is_halted() const { return halt; }
 
 		// Determine the reason why the hart was being halted 
 		const std::string &get_halt_reason() const { return halt_reason; }
 
+		// Determine if the hart halted on an illegal instruction, an
+		// illegal CSR or an access fault, rather than an ebreak
+		bool is_crashed() const { return halt && halt_reason != "EBREAK instruction"; }
+
 		// Determine the number of instructions that have been executed
 		uint64_t get_insn_counter() const { return insn_counter; }
 
+		// The address of the next instruction
+		uint32_t get_pc() const { return pc; }
+
+		// Determine how many of those were run as the second half of a
+		// fused pair
+		uint64_t get_fused_counter() const { return fused_counter; }
+
+		// Halt with an access fault on an out of range load or store,
+		// rather than warning and carrying on
+		void set_halt_on_fault(bool b) { halt_on_fault = b; }
+
+		// Have tick() fetch and decode every instruction through
+		// exec(), without the decode cache, as the reference that
+		// the faster engines are checked against
+		void set_uncached(bool b) { uncached = b; }
+
+		// Count the instructions retired at each pc, in every engine,
+		// for a profile
+		void set_profile(bool b);
+		bool is_profiling() const { return pc_counts != nullptr; }
+
+		// The times the instruction at each pc was retired, indexed by
+		// pc / 4
+		std::vector<uint64_t> get_pc_profile() const;
+
 		// Set the hart ID for the csrrs instruction
 		void set_mhartid(int i) { mhartid = i; }
+		uint32_t get_mhartid() const { return mhartid; }
 
-		// Tells the simulator to execute a given instruction
-		void tick(const std::string &hdr = "");
+		// Write a binary trace record for every instruction run, in
+		// every engine, or stop when r is nullptr
+		void set_recorder(trace_recorder *r);
+		bool is_recording() const { return recorder != nullptr; }
+
+		// Whether the recorder can only be given records by tick()
+		bool is_recording_by_tick() const { return recorder && recorder->needs_tick(); }
+
+		// The registers, as they are before the next tick()
+		const registerfile &get_registers() const { return regs; }
+
+		// The registers written by the instruction before the one
+		// tick() is running
+		uint32_t get_changed_registers() const { return changed_regs; }
+
+		// Executes whole basic blocks, without rendering anything, for
+		// up to budget instructions. Returns the number executed.
+		uint64_t run_blocks(uint64_t budget);
+
+		// Translate hot basic blocks into native code when running
+		// with run_blocks()
+		void set_jit(bool b);
+
+		// Executes instructions, without rendering anything, by chaining
+		// directly from one handler to the next for up to budget
+		// instructions.
+		// Returns the number executed.
+		uint64_t run_threaded(uint64_t budget);
+
+		// Decodes the basic blocks that start at each of starts ahead
+		// of time, and translates the ones at loops if translating
+		void preload(const std::vector<uint32_t> &starts, const std::vector<uint32_t> &loops);
 
 		// Dumps the entire state of the hart
  		void dump(const std::string &hdr = "") const;
 
+		// Where the trace, dumps and results are printed, std::cout
+		// unless changed
+		void set_output(std::ostream *os) { out = os; trace_out.set_stream(os); }
+		std::ostream &get_output() const { return *out; }
+
+		// Taken around every write of the buffered trace, when other
+		// threads print to the same output
+		void set_output_lock(std::mutex *m) { trace_out.set_lock(m); }
+
+		// Writes out anything traced or recorded by tick() that is
+		// still buffered. Needed before printing anything else to
+		// the output.
+		void flush_trace() { trace_out.flush(); if(recorder) recorder->flush(); }
+
 		// Resets the hart
  		void reset();
 
+		// Drops any cached decodes of the stored bytes
+		void code_modified(uint32_t addr, uint32_t len) override;
+
  	private:
  		static constexpr int instruction_width = 35;
 
+		// Pairs of instructions that run_threaded() executes as one
+		// operation. The kind is kept in the slot of the first one.
+		enum fuse_kind
+		{
+			fuse_none,
+			fuse_lui_addi,		// lui rd; addi rd2, rd, imm
+			fuse_auipc_jalr,	// auipc rd; jalr rd2, imm(rd)
+			fuse_slt_branch,	// slt[i][u] rd, ...; beq/bne rd, x0
+			fuse_addi_bne,		// addi rd, rs1, imm; bne rd, rs2
+			fuse_count
+		};
+
+		// One predecoded instruction. An empty slot has an id of
+		// id_none.
+		struct decoded_insn
+		{
+			insn_id id;
+			fuse_kind fused;
+			uint32_t insn;
+			uint32_t rd;
+			uint32_t rs1;
+			uint32_t rs2;
+			int32_t imm;
+		};
+
+		// The decode cache is split into pages of slots that are
+		// allocated the first time code in that page is executed. Each
+		// page has one extra slot on the end that is always empty, so
+		// the handlers can step off the end of a page.
+		static constexpr uint32_t dcache_page_bits = 12;
+		static constexpr uint32_t dcache_page_slots = (1 << dcache_page_bits) / 4;
+
+		decoded_insn *lookup(uint32_t addr);
+		void predecode(uint32_t insn, decoded_insn &d);
+
+		// Each handler executes its instruction and returns the slot to
+		// run next, or nullptr when the hart halts or the next pc is not
+		// in the cache. The trace_table handlers also render what they
+		// simulate, the exec_table ones are compiled without any of it.
+		typedef const decoded_insn *(rv32i_hart::*exec_fn)(const decoded_insn *);
+		static const exec_fn exec_table[id_count];
+		static const exec_fn trace_table[id_count];
+
+		const decoded_insn *jump_to(const decoded_insn *d, uint32_t target);
+		const decoded_insn *access_fault(uint32_t addr, bool store);
+
+		trace_record *record(const decoded_insn &d);
+		void record_result(trace_record &r, const decoded_insn &d);
+		void record_trail(uint32_t addr, const decoded_insn *d, uint32_t n);
+		static bool writes_rd(insn_id id);
+		trace_recorder *recorder = { nullptr };
+
+		// Fused pair handlers. They are handed the slot of the first
+		// instruction and leave the same state as running both.
+		static const exec_fn fused_table[fuse_count];
+		static fuse_kind pair(const decoded_insn &d, const decoded_insn &n);
+
+		const decoded_insn *fused_lui_addi(const decoded_insn *d);
+		const decoded_insn *fused_auipc_jalr(const decoded_insn *d);
+		const decoded_insn *fused_slt_branch(const decoded_insn *d);
+		const decoded_insn *fused_addi_bne(const decoded_insn *d);
+
+		std::vector<std::unique_ptr<decoded_insn[]>> dcache;
+
+		// A straight-line run of cached instructions ending at a
+		// branch, jal, jalr, ebreak, csrrs or illegal instruction.
+		// The successors it has been seen to go to are linked so
+		// that hot edges skip the block lookup.
+		struct basic_block
+		{
+			decoded_insn *insns;
+			uint32_t len;
+			uint32_t next_pc[2];
+			basic_block *next[2];
+
+			// Times run by the interpreter, and the translation
+			// once that passes the hot threshold
+			uint32_t hits;
+			rv32i_jit::block_fn native;
+		};
+
+		basic_block *find_block(uint32_t addr);
+		void translate_block(uint32_t addr, basic_block *b);
+
+		// Memory callbacks for translated code. They are unchecked,
+		// and store the pc first in case the access faults.
+		static uint32_t jit_lb(void *ctx, uint32_t addr, uint32_t pc);
+		static uint32_t jit_lh(void *ctx, uint32_t addr, uint32_t pc);
+		static uint32_t jit_lw(void *ctx, uint32_t addr, uint32_t pc);
+		static uint32_t jit_lbu(void *ctx, uint32_t addr, uint32_t pc);
+		static uint32_t jit_lhu(void *ctx, uint32_t addr, uint32_t pc);
+		static uint32_t jit_sb(void *ctx, uint32_t addr, uint32_t val, uint32_t pc);
+		static uint32_t jit_sh(void *ctx, uint32_t addr, uint32_t val, uint32_t pc);
+		static uint32_t jit_sw(void *ctx, uint32_t addr, uint32_t val, uint32_t pc);
+		static uint32_t jit_written(void *ctx, uint32_t addr, uint32_t len);
+
+		std::unique_ptr<rv32i_jit> jit;
+
+		// Where translated code leaves what each instruction did while
+		// recording, as long as the longest block translated
+		std::vector<rv32i_jit::trail_entry> trail;
+
+		// Where a translated loop counts its passes
+		rv32i_jit::loop_state loop = {};
+
+		std::unordered_map<uint32_t, std::unique_ptr<basic_block>> blocks;
+
+		// Counts n instructions run one after the other from addr.
+		// Only where the run starts and ends is counted, so a whole
+		// block costs the same as one instruction, and the count at
+		// each pc is the sum of those up to it.
+		void profile(uint32_t addr, uint32_t n)
+		{
+			pc_counts[addr >> 2]++;
+			pc_counts[(addr >> 2) + n]--;
+		}
+
+		// Counts n instructions run from addr by a block of len that
+		// a translated loop may have gone round more than once, all
+		// but the last pass whole
+		void profile_passes(uint32_t addr, uint32_t len, uint64_t n)
+		{
+			if(n > len)
+			{
+				uint64_t passes = (n - 1) / len;
+
+				pc_counts[addr >> 2] += passes;
+				pc_counts[(addr >> 2) + len] -= passes;
+				n -= passes * len;
+			}
+			profile(addr, n);
+		}
+
+		// A flat array rather than a map, so that leaving the profile
+		// on costs little. pc_counts is nullptr when it is off.
+		std::vector<uint64_t> pc_profile;
+		uint64_t *pc_counts = { nullptr };
+
+		// Set when a store lands in cached code, the blocks are then
+		// dropped before the next one is started
+		bool blocks_stale = { false };
+
 		// Executing any given RV32I instruction
- 		void exec(uint32_t insn, std::ostream*);
-		void exec_illegal_insn(uint32_t insn, std::ostream*);
-
-		void exec_lui(uint32_t insn, std::ostream*);
-		void exec_auipc(uint32_t insn, std::ostream*);
-		void exec_jal(uint32_t insn, std::ostream*);
-		void exec_jalr(uint32_t insn, std::ostream*);
-		void exec_bne(uint32_t insn, std::ostream*);
-		void exec_blt(uint32_t insn, std::ostream*);
-		void exec_bge(uint32_t insn, std::ostream*);
-		void exec_bltu(uint32_t insn, std::ostream*);
-		void exec_bgeu(uint32_t insn, std::ostream*);
-		void exec_beq(uint32_t insn, std::ostream*);
-		void exec_addi(uint32_t insn, std::ostream*);
-		void exec_lbu(uint32_t insn, std::ostream*);
-		void exec_lhu(uint32_t insn, std::ostream*);
-		void exec_lb(uint32_t insn, std::ostream*);
-		void exec_lh(uint32_t insn, std::ostream*);
-		void exec_lw(uint32_t insn, std::ostream*);
-		void exec_sb(uint32_t insn, std::ostream*);
-		void exec_sh(uint32_t insn, std::ostream*);
-		void exec_sw(uint32_t insn, std::ostream*);
-		void exec_slti(uint32_t insn, std::ostream*);
-		void exec_sltiu(uint32_t insn, std::ostream*);
-		void exec_xori(uint32_t insn, std::ostream*);
-		void exec_ori(uint32_t insn, std::ostream*);
-		void exec_andi(uint32_t insn, std::ostream*);
-		void exec_slli(uint32_t insn, std::ostream*);
-		void exec_srli(uint32_t insn, std::ostream*);
-		void exec_srai(uint32_t insn, std::ostream*);
-		void exec_add(uint32_t insn, std::ostream*);
-		void exec_sub(uint32_t insn, std::ostream*);
-		void exec_sll(uint32_t insn, std::ostream*);
-		void exec_slt(uint32_t insn, std::ostream*);
-		void exec_sltu(uint32_t insn, std::ostream*);
-		void exec_xor(uint32_t insn, std::ostream*);
-		void exec_srl(uint32_t insn, std::ostream*);
-		void exec_sra(uint32_t insn, std::ostream*);
-		void exec_or(uint32_t insn, std::ostream*);
-		void exec_and(uint32_t insn, std::ostream*);
-		void exec_ebreak(uint32_t insn, std::ostream*);
-		void exec_csrrs(uint32_t insn, std::ostream*);
+ 		void exec(uint32_t insn, bool show);
+		template<bool trace> const decoded_insn *exec_illegal_insn(const decoded_insn *d);
+
+		template<bool trace> const decoded_insn *exec_lui(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_auipc(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_jal(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_jalr(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_bne(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_blt(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_bge(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_bltu(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_bgeu(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_beq(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_addi(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_lbu(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_lhu(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_lb(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_lh(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_lw(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sb(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sh(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sw(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_slti(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sltiu(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_xori(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_ori(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_andi(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_slli(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_srli(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_srai(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_add(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sub(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sll(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_slt(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sltu(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_xor(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_srl(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_sra(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_or(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_and(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_ebreak(const decoded_insn *d);
+		template<bool trace> const decoded_insn *exec_csrrs(const decoded_insn *d);
 
 		// Initializing all necessary variables
 		bool halt = { false };
 		std::string halt_reason = { "none" };
 
  		uint64_t insn_counter = { 0 };
+ 		uint64_t fused_counter = { 0 };
  		uint32_t pc = { 0 };
  		uint32_t mhartid = { 0 };
 
+		void dump(trace_writer &out, const std::string &hdr) const;
+		void dump_changes(trace_writer &out, const std::string &hdr) const;
+
 		bool show_instructions = false;
 		bool show_registers = false;
 
+		trace_window window;
+		bool in_window();
+
+		uint64_t register_delta = { 0 };
+		uint32_t changed_regs = { 0 };
+		bool regs_dumped = { false };
+		bool halt_on_fault = false;
+		bool uncached = false;
+
  	protected:
+		// Everything tick() renders goes through here. Out of range
+		// warnings need to be sent here too, so they stay in order.
+		trace_writer trace_out = { &std::cout };
+		std::ostream *out = { &std::cout };
+
+		// Tells the simulator to execute a given instruction. Unless
+		// instructions are being shown, loads and stores are made
+		// without range checks, so the caller needs a fault_guard on
+		// mem that calls retry_access() when it is jumped to. Only
+		// the run loops of the harts that set one up call it, which
+		// is why it isn't public.
+		void tick(const std::string &hdr = "");
+
+		// Finishes an instruction whose unchecked load or store
+		// faulted, through the checked accessors
+		void retry_access();
+
+		// Runs an instruction from a binary trace, rendering it if
+		// instructions or registers are being shown
+		void replay(const trace_record &r, const std::string &hdr);
+
+		// Carries on the register dumps of a run part way through,
+		// after insns instructions, the last of which wrote the
+		// registers changed and had them dumped
+		void resume_dumps(uint64_t insns, uint32_t changed);
+
+		// Renders a trace record as its disassembly and what it left
+		// in rd or memory, with no state from before it
+		static void render_record(trace_writer &out, const std::string &hdr, const trace_record &r);
+
  		registerfile regs;
  		memory &mem;
 };
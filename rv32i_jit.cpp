@@ -0,0 +1,629 @@
+#include "hex.h"
+#include "rv32i_decode.h"
+#include "rv32i_jit.h"
+#include <sys/mman.h>
+
+using namespace std;
+
+// x86 register numbers as used in the ModRM byte
+static constexpr uint8_t x86_eax = 0;
+static constexpr uint8_t x86_ecx = 1;
+static constexpr uint8_t x86_edx = 2;
+static constexpr uint8_t x86_esi = 6;
+
+// The ModRM and SIB bytes of [r14+rsi], the host address of a guest one
+static constexpr uint8_t x86_r14_rsi_modrm = 0x04;
+static constexpr uint8_t x86_r14_rsi_sib = 0x36;
+
+/**
+ * Allocates the buffer that translated code is written into
+ *
+ * If the host is not x86-64, or will not give out executable memory,
+ * the buffer is left null and available() returns false.
+ *
+ * @param h The callbacks used for loads and stores
+ **************************************************************************/
+rv32i_jit::rv32i_jit(const helpers &h) : mem_ops(h)
+{
+#if defined(__x86_64__)
+	void *p = mmap(nullptr, code_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(p != MAP_FAILED)
+		code = static_cast<uint8_t*>(p);
+#endif
+}
+
+rv32i_jit::~rv32i_jit()
+{
+	if(code)
+		munmap(code, code_size);
+}
+
+void rv32i_jit::emit32(uint32_t v)
+{
+	for(int i = 0; i < 4; i++)
+		emit8(v >> (8*i));
+}
+
+void rv32i_jit::emit64(uint64_t v)
+{
+	for(int i = 0; i < 8; i++)
+		emit8(v >> (8*i));
+}
+
+/**
+ * Loads an RV32I register into an x86 register
+ *
+ * @param modrm_reg The x86 register number
+ * @param r The RV32I register, x0 is materialized as zero
+ **************************************************************************/
+void rv32i_jit::load_reg(uint8_t modrm_reg, uint32_t r)
+{
+	if(r == 0)
+	{
+		// xor reg,reg
+		emit8(0x31); emit8(0xc0 | modrm_reg << 3 | modrm_reg);
+	}
+	else
+	{
+		// mov reg,[rbx+4*r]
+		emit8(0x8b); emit8(0x43 | modrm_reg << 3); emit8(4*r);
+	}
+}
+
+/**
+ * Stores eax into an RV32I register, writes to x0 are dropped
+ *
+ * @param rd The RV32I register
+ **************************************************************************/
+void rv32i_jit::store_eax(uint32_t rd)
+{
+	if(rd != 0)
+	{
+		// mov [rbx+4*rd],eax
+		emit8(0x89); emit8(0x43); emit8(4*rd);
+	}
+}
+
+/**
+ * Restores the callee saved registers and returns
+ **************************************************************************/
+void rv32i_jit::epilogue()
+{
+	emit8(0x41); emit8(0x5f);	// pop r15
+	emit8(0x41); emit8(0x5e);	// pop r14
+	emit8(0x41); emit8(0x5d);	// pop r13
+	emit8(0x41); emit8(0x5c);	// pop r12
+	emit8(0x5b);			// pop rbx
+	emit8(0xc3);			// ret
+}
+
+/**
+ * Leaves the block at a pc that is known at translation time
+ *
+ * @param pc The pc to continue at
+ * @param count The number of instructions executed by the block
+ **************************************************************************/
+void rv32i_jit::exit_const(uint32_t pc, uint32_t count)
+{
+	if(looping)
+	{
+		emit8(0xb8); emit32(pc);	// mov eax,pc
+		exit_eax(count);
+		return;
+	}
+
+	// mov rax,count:pc
+	emit8(0x48); emit8(0xb8); emit64((uint64_t)count << 32 | pc);
+	epilogue();
+}
+
+/**
+ * Leaves the block at the pc that has been computed into eax
+ *
+ * @param count The number of instructions executed by the block
+ **************************************************************************/
+void rv32i_jit::exit_eax(uint32_t count)
+{
+	if(looping)
+	{
+		// The passes before this one are added on
+		emit8(0x41); emit8(0x8b); emit8(0x94); emit8(0x24);	// mov edx,[r12+done]
+		emit32(mem_ops.loop_offset + offsetof(loop_state, done));
+		emit8(0x81); emit8(0xc2); emit32(count);		// add edx,count
+		emit8(0x48); emit8(0xc1); emit8(0xe2); emit8(32);	// shl rdx,32
+	}
+	else
+	{
+		// mov rdx,count:0
+		emit8(0x48); emit8(0xba); emit64((uint64_t)count << 32);
+	}
+	emit8(0x48); emit8(0x09); emit8(0xd0);	// or rax,rdx
+	epilogue();
+}
+
+/**
+ * Calls a memory callback with the context pointer as its first argument
+ *
+ * @param fn The address of the callback
+ **************************************************************************/
+void rv32i_jit::call(uint64_t fn)
+{
+	emit8(0x4c); emit8(0x89); emit8(0xe7);	// mov rdi,r12
+	emit8(0x48); emit8(0xb8); emit64(fn);	// mov rax,fn
+	emit8(0xff); emit8(0xd0);		// call rax
+}
+
+/**
+ * Puts the pc of a load or store made inline where the hart keeps it
+ *
+ * @param pc The address of the instruction
+ **************************************************************************/
+void rv32i_jit::store_pc(uint32_t pc)
+{
+	// mov dword [r12+pc_offset],pc
+	emit8(0x41); emit8(0xc7); emit8(0x84); emit8(0x24);
+	emit32(mem_ops.pc_offset);
+	emit32(pc);
+}
+
+/**
+ * Points a short forward jump at the code about to be emitted
+ *
+ * @param at Where the jump's 8 bit displacement is
+ **************************************************************************/
+void rv32i_jit::jump_here(size_t at)
+{
+	code[at] = used - (at + 1);
+}
+
+/**
+ * Writes an x86 register into the trail entry of an instruction
+ *
+ * @param count The number of instructions executed once this one is done
+ * @param field The offset of the field in the trail_entry
+ * @param modrm_reg The x86 register number
+ **************************************************************************/
+void rv32i_jit::trail_reg(uint32_t count, size_t field, uint8_t modrm_reg)
+{
+	if(trailing)
+	{
+		// mov [r13+disp],reg
+		emit8(0x41); emit8(0x89); emit8(0x85 | modrm_reg << 3);
+		emit32((count - 1) * sizeof(trail_entry) + field);
+	}
+}
+
+/**
+ * Writes a value known at translation time into the trail entry of an
+ * instruction
+ *
+ * @param count The number of instructions executed once this one is done
+ * @param field The offset of the field in the trail_entry
+ * @param val The value
+ **************************************************************************/
+void rv32i_jit::trail_const(uint32_t count, size_t field, uint32_t val)
+{
+	if(trailing)
+	{
+		// mov dword [r13+disp],val
+		emit8(0x41); emit8(0xc7); emit8(0x85);
+		emit32((count - 1) * sizeof(trail_entry) + field);
+		emit32(val);
+	}
+}
+
+/**
+ * Translates a basic block
+ *
+ * Translation stops at the first instruction that can not be translated,
+ * or after an instruction that changes the pc.
+ *
+ * @param pc The address of the first instruction
+ * @param insns The instructions of the block
+ * @param trail True to fill in a trail_entry for each instruction run
+ *
+ * @return The translated code, or nullptr
+ **************************************************************************/
+rv32i_jit::block_fn rv32i_jit::compile(uint32_t pc, const std::vector<uint32_t> &insns, bool trail)
+{
+	if(!code || code_size - used < (insns.size() + 2) * max_insn_bytes)
+		return nullptr;
+
+	size_t start = used;
+	trailing = trail;
+
+	// A loop's passes would all need a trail of their own
+	uint32_t last = insns.empty() ? 0 : insns.back();
+	looping = !trailing && mem_ops.loop_offset && get_opcode(last) == opcode_btype
+		&& pc + (insns.size() - 1) * 4 + get_imm_b(last) == pc;
+	loop_pc = pc;
+
+	// Save the callee saved registers, which also leaves the stack
+	// aligned for the memory callbacks, and keep ctx, regs, the trail,
+	// the host memory and the code page flags in them
+	emit8(0x53);				// push rbx
+	emit8(0x41); emit8(0x54);		// push r12
+	emit8(0x41); emit8(0x55);		// push r13
+	emit8(0x41); emit8(0x56);		// push r14
+	emit8(0x41); emit8(0x57);		// push r15
+	emit8(0x49); emit8(0x89); emit8(0xfc);	// mov r12,rdi
+	emit8(0x48); emit8(0x89); emit8(0xf3);	// mov rbx,rsi
+	if(trailing)
+	{
+		emit8(0x49); emit8(0x89); emit8(0xd5);	// mov r13,rdx
+	}
+	if(mem_ops.host_base)
+	{
+		// mov r14,host_base
+		emit8(0x49); emit8(0xbe); emit64(reinterpret_cast<uint64_t>(mem_ops.host_base));
+	}
+	if(mem_ops.host_base && mem_ops.code_pages)
+	{
+		// mov r15,code_pages
+		emit8(0x49); emit8(0xbf); emit64(reinterpret_cast<uint64_t>(mem_ops.code_pages));
+	}
+	loop_top = used;
+
+	uint32_t count = 0;
+	bool ended = false;
+	for(size_t i = 0; i < insns.size() && !ended; i++)
+	{
+		uint32_t opcode = get_opcode(insns[i]);
+
+		if(!emit_insn(pc, insns[i], count + 1))
+			break;
+
+		count++;
+		ended = (opcode == opcode_btype || opcode == opcode_jal || opcode == opcode_jalr);
+		pc += 4;
+	}
+
+	if(count == 0)
+	{
+		used = start;
+		return nullptr;
+	}
+
+	if(!ended)
+		exit_const(pc, count);
+
+	return reinterpret_cast<block_fn>(code + start);
+}
+
+/**
+ * Emits the native code for a single instruction
+ *
+ * Nothing is emitted for an instruction that can not be translated.
+ *
+ * @param pc The address of the instruction
+ * @param insn The instruction
+ * @param count The number of instructions executed once this one is done
+ *
+ * @return False if the instruction can not be translated
+ **************************************************************************/
+bool rv32i_jit::emit_insn(uint32_t pc, uint32_t insn, uint32_t count)
+{
+	uint32_t opcode = get_opcode(insn);
+	uint32_t funct3 = get_funct3(insn);
+	uint32_t funct7 = get_funct7(insn);
+	uint32_t rd = get_rd(insn);
+	uint32_t rs1 = get_rs1(insn);
+	uint32_t rs2 = get_rs2(insn);
+	int32_t imm_i = get_imm_i(insn);
+	size_t mark = used;
+
+	switch(opcode)
+	{
+		default:
+			used = mark; return false;
+
+		case opcode_lui:
+		case opcode_auipc:
+		{
+			uint32_t val = get_imm_u(insn) + (opcode == opcode_auipc ? pc : 0);
+			if(rd != 0)
+			{
+				// mov dword [rbx+4*rd],val
+				emit8(0xc7); emit8(0x43); emit8(4*rd); emit32(val);
+				trail_const(count, offsetof(trail_entry, rd_value), val);
+			}
+			return true;
+		}
+
+		case opcode_jal:
+			if(rd != 0)
+			{
+				emit8(0xc7); emit8(0x43); emit8(4*rd); emit32(pc + 4);
+				trail_const(count, offsetof(trail_entry, rd_value), pc + 4);
+			}
+			exit_const(pc + get_imm_j(insn), count);
+			return true;
+
+		case opcode_jalr:
+			// The target is worked out before rd is written, as rd
+			// may be the same register as rs1
+			load_reg(x86_eax, rs1);
+			emit8(0x05); emit32(imm_i);		// add eax,imm
+			emit8(0x25); emit32(0xfffffffe);	// and eax,~1
+			if(rd != 0)
+			{
+				emit8(0xc7); emit8(0x43); emit8(4*rd); emit32(pc + 4);
+				trail_const(count, offsetof(trail_entry, rd_value), pc + 4);
+			}
+			exit_eax(count);
+			return true;
+
+		case opcode_btype:
+		{
+			uint8_t cmov;
+			switch(funct3)
+			{
+				default:          used = mark; return false;
+				case funct3_beq:  cmov = 0x44; break;	// cmove
+				case funct3_bne:  cmov = 0x45; break;	// cmovne
+				case funct3_blt:  cmov = 0x4c; break;	// cmovl
+				case funct3_bge:  cmov = 0x4d; break;	// cmovge
+				case funct3_bltu: cmov = 0x42; break;	// cmovb
+				case funct3_bgeu: cmov = 0x43; break;	// cmovae
+			}
+			load_reg(x86_eax, rs1);
+			load_reg(x86_ecx, rs2);
+			emit8(0x39); emit8(0xc8);				// cmp eax,ecx
+			if(looping && pc + get_imm_b(insn) == loop_pc)
+			{
+				loop_back(cmov & 0x0f, pc, count);
+				return true;
+			}
+			emit8(0xb8); emit32(pc + 4);				// mov eax,pc+4
+			emit8(0xba); emit32(pc + get_imm_b(insn));		// mov edx,target
+			emit8(0x0f); emit8(cmov); emit8(0xc2);			// cmovcc eax,edx
+			exit_eax(count);
+			return true;
+		}
+
+		case opcode_load_imm:
+			return emit_load(pc, insn, count);
+
+		case opcode_stype:
+			return emit_store(pc, insn, count);
+
+		case opcode_alu_imm:
+			load_reg(x86_eax, rs1);
+			switch(funct3)
+			{
+				default:          used = mark; return false;
+				case funct3_add:  emit8(0x05); emit32(imm_i); break;	// add eax,imm
+				case funct3_xor:  emit8(0x35); emit32(imm_i); break;	// xor eax,imm
+				case funct3_or:   emit8(0x0d); emit32(imm_i); break;	// or eax,imm
+				case funct3_and:  emit8(0x25); emit32(imm_i); break;	// and eax,imm
+				case funct3_slt:
+				case funct3_sltu:
+					emit8(0x31); emit8(0xc9);			// xor ecx,ecx
+					emit8(0x3d); emit32(imm_i);			// cmp eax,imm
+					emit8(0x0f); emit8(funct3 == funct3_slt ? 0x9c : 0x92); emit8(0xc1);	// setl/setb cl
+					emit8(0x89); emit8(0xc8);			// mov eax,ecx
+					break;
+				case funct3_sll:
+					emit8(0xc1); emit8(0xe0); emit8(imm_i % XLEN);	// shl eax,imm
+					break;
+			  	case funct3_srx:
+					switch(funct7)
+					{
+						default:         used = mark; return false;
+						case funct7_srl: emit8(0xc1); emit8(0xe8); emit8(imm_i % XLEN); break;	// shr eax,imm
+						case funct7_sra: emit8(0xc1); emit8(0xf8); emit8(imm_i % XLEN); break;	// sar eax,imm
+					}
+					break;
+			}
+			store_eax(rd);
+			if(rd != 0)
+				trail_reg(count, offsetof(trail_entry, rd_value), x86_eax);
+			return true;
+
+		case opcode_rtype:
+			load_reg(x86_eax, rs1);
+			load_reg(x86_ecx, rs2);
+			switch(funct3)
+			{
+				default:  	  used = mark; return false;
+				case funct3_add:
+					switch(funct7)
+					{
+						default:  	  used = mark; return false;
+						case funct7_add:  emit8(0x01); emit8(0xc8); break;	// add eax,ecx
+						case funct7_sub:  emit8(0x29); emit8(0xc8); break;	// sub eax,ecx
+					}
+					break;
+				case funct3_xor:  emit8(0x31); emit8(0xc8); break;		// xor eax,ecx
+				case funct3_or:   emit8(0x09); emit8(0xc8); break;		// or eax,ecx
+				case funct3_and:  emit8(0x21); emit8(0xc8); break;		// and eax,ecx
+				case funct3_sll:  emit8(0xd3); emit8(0xe0); break;		// shl eax,cl
+				case funct3_slt:
+				case funct3_sltu:
+					emit8(0x31); emit8(0xd2);				// xor edx,edx
+					emit8(0x39); emit8(0xc8);				// cmp eax,ecx
+					emit8(0x0f); emit8(funct3 == funct3_slt ? 0x9c : 0x92); emit8(0xc2);	// setl/setb dl
+					emit8(0x89); emit8(0xd0);				// mov eax,edx
+					break;
+			 	case funct3_srx:
+					switch(funct7)
+					{
+						default:         used = mark; return false;
+						case funct7_srl: emit8(0xd3); emit8(0xe8); break;	// shr eax,cl
+						case funct7_sra: emit8(0xd3); emit8(0xf8); break;	// sar eax,cl
+					}
+					break;
+			}
+			store_eax(rd);
+			if(rd != 0)
+				trail_reg(count, offsetof(trail_entry, rd_value), x86_eax);
+			return true;
+	}
+}
+
+/**
+ * Emits the end of a block that branches back to its own start
+ *
+ * When the branch is taken the block goes round again, as long as the
+ * pass after this one would still fit in the room. The flags are set by
+ * the compare of the branch.
+ *
+ * @param cc The x86 condition for the branch being taken
+ * @param pc The address of the branch
+ * @param count The number of instructions in a pass
+ **************************************************************************/
+void rv32i_jit::loop_back(uint8_t cc, uint32_t pc, uint32_t count)
+{
+	int32_t done = mem_ops.loop_offset + offsetof(loop_state, done);
+	int32_t room = mem_ops.loop_offset + offsetof(loop_state, room);
+
+	emit8(0x70 | (cc ^ 1)); size_t fall = used; emit8(0);			// jncc to the exit past the loop
+	emit8(0x41); emit8(0x8b); emit8(0x84); emit8(0x24); emit32(done);	// mov eax,[r12+done]
+	emit8(0x05); emit32(count);						// add eax,count
+	emit8(0x41); emit8(0x89); emit8(0x84); emit8(0x24); emit32(done);	// mov [r12+done],eax
+	emit8(0x05); emit32(count);						// add eax,count
+	emit8(0x41); emit8(0x3b); emit8(0x84); emit8(0x24); emit32(room);	// cmp eax,[r12+room]
+	emit8(0x77); size_t full = used; emit8(0);				// ja to the exit at the start
+	emit8(0xe9); emit32(loop_top - (used + 4));				// jmp to the start
+
+	jump_here(full);
+	exit_const(loop_pc, 0);
+	jump_here(fall);
+	exit_const(pc + 4, count);
+}
+
+/**
+ * Emits the native code for a load
+ *
+ * With the host memory at hand the load is a single move from it, which
+ * faults like the callback would when the address is out of range.
+ *
+ * @param pc The address of the instruction
+ * @param insn The instruction
+ * @param count The number of instructions executed once this one is done
+ *
+ * @return False if the instruction can not be translated
+ **************************************************************************/
+bool rv32i_jit::emit_load(uint32_t pc, uint32_t insn, uint32_t count)
+{
+	load_fn fn;
+	uint8_t op;		// the second byte of movsx/movzx, or 0 for mov
+
+	switch(get_funct3(insn))
+	{
+		default:	 return false;
+		case funct3_lb:  fn = mem_ops.lb; op = 0xbe; break;
+		case funct3_lh:  fn = mem_ops.lh; op = 0xbf; break;
+		case funct3_lw:  fn = mem_ops.lw; op = 0; break;
+		case funct3_lbu: fn = mem_ops.lbu; op = 0xb6; break;
+		case funct3_lhu: fn = mem_ops.lhu; op = 0xb7; break;
+	}
+	load_reg(x86_esi, get_rs1(insn));
+	emit8(0x81); emit8(0xc6); emit32(get_imm_i(insn));	// add esi,imm
+	trail_reg(count, offsetof(trail_entry, mem_addr), x86_esi);
+
+	if(mem_ops.host_base)
+	{
+		store_pc(pc);
+		emit8(0x41);					// mov/movsx/movzx eax,[r14+rsi]
+		if(op)
+		{
+			emit8(0x0f); emit8(op);
+		}
+		else
+			emit8(0x8b);
+		emit8(x86_r14_rsi_modrm); emit8(x86_r14_rsi_sib);
+	}
+	else
+	{
+		emit8(0xba); emit32(pc);			// mov edx,pc
+		call(reinterpret_cast<uint64_t>(fn));
+	}
+	trail_reg(count, offsetof(trail_entry, mem_value), x86_eax);
+	store_eax(get_rd(insn));
+	return true;
+}
+
+/**
+ * Emits the native code for a store
+ *
+ * With the host memory and the code page flags at hand the store is a
+ * single move into it, and the callback is only needed to pass on a
+ * store into a page of code. Either way the block exits right after a
+ * store that hit cached code.
+ *
+ * @param pc The address of the instruction
+ * @param insn The instruction
+ * @param count The number of instructions executed once this one is done
+ *
+ * @return False if the instruction can not be translated
+ **************************************************************************/
+bool rv32i_jit::emit_store(uint32_t pc, uint32_t insn, uint32_t count)
+{
+	store_fn fn;
+	uint32_t len;
+
+	switch(get_funct3(insn))
+	{
+		default: 	return false;
+		case funct3_sb: fn = mem_ops.sb; len = 1; break;
+		case funct3_sh: fn = mem_ops.sh; len = 2; break;
+		case funct3_sw: fn = mem_ops.sw; len = 4; break;
+	}
+	load_reg(x86_esi, get_rs1(insn));
+	emit8(0x81); emit8(0xc6); emit32(get_imm_s(insn));	// add esi,imm
+	load_reg(x86_edx, get_rs2(insn));
+	trail_reg(count, offsetof(trail_entry, mem_addr), x86_esi);
+	trail_reg(count, offsetof(trail_entry, mem_value), x86_edx);
+
+	size_t done = 0;
+	if(mem_ops.host_base && mem_ops.code_pages)
+	{
+		store_pc(pc);
+		if(len == 2)
+			emit8(0x66);				// operand size prefix
+		emit8(0x41); emit8(len == 1 ? 0x88 : 0x89);	// mov [r14+rsi],dl/dx/edx
+		emit8(x86_r14_rsi_modrm | x86_edx << 3); emit8(x86_r14_rsi_sib);
+		if(mem_ops.fence)
+		{
+			emit8(0x0f); emit8(0xae); emit8(0xf0);	// mfence
+		}
+
+		// Check the flags of the pages of the first and last bytes
+		auto code_page = [this]()
+		{
+			emit8(0xc1); emit8(0xe8); emit8(mem_ops.code_page_bits);		// shr eax,bits
+			emit8(0x41); emit8(0x80); emit8(0x3c); emit8(0x07); emit8(0);	// cmp byte [r15+rax],0
+		};
+		size_t first = 0;
+
+		emit8(0x89); emit8(0xf0);			// mov eax,esi
+		code_page();
+		if(len > 1)
+		{
+			emit8(0x75); first = used; emit8(0);	// jne to the callback
+			emit8(0x8d); emit8(0x46); emit8(len - 1);	// lea eax,[rsi+len-1]
+			code_page();
+		}
+		emit8(0x74); done = used; emit8(0);		// je over the callback
+		if(first)
+			jump_here(first);
+
+		emit8(0xba); emit32(len);			// mov edx,len
+		call(reinterpret_cast<uint64_t>(mem_ops.written));
+	}
+	else
+	{
+		emit8(0xb9); emit32(pc);			// mov ecx,pc
+		call(reinterpret_cast<uint64_t>(fn));
+	}
+
+	// Leave right away if the store hit cached code
+	emit8(0x85); emit8(0xc0);		// test eax,eax
+	emit8(0x74); size_t skip = used; emit8(0);	// jz over the exit
+	exit_const(pc + 4, count);
+	jump_here(skip);
+	if(done)
+		jump_here(done);
+	return true;
+}
@@ -0,0 +1,140 @@
+#ifndef JIT_H
+#define JIT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "hex.h"
+#include "rv32i_decode.h"
+
+// Translates basic blocks of RV32I instructions into native x86-64 code.
+//
+// A translated block is called with the hart's context pointer and its
+// array of 32 registers. It returns the pc to continue at in the low 32
+// bits and the number of instructions it executed in the high 32 bits.
+// ebreak, csrrs and illegal instructions are never translated, a block
+// stops just before them so the interpreter can run them.
+//
+// A block translated with a trail also fills in one trail_entry for each
+// instruction it executes, so that a trace can be recorded from it.
+//
+// A block without a trail that ends in a branch back to its own start
+// runs the loop natively, pass after pass, for as long as the next pass
+// fits in the room it was given. The count it returns is for all of the
+// passes.
+class rv32i_jit : public rv32i_decode
+{
+	public:
+		// What an instruction left behind: the value written to rd,
+		// or the address and value of a load or store. Only the ones
+		// the instruction has are filled in.
+		struct trail_entry
+		{
+			uint32_t rd_value;
+			uint32_t mem_addr;
+			uint32_t mem_value;
+		};
+
+		typedef uint64_t (*block_fn)(void *ctx, int32_t *regs, trail_entry *trail);
+
+		// Memory access callbacks, which are also passed the pc of
+		// the instruction. A store returns nonzero when it has
+		// modified cached code, and the block then exits.
+		typedef uint32_t (*load_fn)(void *ctx, uint32_t addr, uint32_t pc);
+		typedef uint32_t (*store_fn)(void *ctx, uint32_t addr, uint32_t val, uint32_t pc);
+
+		// Called after a store made inline into a page of code, and
+		// returns the same as a store callback
+		typedef uint32_t (*written_fn)(void *ctx, uint32_t addr, uint32_t len);
+
+		struct helpers
+		{
+			load_fn lb, lh, lw, lbu, lhu;
+			store_fn sb, sh, sw;
+
+			// Loads and stores are made inline, straight to the
+			// host memory at host_base, unless it is nullptr. The
+			// pc is put at pc_offset in ctx first, in case the
+			// access faults. A store is then checked against the
+			// flag for its code page, 1 << code_page_bits bytes,
+			// and passed to written if it is set. Without
+			// code_pages stores always use the callbacks. With
+			// fence, an mfence is put between the store and the
+			// check, as memory::written() does for harts that
+			// share memory.
+			uint8_t *host_base;
+			int32_t pc_offset;
+			const uint8_t *code_pages;
+			uint32_t code_page_bits;
+			written_fn written;
+			bool fence;
+
+			// Where in ctx the loop_state is, 0 to never loop
+			int32_t loop_offset;
+		};
+
+		// Kept in ctx for a block that loops. done is 0 when the
+		// block is called, and counts the instructions of the passes
+		// before the current one, so a fault part way through can be
+		// counted. room is the most instructions it may run in all.
+		struct loop_state
+		{
+			uint32_t done;
+			uint32_t room;
+		};
+
+		// Blocks are translated after running this many times
+		static constexpr uint32_t hot_threshold = 16;
+
+		rv32i_jit(const helpers &h);
+		~rv32i_jit();
+
+		// Is native code generation available on this host
+		bool available() const { return code != nullptr; }
+
+		// Translates the instructions starting at pc, leaving a trail
+		// if trail is true. Returns nullptr if nothing in the block can
+		// be translated or the code buffer is full.
+		block_fn compile(uint32_t pc, const std::vector<uint32_t> &insns, bool trail);
+
+		// Throws away all of the translated code
+		void reset() { used = 0; }
+
+	private:
+		static constexpr size_t code_size = 16 << 20;
+
+		// Worst case bytes emitted for one instruction, plus the exit
+		static constexpr size_t max_insn_bytes = 160;
+
+		void emit8(uint8_t b) { code[used++] = b; }
+		void emit32(uint32_t v);
+		void emit64(uint64_t v);
+
+		void load_reg(uint8_t modrm_reg, uint32_t r);
+		void store_eax(uint32_t rd);
+		void exit_const(uint32_t pc, uint32_t count);
+		void exit_eax(uint32_t count);
+		void epilogue();
+		void call(uint64_t fn);
+		void store_pc(uint32_t pc);
+		void jump_here(size_t at);
+		bool emit_load(uint32_t pc, uint32_t insn, uint32_t count);
+		bool emit_store(uint32_t pc, uint32_t insn, uint32_t count);
+		void loop_back(uint8_t cc, uint32_t pc, uint32_t count);
+		void trail_reg(uint32_t count, size_t field, uint8_t modrm_reg);
+		void trail_const(uint32_t count, size_t field, uint32_t val);
+
+		bool emit_insn(uint32_t pc, uint32_t insn, uint32_t count);
+
+		helpers mem_ops;
+		uint8_t *code = { nullptr };
+		size_t used = { 0 };
+		bool trailing = { false };
+
+		// Set while translating a block that loops, with the address
+		// of its first instruction and where the code for it starts
+		bool looping = { false };
+		uint32_t loop_pc = { 0 };
+		size_t loop_top = { 0 };
+};
+
+#endif
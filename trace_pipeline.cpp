@@ -0,0 +1,180 @@
+#include "trace_pipeline.h"
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+/**
+ * Constructor
+ *
+ * Starts the workers, each with a memory of the same size as the hart's
+ * to replay on, and the writer.
+ *
+ * @param hart The hart whose instructions are recorded
+ * @param mem The hart's memory
+ * @param workers The number of worker threads
+ * @param show_insns Render the instructions, like -i
+ * @param show_regs Render the registers before each one, like -r
+ **************************************************************************/
+trace_pipeline::trace_pipeline(const rv32i_hart &hart, memory &mem, unsigned workers, bool show_insns, bool show_regs)
+	: hart(hart), mem(mem), warning_limit(mem.get_warning_limit()),
+	ring_size(2 * workers + 2), ring(new chunk[ring_size])
+{
+	mem.set_warning_limit(0);
+
+	for(unsigned i = 0; i < workers; i++)
+	{
+		worker_mem.emplace_back(new memory(mem.get_size()));
+		worker_mem.back()->set_warning_limit(warning_limit);
+
+		replays.emplace_back(new trace_replay(*worker_mem.back()));
+		replays.back()->set_mhartid(hart.get_mhartid());
+		replays.back()->set_show_instructions(show_insns);
+		replays.back()->set_show_registers(show_regs);
+		replays.back()->set_register_delta(hart.get_register_delta());
+	}
+
+	for(unsigned i = 0; i < workers; i++)
+		threads.emplace_back(&trace_pipeline::work, this, i);
+	threads.emplace_back(&trace_pipeline::write, this);
+}
+
+/**
+ * Destructor
+ *
+ * Prints whatever is left and stops the threads.
+ **************************************************************************/
+trace_pipeline::~trace_pipeline()
+{
+	flush();
+	stopping.store(true);
+	for(auto &t : threads)
+		t.join();
+
+	mem.set_warning_limit(warning_limit);
+}
+
+/**
+ * Hands the chunk being filled to the workers, and starts the next one
+ *
+ * Called by next() before the first record and whenever the chunk is
+ * full. The instruction being recorded has not run yet, so the hart's
+ * registers are the ones the new chunk starts with, though it has already
+ * been counted.
+ **************************************************************************/
+void trace_pipeline::spill()
+{
+	if(capacity)
+		publish();
+
+	chunk &c = slot(published);
+	unsigned spins = 0;
+
+	while(c.state.load(std::memory_order_acquire) != chunk_free)
+		wait(spins);
+
+	for(uint32_t i = 0; i < 32; i++)
+		c.start.regs[i] = hart.get_registers().get(i);
+	c.start.changed = hart.get_changed_registers();
+	c.start.insns = hart.get_insn_counter() - 1;
+	c.start.warnings = mem.get_warning_count();
+
+	records = c.records;
+	used = 0;
+	capacity = chunk_records;
+}
+
+/**
+ * Hands the chunk being filled to the workers
+ **************************************************************************/
+void trace_pipeline::publish()
+{
+	chunk &c = slot(published);
+
+	c.count = used;
+	c.seq.store(published, std::memory_order_relaxed);
+	c.state.store(chunk_full, std::memory_order_release);
+	published++;
+
+	used = 0;
+	capacity = 0;
+}
+
+/**
+ * Waits until everything recorded so far has been printed
+ *
+ * The next record starts a new chunk, with the registers as they are
+ * then.
+ **************************************************************************/
+void trace_pipeline::flush()
+{
+	if(used)
+		publish();
+	capacity = 0;
+
+	unsigned spins = 0;
+	while(written.load(std::memory_order_acquire) != published)
+		wait(spins);
+}
+
+/**
+ * Worker thread, renders chunks in the order it claims them
+ *
+ * @param id The worker's number, which replay it uses
+ **************************************************************************/
+void trace_pipeline::work(unsigned id)
+{
+	for(;;)
+	{
+		uint64_t seq = claimed.fetch_add(1);
+		chunk &c = slot(seq);
+		unsigned spins = 0;
+
+		// The slot may still hold the chunk from a lap before
+		while(c.state.load(std::memory_order_acquire) != chunk_full || c.seq.load(std::memory_order_relaxed) != seq)
+		{
+			if(stopping.load())
+				return;
+			wait(spins);
+		}
+
+		replays[id]->render(c.start, c.records, c.count, c.text);
+		c.state.store(chunk_rendered, std::memory_order_release);
+	}
+}
+
+/**
+ * Writer thread, prints the rendered chunks in order
+ **************************************************************************/
+void trace_pipeline::write()
+{
+	for(uint64_t seq = 0; ; seq++)
+	{
+		chunk &c = slot(seq);
+		unsigned spins = 0;
+
+		while(c.state.load(std::memory_order_acquire) != chunk_rendered)
+		{
+			if(stopping.load())
+				return;
+			wait(spins);
+		}
+
+		hart.get_output().write(c.text.data(), c.text.size());
+		c.state.store(chunk_free, std::memory_order_release);
+		written.store(seq + 1, std::memory_order_release);
+	}
+}
+
+/**
+ * Waits for another thread to catch up
+ *
+ * @param spins The number of times this wait has been called so far
+ **************************************************************************/
+void trace_pipeline::wait(unsigned &spins)
+{
+	if(++spins < 64)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
@@ -0,0 +1,89 @@
+#ifndef TRACE_PIPELINE_H
+#define TRACE_PIPELINE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memory.h"
+#include "rv32i_hart.h"
+#include "trace_recorder.h"
+#include "trace_replay.h"
+
+// Renders the -i and -r output of a hart on worker threads.
+//
+// The hart only records its instructions, into chunks in a ring. Each
+// chunk starts with a snapshot of the hart, so the workers can each
+// take the next chunk and render it on a trace_replay of their own, in
+// parallel. A writer thread prints the chunks in the order they were
+// recorded, so the output is just what tick() would have printed.
+//
+// The ring is lock free. Each chunk moves from free to full (by the
+// hart) to rendered (by a worker) and back to free (by the writer).
+class trace_pipeline : public trace_recorder
+{
+	public:
+		// The hart must render nothing itself. Its memory's warnings
+		// are silenced while the pipeline exists, the workers print
+		// them instead.
+		trace_pipeline(const rv32i_hart &hart, memory &mem, unsigned workers, bool show_insns, bool show_regs);
+		~trace_pipeline();
+
+		// Waits until everything recorded so far has been printed
+		void flush() override;
+
+		// Each chunk starts from the hart's registers
+		bool needs_tick() const override { return true; }
+
+	protected:
+		void spill() override;
+
+	private:
+		static constexpr size_t chunk_records = 4096;
+
+		enum { chunk_free, chunk_full, chunk_rendered };
+
+		struct chunk
+		{
+			std::atomic<int> state = { chunk_free };
+			std::atomic<uint64_t> seq = { 0 };
+
+			// The state before the first record
+			trace_snapshot start;
+
+			size_t count;
+			trace_record records[chunk_records];
+			std::string text;
+		};
+
+		chunk &slot(uint64_t seq) { return ring[seq % ring_size]; }
+
+		void publish();
+		void work(unsigned id);
+		void write();
+
+		// Yields at first, then sleeps, while another thread catches
+		// up
+		static void wait(unsigned &spins);
+
+		const rv32i_hart &hart;
+		memory &mem;
+		uint64_t warning_limit;
+
+		size_t ring_size;
+		std::unique_ptr<chunk[]> ring;
+
+		// Chunks published by the hart, claimed by the workers and
+		// printed by the writer
+		uint64_t published = { 0 };
+		std::atomic<uint64_t> claimed = { 0 };
+		std::atomic<uint64_t> written = { 0 };
+		std::atomic<bool> stopping = { false };
+
+		std::vector<std::unique_ptr<memory>> worker_mem;
+		std::vector<std::unique_ptr<trace_replay>> replays;
+		std::vector<std::thread> threads;
+};
+
+#endif
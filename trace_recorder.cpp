@@ -0,0 +1,70 @@
+#include "trace_recorder.h"
+#include <cstring>
+
+using namespace std;
+
+constexpr char trace_recorder::magic[8];
+
+/**
+ * Constructor
+ *
+ * Writes the header of the trace.
+ *
+ * @param os The stream to write the trace to
+ * @param mem_size The size of memory
+ * @param mhartid The hart ID read by csrrs
+ **************************************************************************/
+trace_recorder::trace_recorder(std::ostream &os, uint32_t mem_size, uint32_t mhartid) : os(&os), buffer(buffer_records)
+{
+	trace_header h;
+
+	records = buffer.data();
+	capacity = buffer.size();
+
+	memcpy(h.magic, magic, sizeof(h.magic));
+	h.mem_size = mem_size;
+	h.mhartid = mhartid;
+	os.write(reinterpret_cast<const char*>(&h), sizeof(h));
+}
+
+trace_recorder::~trace_recorder()
+{
+	if(os)
+		flush();
+}
+
+/**
+ * Writes out the records buffered so far
+ **************************************************************************/
+void trace_recorder::flush()
+{
+	os->write(reinterpret_cast<const char*>(records), used * sizeof(trace_record));
+	os->flush();
+	used = 0;
+}
+
+/**
+ * Reads and checks the header of a trace
+ *
+ * @param is The stream to read from
+ * @param h Where to put the header
+ *
+ * @return True if the stream starts with a trace header
+ **************************************************************************/
+bool trace_recorder::read_header(std::istream &is, trace_header &h)
+{
+	if(!is.read(reinterpret_cast<char*>(&h), sizeof(h)))
+		return false;
+	return memcmp(h.magic, magic, sizeof(h.magic)) == 0;
+}
+
+/**
+ * Constructor
+ *
+ * @param n The number of records to keep, at least 1
+ **************************************************************************/
+flight_recorder::flight_recorder(size_t n) : ring(n)
+{
+	records = ring.data();
+	capacity = ring.size();
+}
@@ -0,0 +1,101 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <stdint.h>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+// A binary trace is a trace_header followed by one trace_record for
+// every instruction executed, in the host's byte order. rv32i -t writes
+// one and trace_render turns it back into the -i and -r text.
+struct trace_header
+{
+	char magic[8];
+	uint32_t mem_size;	// the size of memory, the initial sp
+	uint32_t mhartid;
+};
+
+struct trace_record
+{
+	uint32_t pc;
+	uint32_t insn;
+	uint32_t rd_value;	// rd after the instruction
+	uint32_t mem_addr;	// the address of a load or store
+	uint32_t mem_value;	// the value loaded into rd, or stored
+	uint32_t flags;
+};
+
+class trace_recorder
+{
+	public:
+		static constexpr char magic[8] = { 'R', 'V', '3', '2', 'I', 'T', 'R', '1' };
+
+		// The instruction did not complete, it raised an access fault
+		static constexpr uint32_t flag_fault = 1;
+
+		trace_recorder(std::ostream &os, uint32_t mem_size, uint32_t mhartid);
+		virtual ~trace_recorder();
+
+		// The record to fill in for the next instruction
+		trace_record &next()
+		{
+			if(used == capacity)
+				spill();
+			return records[used++];
+		}
+
+		// Writes out every record so far
+		virtual void flush();
+
+		// Whether the records have to be made by tick(), with the
+		// hart's registers and counter up to date at every one. The
+		// faster engines only bring them up to date after each block.
+		virtual bool needs_tick() const { return false; }
+
+		// Reads the header of a trace. Returns false if it isn't one.
+		static bool read_header(std::istream &is, trace_header &h);
+
+	protected:
+		// For recorders that hand the records on some other way. They
+		// point records at their own buffer from spill().
+		trace_recorder() {}
+
+		// Called by next() when the buffer is full, to make room
+		virtual void spill() { flush(); }
+
+		trace_record *records = { nullptr };
+		size_t used = { 0 };
+		size_t capacity = { 0 };
+
+	private:
+		static constexpr size_t buffer_records = 1 << 16;
+
+		std::ostream *os = { nullptr };
+		std::vector<trace_record> buffer;
+};
+
+// Keeps only the records of the last n instructions, in a ring, so that
+// what led up to a crash can be shown without tracing the whole run
+class flight_recorder : public trace_recorder
+{
+	public:
+		flight_recorder(size_t n);
+
+		// There is nowhere to write the records to
+		void flush() override {}
+
+		// The number of records kept, and the i'th oldest of them
+		size_t size() const { return wrapped ? ring.size() : used; }
+		const trace_record &operator[](size_t i) const { return ring[wrapped ? (used + i) % ring.size() : i]; }
+
+	protected:
+		// Starts overwriting the oldest records
+		void spill() override { used = 0; wrapped = true; }
+
+	private:
+		std::vector<trace_record> ring;
+		bool wrapped = { false };
+};
+
+#endif
@@ -0,0 +1,30 @@
+#include <iostream>
+#include <fstream>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include "memory.h"
+#include "trace_replay.h"
+
+using namespace std;
+
+static void usage()
+{
+	cerr << "Usage: trace_render [-i] [-r] [-f first] [-n count] [-R full-dump-every] tracefile" << endl;
+	cerr << "    -f index of the first instruction to render (default = 0)" << endl;
+	cerr << "    -i render the instructions (default unless -r is given)" << endl;
+	cerr << "    -n number of instructions to render (default = all)" << endl;
+	cerr << "    -r render the registers before each instruction" << endl;
+	cerr << "    -R with -r, render only the pc and the registers written since the last dump, and all of them every n instructions" << endl;
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	render_options o;
+
+	if(!parse_render_options(argc, argv, o) || !render_trace(o, cout, cerr))
+		usage();
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+#include "trace_replay.h"
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * Replays every record of a trace, rendering the ones in a window
+ *
+ * The records before the window are still run, without rendering
+ * anything, to rebuild the registers. The window replaces any trace
+ * window set before, what is rendered in it is set up with
+ * set_show_instructions() and set_show_registers().
+ *
+ * @param is The trace, after its header
+ * @param first The index of the first record to render
+ * @param count The number of records to render
+ **************************************************************************/
+void trace_replay::run(std::istream &is, uint64_t first, uint64_t count)
+{
+	trace_window w;
+
+	w.kind = trace_window::insns;
+	w.first = first;
+	w.last = count == 0 || count - 1 > UINT64_MAX - first ? UINT64_MAX : first + count - 1;
+	set_trace_window(w);
+
+	regs.set(2, mem.get_size());
+
+	// Records outside the window run with unchecked loads and stores,
+	// the same as in cpu_single_hart::run()
+	const std::string hdr;
+	memory::fault_guard guard(mem);
+	if(sigsetjmp(guard.env, 0))
+		retry_access();
+
+	while(!is_halted() && (index < first || index - first < count) && is.read(reinterpret_cast<char*>(&rec), sizeof(rec)))
+	{
+		index++;
+		replay(rec, hdr);
+	}
+	flush_trace();
+}
+
+/**
+ * Renders a run of consecutive records
+ *
+ * The hart is put back into the state it was in before the first one,
+ * so any run of records can be rendered on its own, in any order.
+ *
+ * @param start The state of the hart before the first record
+ * @param recs The records
+ * @param n The number of records
+ * @param text Where to put the rendered text
+ **************************************************************************/
+void trace_replay::render(const trace_snapshot &start, const trace_record *recs, size_t n, std::string &text)
+{
+	reset();
+	for(uint32_t i = 1; i < 32; i++)
+		regs.set(i, start.regs[i]);
+	resume_dumps(start.insns, start.changed);
+	mem.set_warning_count(start.warnings);
+	mem.set_warning_writer(&trace_out);
+	trace_out.set_stream(nullptr);
+
+	// Without -i the untraced handlers are used, see run()
+	const std::string hdr;
+	index = 0;
+	memory::fault_guard guard(mem);
+	if(sigsetjmp(guard.env, 0))
+		retry_access();
+
+	while(!is_halted() && index < n)
+		replay(recs[index++], hdr);
+
+	mem.set_warning_writer(nullptr);
+	trace_out.drain(text);
+}
+
+/**
+ * Parses the command line of trace_render
+ *
+ * @param argc The number of arguments, with the program name first
+ * @param argv The arguments
+ * @param o Where to put the options and tracefile
+ *
+ * @return False if they are not valid
+ **************************************************************************/
+bool parse_render_options(int argc, char **argv, render_options &o)
+{
+	int opt;
+
+	// Starts getopt() over, it may have been used before
+	optind = 0;
+	opterr = 0;
+
+	try
+	{
+		while((opt = getopt(argc, argv, "f:n:R:ir")) != -1)
+		{
+			switch(opt)
+			{
+				case 'f':
+					o.first = std::stoull(optarg, nullptr, 0);
+					break;
+
+				case 'n':
+					o.count = std::stoull(optarg, nullptr, 0);
+					break;
+
+				case 'R':
+					o.register_delta = std::stoull(optarg, nullptr, 0);
+					break;
+
+				case 'i':
+					o.iflag = true;
+					break;
+
+				case 'r':
+					o.rflag = true;
+					break;
+
+				default:
+					return false;
+			}
+		}
+	}
+	catch(const std::logic_error &)
+	{
+		// A number that stoull() can't make sense of
+		return false;
+	}
+
+	if(optind >= argc)
+		return false;
+	o.trace_name = argv[optind];
+
+	if(!o.iflag && !o.rflag)
+		o.iflag = true;
+	return true;
+}
+
+/**
+ * Renders the records of a trace file
+ *
+ * @param o What to render, and from which file
+ * @param out Where to render them
+ * @param err Where to say why the trace can't be read
+ *
+ * @return False if the trace can't be read
+ **************************************************************************/
+bool render_trace(const render_options &o, std::ostream &out, std::ostream &err)
+{
+	std::ifstream is(o.trace_name, std::ios::binary);
+	trace_header h;
+
+	if(!is)
+	{
+		err << "Can't open file " << o.trace_name << " for reading" << endl;
+		return false;
+	}
+	if(!trace_recorder::read_header(is, h))
+	{
+		err << o.trace_name << " is not an rv32i trace" << endl;
+		return false;
+	}
+
+	// Out of range accesses were warned about when the trace was made
+	memory mem(h.mem_size);
+	mem.set_warning_limit(0);
+	mem.set_output(&out);
+
+	trace_replay replay(mem);
+	replay.set_output(&out);
+	replay.set_mhartid(h.mhartid);
+	replay.set_show_instructions(o.iflag);
+	replay.set_show_registers(o.rflag);
+	replay.set_register_delta(o.register_delta);
+	replay.run(is, o.first, o.count);
+	return true;
+}
@@ -0,0 +1,62 @@
+#ifndef TRACE_REPLAY_H
+#define TRACE_REPLAY_H
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include "memory.h"
+#include "rv32i_hart.h"
+#include "trace_recorder.h"
+
+// The state of a hart before a run of trace records, enough to render
+// them on their own
+struct trace_snapshot
+{
+	int32_t regs[32];
+	uint32_t changed;	// the registers written by the instruction before
+	uint64_t insns;		// the number of instructions run before
+	uint64_t warnings;	// the number of out of range accesses before
+};
+
+// Turns binary trace records back into the text that rv32i -i and -r
+// print, by running them again on a hart of its own
+class trace_replay : public rv32i_hart
+{
+	public:
+		trace_replay(memory &mem) : rv32i_hart(mem) {}
+
+		// Replays a whole trace from the start, rendering the records
+		// from first to first + count - 1 to the output
+		void run(std::istream &is, uint64_t first, uint64_t count);
+
+		// Renders a run of records that started from the state start,
+		// replacing text with what they print
+		void render(const trace_snapshot &start, const trace_record *recs, size_t n, std::string &text);
+
+	private:
+		// Kept out of run() and render() so they are still good after
+		// a fault jumps back into them
+		trace_record rec;
+		uint64_t index = { 0 };
+};
+
+// What trace_render is told on its command line
+struct render_options
+{
+	uint64_t first = { 0 };
+	uint64_t count = { UINT64_MAX };
+	uint64_t register_delta = { 0 };
+	bool iflag = { false };
+	bool rflag = { false };
+	std::string trace_name;
+};
+
+// Parses the options and tracefile of trace_render, -i is set when
+// neither -i nor -r is given. Returns false if they are not valid.
+bool parse_render_options(int argc, char **argv, render_options &o);
+
+// Renders a trace to out the way trace_render does. Returns false, after
+// saying why to err, if it isn't an rv32i trace that can be read.
+bool render_trace(const render_options &o, std::ostream &out, std::ostream &err);
+
+#endif
@@ -0,0 +1,215 @@
+#include "trace_writer.h"
+#include <cstring>
+
+using namespace std;
+
+const char trace_writer::hex_digits[513] =
+	"000102030405060708090a0b0c0d0e0f"
+	"101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f"
+	"303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f"
+	"505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f"
+	"707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f"
+	"909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/**
+ * Constructor
+ *
+ * The buffer is allocated up front. It is written out once it is more
+ * than half full at the end of a line, so the lines never make it grow.
+ *
+ * @param os The stream to write to, or nullptr to only collect the text
+ * @param size The size of the buffer
+ **************************************************************************/
+trace_writer::trace_writer(std::ostream *os, size_t size) : os(os), buf(size), flush_at(size / 2)
+{
+}
+
+/**
+ * Appends a string
+ *
+ * @param s The string to append
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::text(const char *s)
+{
+	return text(s, strlen(s));
+}
+
+trace_writer &trace_writer::text(const std::string &s)
+{
+	return text(s.data(), s.size());
+}
+
+trace_writer &trace_writer::text(const char *s, size_t len)
+{
+	room(len);
+	memcpy(&buf[used], s, len);
+	used += len;
+	return *this;
+}
+
+/**
+ * Appends a 32 bit value as 8 hex digits
+ *
+ * @param i The value to append
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::hex32(uint32_t i)
+{
+	room(8);
+	char *p = &buf[used];
+	memcpy(p, &hex_digits[2 * (i >> 24)], 2);
+	memcpy(p + 2, &hex_digits[2 * ((i >> 16) & 0xff)], 2);
+	memcpy(p + 4, &hex_digits[2 * ((i >> 8) & 0xff)], 2);
+	memcpy(p + 6, &hex_digits[2 * (i & 0xff)], 2);
+	used += 8;
+	return *this;
+}
+
+/**
+ * Appends a 32 bit value as 0x and 8 hex digits
+ *
+ * @param i The value to append
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::hex0x32(uint32_t i)
+{
+	return text("0x", 2).hex32(i);
+}
+
+/**
+ * Appends the upper 20 bits of a value as 0x and 5 hex digits
+ *
+ * @param i The value to append
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::hex0x20(uint32_t i)
+{
+	room(7);
+	char *p = &buf[used];
+	i >>= 12;
+	p[0] = '0';
+	p[1] = 'x';
+	p[2] = hex_digits[2 * (i >> 16) + 1];
+	memcpy(p + 3, &hex_digits[2 * ((i >> 8) & 0xff)], 2);
+	memcpy(p + 5, &hex_digits[2 * (i & 0xff)], 2);
+	used += 7;
+	return *this;
+}
+
+/**
+ * Appends the lower 12 bits of a value as 0x and 3 hex digits
+ *
+ * @param i The value to append
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::hex0x12(uint32_t i)
+{
+	room(5);
+	char *p = &buf[used];
+	i &= 0xfff;
+	p[0] = '0';
+	p[1] = 'x';
+	p[2] = hex_digits[2 * (i >> 8) + 1];
+	memcpy(p + 3, &hex_digits[2 * (i & 0xff)], 2);
+	used += 5;
+	return *this;
+}
+
+/**
+ * Appends a value in decimal
+ *
+ * @param i The value to append
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::dec(int64_t i)
+{
+	char digits[20];
+	int n = 0;
+	uint64_t u = i < 0 ? 0 - (uint64_t)i : i;
+
+	do
+	{
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while(u);
+
+	room(n + 1);
+	if(i < 0)
+		buf[used++] = '-';
+	while(n)
+		buf[used++] = digits[--n];
+	return *this;
+}
+
+/**
+ * Pads out a field with spaces
+ *
+ * @param start Where the field started, from mark()
+ * @param width The minimum width of the field
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::pad(size_t start, size_t width)
+{
+	if(used - start < width)
+	{
+		size_t n = width - (used - start);
+
+		room(n);
+		memset(&buf[used], ' ', n);
+		used += n;
+	}
+	return *this;
+}
+
+/**
+ * Ends the current line
+ *
+ * Unlike std::endl, this does not flush the stream. The buffer is only
+ * written out once it has filled past the halfway point.
+ *
+ * @return The writer
+ **************************************************************************/
+trace_writer &trace_writer::end_line()
+{
+	room(1);
+	buf[used++] = '\n';
+	if(os && used >= flush_at)
+		flush();
+	return *this;
+}
+
+/**
+ * Writes out everything in the buffer
+ **************************************************************************/
+void trace_writer::flush()
+{
+	if(!os || !used)
+		return;
+
+	if(lock)
+	{
+		std::lock_guard<std::mutex> l(*lock);
+		os->write(buf.data(), used);
+	}
+	else
+		os->write(buf.data(), used);
+	used = 0;
+}
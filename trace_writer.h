@@ -0,0 +1,79 @@
+#ifndef TRACE_WRITER_H
+#define TRACE_WRITER_H
+
+#include <stdint.h>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Formats trace output straight into a preallocated char buffer, which
+// is only written to the stream once it has filled up past a whole
+// number of lines, or when flush() is called. Anything else printed to
+// the same stream needs a flush() first to stay in order.
+//
+// A writer without a stream just grows, and str() returns what is in it.
+class trace_writer
+{
+	public:
+		static constexpr size_t default_size = 1 << 20;
+
+		trace_writer(std::ostream *os, size_t size = default_size);
+		~trace_writer() { flush(); }
+
+		trace_writer &text(const char *s);
+		trace_writer &text(const std::string &s);
+
+		// The same as hex::to_hex32(), to_hex0x32(), to_hex0x20() and
+		// to_hex0x12()
+		trace_writer &hex32(uint32_t i);
+		trace_writer &hex0x32(uint32_t i);
+		trace_writer &hex0x20(uint32_t i);
+		trace_writer &hex0x12(uint32_t i);
+
+		// The same as streaming i with std::dec
+		trace_writer &dec(int64_t i);
+
+		// Where the next character will go, for pad()
+		size_t mark() const { return used; }
+
+		// Pads with spaces until what has been written since start is
+		// at least width characters long, like std::setw with
+		// std::left
+		trace_writer &pad(size_t start, size_t width);
+
+		// Ends the line, and writes out the buffer if it is full
+		trace_writer &end_line();
+
+		void flush();
+
+		// Where flush() writes to, nullptr to only collect the text
+		void set_stream(std::ostream *s) { os = s; }
+
+		// Held while flush() writes, for a stream that writers on
+		// other threads print to as well. nullptr for none.
+		void set_lock(std::mutex *m) { lock = m; }
+
+		std::string str() const { return std::string(buf.data(), used); }
+
+		// Moves what has been written into s, leaving the writer
+		// empty
+		void drain(std::string &s) { s.assign(buf.data(), used); used = 0; }
+
+	private:
+		// Makes room for n more characters
+		void room(size_t n) { if(used + n > buf.size()) buf.resize(2 * (used + n)); }
+
+		trace_writer &text(const char *s, size_t len);
+
+		// "000102...feff", two digits for every byte value
+		static const char hex_digits[513];
+
+		std::ostream *os;
+		std::mutex *lock = { nullptr };
+		std::vector<char> buf;
+		size_t used = { 0 };
+		size_t flush_at;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#include "work_pool.h"
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+/**
+ * Runs the jobs across the threads
+ *
+ * @param jobs The number of jobs
+ * @param job Runs a job, on whichever thread it has been taken by
+ **************************************************************************/
+void work_pool::run(size_t jobs, const std::function<void(size_t)> &job)
+{
+	unsigned n = std::min<size_t>(threads, jobs ? jobs : 1);
+	std::vector<queue> queues(n);
+	std::vector<std::thread> workers;
+
+	for(unsigned id = 0; id < n; id++)
+		for(size_t i = jobs * id / n; i < jobs * (id + 1) / n; i++)
+			queues[id].jobs.push_back(i);
+
+	auto work = [this, &queues, &job](unsigned id)
+	{
+		size_t i;
+
+		while(next(queues, id, i))
+			job(i);
+	};
+
+	for(unsigned id = 1; id < n; id++)
+		workers.emplace_back(work, id);
+	work(0);
+
+	for(std::thread &t : workers)
+		t.join();
+}
+
+/**
+ * Takes the next job for a thread
+ *
+ * @param queues The deques of all of the threads
+ * @param id The thread
+ * @param job Where to put the job
+ *
+ * @return False if every deque is empty
+ **************************************************************************/
+bool work_pool::next(std::vector<queue> &queues, unsigned id, size_t &job)
+{
+	{
+		std::lock_guard<std::mutex> l(queues[id].lock);
+		if(!queues[id].jobs.empty())
+		{
+			job = queues[id].jobs.front();
+			queues[id].jobs.pop_front();
+			return true;
+		}
+	}
+
+	for(unsigned k = 1; k < queues.size(); k++)
+	{
+		queue &victim = queues[(id + k) % queues.size()];
+		std::lock_guard<std::mutex> l(victim.lock);
+
+		if(!victim.jobs.empty())
+		{
+			job = victim.jobs.back();
+			victim.jobs.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
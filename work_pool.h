@@ -0,0 +1,40 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stddef.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Runs a fixed set of jobs, numbered from 0, on a set of threads.
+//
+// Each thread starts out with an even, contiguous share of the jobs in
+// a deque of its own, and takes them from the front. Once its own have
+// run out it steals from the back of the others', so one long job
+// doesn't hold up the ones queued behind it. Nothing is added once the
+// jobs have started, so a thread is done when every deque is empty.
+class work_pool
+{
+	public:
+		work_pool(unsigned threads) : threads(threads ? threads : 1) {}
+
+		// Runs job(i) for every i below jobs, and returns once they
+		// have all finished. The calling thread is one of the threads.
+		void run(size_t jobs, const std::function<void(size_t)> &job);
+
+	private:
+		struct queue
+		{
+			std::mutex lock;
+			std::deque<size_t> jobs;
+		};
+
+		// The next job for thread id, its own or a stolen one. False
+		// when there are none left anywhere.
+		bool next(std::vector<queue> &queues, unsigned id, size_t &job);
+
+		unsigned threads;
+};
+
+#endif